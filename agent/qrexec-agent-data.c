@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
@@ -59,6 +60,7 @@ static volatile sig_atomic_t sigusr1 = 0;
  */
 int replace_chars_stdout = -1;
 int replace_chars_stderr = -1;
+bool client_threaded_io = false;
 
 static void sigchld_handler(int __attribute__((__unused__))x)
 {
@@ -181,29 +183,16 @@ static int handle_just_exec(struct qrexec_parsed_command *cmd)
  *  buffer_size is about vchan buffer allocated (only for vchan server cases),
  *  use 0 to use built-in default (64k); needs to be power of 2
  */
-static int handle_new_process_common(
-    int type, int connect_domain, int connect_port,
-    struct qrexec_parsed_command *cmd,
-    int buffer_size)
+static libvchan_t *connect_data_vchan(int connect_domain, int connect_port,
+                                     int *data_protocol_version)
 {
     libvchan_t *data_vchan;
-    int exit_code;
-    int data_protocol_version;
-    struct buffer stdin_buf;
-    struct process_io_request req = { 0 };
-    int stdin_fd, stdout_fd, stderr_fd;
     int wait_fd;
-    pid_t pid;
     /* TODO: consider env variable / cmdline option for this, until then make
      * the timeout generous as for example fresh DispVM may need some more time.
      */
     int connection_timeout = 120;
 
-    assert(type != MSG_SERVICE_CONNECT);
-
-    if (buffer_size == 0)
-        buffer_size = VCHAN_BUFFER_SIZE;
-
     data_vchan = libvchan_client_init_async(connect_domain, connect_port, &wait_fd);
     if (!data_vchan) {
         LOG(ERROR, "Data vchan connection failed");
@@ -214,14 +203,160 @@ static int handle_new_process_common(
         LOG(ERROR, "Data vchan connection failed");
         exit(1);
     }
-    data_protocol_version = handle_handshake(data_vchan);
-    if (data_protocol_version < 0) {
+    *data_protocol_version = handle_handshake(data_vchan);
+    if (*data_protocol_version < 0) {
         exit(1);
     }
+    return data_vchan;
+}
+
+/* Report a service that was not started to the client */
+static void send_start_failure(libvchan_t *data_vchan, int type, int exit_code)
+{
+    if (type == MSG_EXEC_CMDLINE) {
+        /* Send stdout+stderr EOF first, since the service is expected to send
+         * one before exit code in case of MSG_EXEC_CMDLINE. Ignore
+         * libvchan_send error if any, as we're going to terminate soon
+         * anyway.
+         */
+        struct msg_header hdr = { .type = MSG_DATA_STDOUT, .len = 0 };
+        libvchan_send(data_vchan, &hdr, sizeof(hdr));
+        hdr.type = MSG_DATA_STDERR;
+        libvchan_send(data_vchan, &hdr, sizeof(hdr));
+    }
+    send_exit_code(data_vchan, exit_code);
+}
+
+static uint64_t timeval_us(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        abort();
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Log the resources used by a finished call, and send them to qrexec-agent
+ * if usage_fd is not -1. */
+static void report_usage(const struct qrexec_parsed_command *cmd,
+                         pid_t pid, int exit_code, uint64_t wall_us,
+                         const struct rusage *rusage, int usage_fd)
+{
+    struct {
+        struct qrexec_service_usage usage;
+        char names[2 * QREXEC_SERVICE_USAGE_MAX_NAME];
+    } msg = {
+        .usage = {
+            .wall_us = wall_us,
+            .exit_code = exit_code,
+        },
+    };
+
+    if (pid > 0) {
+        msg.usage.user_us = timeval_us(&rusage->ru_utime);
+        msg.usage.system_us = timeval_us(&rusage->ru_stime);
+        msg.usage.max_rss_kib = (uint64_t)rusage->ru_maxrss;
+        msg.usage.blocks_in = (uint64_t)rusage->ru_inblock;
+        msg.usage.blocks_out = (uint64_t)rusage->ru_oublock;
+        LOG(INFO, "pid %d exited with %d after %.3f s (user %.3f s, system %.3f s, "
+            "max RSS %" PRIu64 " KiB, %" PRIu64 " blocks in, %" PRIu64 " blocks out)",
+            pid, exit_code, (double)wall_us / 1e6,
+            (double)msg.usage.user_us / 1e6, (double)msg.usage.system_us / 1e6,
+            msg.usage.max_rss_kib, msg.usage.blocks_in, msg.usage.blocks_out);
+    } else {
+        LOG(INFO, "Socket service closed after %.3f s", (double)wall_us / 1e6);
+    }
+
+    if (usage_fd < 0 || cmd->service_name == NULL || cmd->source_domain == NULL)
+        return;
+    size_t service_name_len = strlen(cmd->service_name);
+    size_t source_domain_len = strlen(cmd->source_domain);
+    if (service_name_len > QREXEC_SERVICE_USAGE_MAX_NAME ||
+            source_domain_len > QREXEC_SERVICE_USAGE_MAX_NAME)
+        return;
+    msg.usage.service_name_len = (uint16_t)service_name_len;
+    msg.usage.source_domain_len = (uint16_t)source_domain_len;
+    memcpy(msg.names, cmd->service_name, service_name_len);
+    memcpy(msg.names + service_name_len, cmd->source_domain, source_domain_len);
+    size_t len = sizeof(msg.usage) + service_name_len + source_domain_len;
+    /* qrexec-agent only counts the call, nothing to do if it is gone */
+    if (send(usage_fd, &msg, len, MSG_NOSIGNAL) != (ssize_t)len)
+        PERROR("Cannot send resource usage to qrexec-agent");
+}
+
+/* Start the service of a MSG_EXEC_CMDLINE call, and queue the initial data
+ * sent along with the request for its stdin. Returns 0, or the exit code to
+ * report to the client. */
+static int start_service(struct qrexec_parsed_command *cmd,
+                         const char *initial_stdin, size_t initial_stdin_len,
+                         pid_t *pid, int *stdin_fd, int *stdout_fd,
+                         int *stderr_fd, struct buffer *stdin_buf)
+{
+    int status;
+
+    buffer_init(stdin_buf);
+    if (cmd == NULL)
+        return QREXEC_EXIT_PROBLEM;
+    status = execute_parsed_qubes_rpc_command(cmd, pid, stdin_fd, stdout_fd,
+                                              stderr_fd, stdin_buf);
+    if (status == -1)
+        return QREXEC_EXIT_SERVICE_NOT_FOUND;
+    if (status != 0)
+        return QREXEC_EXIT_PROBLEM;
+    LOG(INFO, "executed: %s (pid %d)", cmd->cmdline, *pid);
+    /* after the service descriptor (if any) */
+    if (initial_stdin_len > 0)
+        buffer_append(stdin_buf, initial_stdin, (int)initial_stdin_len);
+    set_nonblock(*stdin_fd);
+    /* what does not fit, and errors, are handled by qrexec_process_io() */
+    flush_client_data(*stdin_fd, stdin_buf);
+    return 0;
+}
+
+static int handle_new_process_common(
+    int type, int connect_domain, int connect_port,
+    struct qrexec_parsed_command *cmd,
+    const char *initial_stdin, size_t initial_stdin_len,
+    int buffer_size, int usage_fd)
+{
+    libvchan_t *data_vchan;
+    int exit_code = QREXEC_EXIT_PROBLEM;
+    int data_protocol_version;
+    struct buffer stdin_buf;
+    struct process_io_request req = { 0 };
+    struct rusage rusage = { 0 };
+    int stdin_fd, stdout_fd, stderr_fd;
+    pid_t pid;
+    uint64_t start = 0;
+    /* With data sent along with the request, start the service before
+     * connecting the data vchan, so that it starts up and reads the data
+     * while the connection is being set up. Otherwise the client may never
+     * connect, so wait for it first. */
+    bool start_early = type == MSG_EXEC_CMDLINE && initial_stdin_len > 0;
+
+    assert(type != MSG_SERVICE_CONNECT);
+
+    if (buffer_size == 0)
+        buffer_size = VCHAN_BUFFER_SIZE;
 
     prepare_child_env();
     /* TODO: use setresuid to allow child process to actually send the signal? */
 
+    if (start_early) {
+        start = monotonic_us();
+        exit_code = start_service(cmd, initial_stdin, initial_stdin_len, &pid,
+                                  &stdin_fd, &stdout_fd, &stderr_fd,
+                                  &stdin_buf);
+    }
+
+    data_vchan = connect_data_vchan(connect_domain, connect_port,
+                                    &data_protocol_version);
+
     switch (type) {
         case MSG_JUST_EXEC:
             if (send_exit_code(data_vchan, handle_just_exec(cmd)) < 0)
@@ -229,31 +364,18 @@ static int handle_new_process_common(
             libvchan_close(data_vchan);
             return 0;
         case MSG_EXEC_CMDLINE:
-            exit_code = QREXEC_EXIT_PROBLEM;
-            buffer_init(&stdin_buf);
-            if (cmd != NULL) {
-                int status = execute_parsed_qubes_rpc_command(cmd, &pid, &stdin_fd, &stdout_fd, &stderr_fd, &stdin_buf);
-                if (status == -1)
-                    exit_code = QREXEC_EXIT_SERVICE_NOT_FOUND;
-                else if (status == 0)
-                    exit_code = 0;
+            if (!start_early) {
+                start = monotonic_us();
+                exit_code = start_service(cmd, initial_stdin,
+                                          initial_stdin_len, &pid, &stdin_fd,
+                                          &stdout_fd, &stderr_fd, &stdin_buf);
             }
             if (exit_code != 0) {
                 LOG(ERROR, "failed to spawn process");
-                /* Send stdout+stderr EOF first, since the service is expected to send
-                 * one before exit code in case of MSG_EXEC_CMDLINE. Ignore
-                 * libvchan_send error if any, as we're going to terminate soon
-                 * anyway.
-                 */
-                struct msg_header hdr = { .type = MSG_DATA_STDOUT, .len = 0 };
-                libvchan_send(data_vchan, &hdr, sizeof(hdr));
-                hdr.type = MSG_DATA_STDERR;
-                libvchan_send(data_vchan, &hdr, sizeof(hdr));
-                send_exit_code(data_vchan, exit_code);
+                send_start_failure(data_vchan, type, exit_code);
                 libvchan_close(data_vchan);
                 return exit_code;
             }
-            LOG(INFO, "executed: %s (pid %d)", cmd->cmdline, pid);
             break;
         default:
             LOG(ERROR, "unknown request type: %d", type);
@@ -281,14 +403,13 @@ static int handle_new_process_common(
     req.prefix_data.data = NULL;
     req.prefix_data.len = 0;
 
+    req.local_rusage = &rusage;
+
     exit_code = qrexec_process_io(&req, cmd);
 
-    if (type == MSG_EXEC_CMDLINE) {
-        if (pid > 0)
-            LOG(INFO, "pid %d exited with %d", pid, exit_code);
-        else
-            LOG(INFO, "Socket service closed");
-    }
+    if (type == MSG_EXEC_CMDLINE)
+        report_usage(cmd, pid, exit_code, monotonic_us() - start, &rusage,
+                     usage_fd);
 
     libvchan_close(data_vchan);
     return exit_code;
@@ -296,7 +417,9 @@ static int handle_new_process_common(
 
 /* Returns PID of data processing process */
 pid_t handle_new_process(int type, int connect_domain, int connect_port,
-                         struct qrexec_parsed_command *cmd)
+                         struct qrexec_parsed_command *cmd,
+                         const char *initial_stdin, size_t initial_stdin_len,
+                         int usage_fd)
 {
     int exit_code;
     pid_t pid;
@@ -314,16 +437,43 @@ pid_t handle_new_process(int type, int connect_domain, int connect_port,
 
     /* child process */
     exit_code = handle_new_process_common(type, connect_domain, connect_port,
-                                          cmd, 0);
+                                          cmd, initial_stdin, initial_stdin_len, 0,
+                                          usage_fd);
 
     exit(exit_code);
 }
 
+/* Returns PID of the process telling the client that the call was refused */
+pid_t handle_refused_process(int type, int connect_domain, int connect_port)
+{
+    libvchan_t *data_vchan;
+    int data_protocol_version;
+    pid_t pid;
+    assert(type != MSG_SERVICE_CONNECT);
+
+    switch (pid=fork()){
+        case -1:
+            PERROR("fork");
+            return -1;
+        case 0:
+            break;
+        default:
+            return pid;
+    }
+
+    /* child process */
+    data_vchan = connect_data_vchan(connect_domain, connect_port,
+                                    &data_protocol_version);
+    send_start_failure(data_vchan, type, QREXEC_EXIT_REQUEST_REFUSED);
+    libvchan_close(data_vchan);
+    exit(0);
+}
+
 /* Returns exit code of remote process */
 int handle_data_client(
     int type, int connect_domain, int connect_port,
     int stdin_fd, int stdout_fd, int buffer_size, pid_t pid,
-    const char *extra_data)
+    const char *extra_data, bool extra_data_sent)
 {
     int exit_code;
     int data_protocol_version;
@@ -370,11 +520,15 @@ int handle_data_client(
     req.replace_chars_stdout = replace_chars_stdout > 0;
     req.replace_chars_stderr = replace_chars_stderr > 0;
     req.data_protocol_version = data_protocol_version;
+    req.threaded_io = client_threaded_io;
 
     req.sigchld = &sigchld;
     req.sigusr1 = &sigusr1;
 
-    if (extra_data) {
+    /* The data sent together with the service request reaches the service
+     * only if the other side supports it too. */
+    if (extra_data && !(extra_data_sent &&
+                data_protocol_version >= QREXEC_PROTOCOL_V4)) {
         req.prefix_data.data = extra_data;
         req.prefix_data.len = strlen(extra_data);
     } else {
@@ -38,6 +38,8 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <limits.h>
+#include <inttypes.h>
+#include <time.h>
 #ifdef HAVE_PAM
 #include <security/pam_appl.h>
 #endif
@@ -51,15 +53,24 @@ struct connection_info {
     int fd;  /* socket to the process handling the data (wait for EOF here) */
     int connect_domain;
     int connect_port;
+    int limit; /* index in service_limits, -1 if not counted */
 };
 
 /* structure describing a single request waiting for qubes.WaitForSession to
- * finish */
+ * finish, or for a free instance of its service */
 struct waiting_request {
     int type;
-    int padding;
+    int limit; /* index in service_limits (queued requests only) */
     struct exec_params *params;
     struct qrexec_parsed_command *cmd;
+    size_t payload_len;
+};
+
+/* initial stdin data sent by qrexec-client-vm together with a service request */
+enum trigger_payload_state {
+    TRIGGER_PAYLOAD_NONE = 0, // no data sent
+    TRIGGER_PAYLOAD_DROPPED,  // qrexec-daemon does not support it
+    TRIGGER_PAYLOAD_SENT,     // passed to qrexec-daemon
 };
 
 /*  */
@@ -67,22 +78,88 @@ static struct connection_info connection_info[MAX_FDS];
 
 static struct waiting_request requests_waiting_for_session[MAX_FDS];
 
+/* indexed by qrexec-client-vm socket FD */
+static enum trigger_payload_state trigger_payload[MAX_FDS];
+
+/* service request sent by qrexec-client-vm, waiting for the answer */
+enum trigger_request_state {
+    TRIGGER_REQUEST_NONE = 0,  // no request, or not tracked (protocol < 5)
+    TRIGGER_REQUEST_PENDING,   // watching for qrexec-client-vm going away
+    TRIGGER_REQUEST_CANCELLED, // MSG_SERVICE_CANCEL sent
+};
+
+/* indexed by qrexec-client-vm socket FD; the FD is kept open until
+ * qrexec-daemon answers even for a cancelled request, so that the answer
+ * cannot reach a new client that got the same FD */
+static enum trigger_request_state trigger_requests[MAX_FDS];
+
+/* running and queued calls of a service with max-instances set */
+struct service_limit {
+    char *service_name; /* NULL for a free slot */
+    unsigned int running;
+    unsigned int queued;
+    /* counters since qrexec-agent start */
+    unsigned long started;
+    unsigned long delayed;
+    unsigned long refused;
+};
+
+static struct service_limit service_limits[MAX_FDS];
+
+/* resources used by the calls of a service since qrexec-agent start, as
+ * reported by the processes handling them, see struct qrexec_service_usage */
+struct service_usage {
+    char *service_name; /* NULL for a free slot */
+    unsigned long calls;
+    unsigned long failed;
+    uint64_t wall_us;
+    uint64_t user_us;
+    uint64_t system_us;
+    uint64_t max_rss_kib; /* of the largest call */
+    uint64_t blocks_in;
+    uint64_t blocks_out;
+};
+
+static struct service_usage service_usage[MAX_FDS];
+
+/* one JSON object per finished call is appended here, -1 if disabled */
+static int usage_log_fd = -1;
+
+/* requests waiting for a free instance of their service, oldest first */
+static struct waiting_request queued_requests[MAX_FDS];
+static int queued_requests_count;
+
 static libvchan_t *ctrl_vchan;
 
+/* control messages waiting for space in the vchan ring */
+static struct vchan_queue ctrl_queue;
+
+static int ctrl_ring_size = VCHAN_CTRL_RING_SIZE;
+
+static int ctrl_protocol_version;
+
 static pid_t wait_for_session_pid = -1;
 
 static int trigger_fd;
 
 static int terminate_requested;
 
+static volatile sig_atomic_t usage_dump_requested;
+
 static int meminfo_write_started = 0;
 
 static const char *agent_trigger_path = QREXEC_AGENT_TRIGGER_PATH;
 static const char *fork_server_path = QREXEC_FORK_SERVER_SOCKET;
 
+static bool handle_server_exec_request_limited(int type,
+                                               struct qrexec_parsed_command *cmd,
+                                               struct exec_params *params,
+                                               size_t payload_len);
 static void handle_server_exec_request_do(int type,
                                           struct qrexec_parsed_command *cmd,
-                                          struct exec_params *params);
+                                          struct exec_params *params,
+                                          size_t payload_len,
+                                          int limit);
 static void terminate_connection(uint32_t domain, uint32_t port);
 
 const bool qrexec_is_fork_server = false;
@@ -265,6 +342,8 @@ _Noreturn void do_exec(const char *cmd, const char *user)
         case 0:
             /* child */
 
+            /* pam_systemd may have moved us to the session scope */
+            qrexec_rejoin_service_cgroup();
             if (setgid (pw->pw_gid))
                 _exit(QREXEC_EXIT_PROBLEM);
             if (setuid (pw->pw_uid))
@@ -373,10 +452,12 @@ static void init(void)
 {
     mode_t old_umask;
     /* FIXME: This 0 is remote domain ID */
-    ctrl_vchan = libvchan_server_init(0, VCHAN_BASE_PORT, 4096, 4096);
+    ctrl_vchan = libvchan_server_init(0, VCHAN_BASE_PORT,
+                                      ctrl_ring_size, ctrl_ring_size);
     if (!ctrl_vchan)
         handle_vchan_error("server_init");
-    if (handle_handshake(ctrl_vchan) < 0)
+    ctrl_protocol_version = handle_handshake(ctrl_vchan);
+    if (ctrl_protocol_version < 0)
         exit(1);
     old_umask = umask(0);
     trigger_fd = get_server_socket(agent_trigger_path);
@@ -425,7 +506,8 @@ static void wake_meminfo_writer(void)
 }
 
 static int try_fork_server(int type, int connect_domain, int connect_port,
-        const char *cmdline, size_t cmdline_len, const char *username) {
+        const char *cmdline, size_t cmdline_len, size_t payload_len,
+        const char *username) {
     char *colon;
     char *fork_server_socket_path;
     int s = -1;
@@ -434,7 +516,7 @@ static int try_fork_server(int type, int connect_domain, int connect_port,
     if (!fork_server_path)
         return -1;
 
-    if (cmdline_len > MAX_QREXEC_CMD_LEN)
+    if (cmdline_len + payload_len > MAX_QREXEC_CMD_LEN)
         return -1;
     colon = strchr(cmdline, ':');
     if (!colon)
@@ -469,7 +551,8 @@ static int try_fork_server(int type, int connect_domain, int connect_port,
     size_t username_len = (size_t)(colon - cmdline);
     assert(cmdline_len <= INT_MAX);
     assert(cmdline_len > username_len);
-    info.cmdline_len = (int)(cmdline_len - (username_len + 1));
+    info.cmdline_len = (int)(cmdline_len + payload_len - (username_len + 1));
+    info.payload_len = (unsigned int)payload_len;
     if (!write_all(s, &info, sizeof(info))) {
         PERROR("write");
         goto fail;
@@ -487,7 +570,8 @@ fail:
 }
 
 
-static void register_vchan_connection(pid_t pid, int fd, int domain, int port)
+static void register_vchan_connection(pid_t pid, int fd, int domain, int port,
+                                      int limit)
 {
     int i;
 
@@ -497,11 +581,36 @@ static void register_vchan_connection(pid_t pid, int fd, int domain, int port)
             connection_info[i].fd = fd;
             connection_info[i].connect_domain = domain;
             connection_info[i].connect_port = port;
+            connection_info[i].limit = limit;
             return;
         }
     }
 
     LOG(ERROR, "No free slot for child %d (connection to %d:%d)", pid, domain, port);
+    if (limit >= 0)
+        service_limits[limit].running--;
+}
+
+/* Find the limit slot of a service, allocating it on first use. Returns -1 if
+ * there are no free slots. */
+static int find_service_limit(const char *service_name)
+{
+    int free_slot = -1;
+
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (service_limits[i].service_name == NULL) {
+            if (free_slot < 0)
+                free_slot = i;
+        } else if (strcmp(service_limits[i].service_name, service_name) == 0) {
+            return i;
+        }
+    }
+    if (free_slot < 0)
+        return -1;
+    service_limits[free_slot].service_name = strdup(service_name);
+    if (service_limits[free_slot].service_name == NULL)
+        return -1;
+    return free_slot;
 }
 
 /* Check if requested command/service require GUI session and if so, initiate
@@ -560,15 +669,26 @@ static void handle_server_exec_request_init(struct msg_header *hdr)
 {
     struct qrexec_parsed_command *cmd;
     struct exec_params *params;
+    size_t payload_len = 0;
     if (hdr->len <= sizeof(*params) || hdr->len > (uint32_t)INT_MAX)
         handle_vchan_error("buffer size validation");
     size_t buf_len = hdr->len - sizeof(*params);
     params = malloc(hdr->len);
     if (params == NULL)
         handle_vchan_error("buffer alloc");
-    if (libvchan_recv(ctrl_vchan, params, hdr->len) != (int)hdr->len)
+    /* the command line may be larger than the ring */
+    if (!read_vchan_all(ctrl_vchan, params, hdr->len))
         handle_vchan_error("read exec params");
-    params->cmdline[buf_len - 1] = 0;
+    qrexec_trace_payload(params, hdr->len);
+    if (hdr->type == MSG_EXEC_CMDLINE &&
+            ctrl_protocol_version >= QREXEC_PROTOCOL_V4) {
+        /* initial stdin data may follow the command line */
+        const char *nul = memchr(params->cmdline, 0, buf_len);
+        if (nul)
+            payload_len = buf_len - (size_t)(nul - params->cmdline) - 1;
+    }
+    if (payload_len == 0)
+        params->cmdline[buf_len - 1] = 0;
 
     if (hdr->type == MSG_SERVICE_CONNECT) {
         cmd = NULL;
@@ -602,6 +722,7 @@ static void handle_server_exec_request_init(struct msg_header *hdr)
                     requests_waiting_for_session[slot_index].type = hdr->type;
                     requests_waiting_for_session[slot_index].params = params;
                     requests_waiting_for_session[slot_index].cmd = cmd;
+                    requests_waiting_for_session[slot_index].payload_len = payload_len;
                     /* nothing to do now, when we get GUI session, we'll continue */
                     return;
                 }
@@ -610,18 +731,107 @@ static void handle_server_exec_request_init(struct msg_header *hdr)
     }
 
 doit:
-    handle_server_exec_request_do(hdr->type, cmd, params);
+    if (handle_server_exec_request_limited(hdr->type, cmd, params, payload_len))
+        return;
     destroy_qrexec_parsed_command(cmd);
     free(params);
 }
 
+/* Start the request, unless its service has max-instances calls running
+ * already. Returns true if the request was queued instead; cmd and params are
+ * then owned by the queue. */
+static bool handle_server_exec_request_limited(int type,
+                                               struct qrexec_parsed_command *cmd,
+                                               struct exec_params *params,
+                                               size_t payload_len)
+{
+    struct service_limit *sl;
+    pid_t child_agent;
+    int limit = -1;
+
+    if (type == MSG_SERVICE_CONNECT || cmd == NULL ||
+            cmd->service_name == NULL || cmd->max_instances == 0)
+        goto start;
+
+    limit = find_service_limit(cmd->service_name);
+    if (limit < 0) {
+        LOG(WARNING, "No free slots for limiting calls of %s, continuing!",
+            cmd->service_name);
+        goto start;
+    }
+    sl = &service_limits[limit];
+    /* earlier queued calls go first */
+    if (sl->running < cmd->max_instances && sl->queued == 0) {
+        sl->running++;
+        sl->started++;
+        goto start;
+    }
+
+    if (sl->queued < cmd->max_queued && queued_requests_count < MAX_FDS) {
+        queued_requests[queued_requests_count++] = (struct waiting_request) {
+            .type = type,
+            .limit = limit,
+            .params = params,
+            .cmd = cmd,
+            .payload_len = payload_len,
+        };
+        sl->queued++;
+        sl->delayed++;
+        LOG(INFO, "Queued call to %s: %u running, %u queued (%lu delayed in total)",
+            cmd->service_name, sl->running, sl->queued, sl->delayed);
+        return true;
+    }
+
+    sl->refused++;
+    LOG(WARNING, "Refusing call to %s: %u running, %u queued (%lu refused in total)",
+        cmd->service_name, sl->running, sl->queued, sl->refused);
+    child_agent = handle_refused_process(type,
+            params->connect_domain, params->connect_port);
+    register_vchan_connection(child_agent, -1,
+            params->connect_domain, params->connect_port, -1);
+    return false;
+
+start:
+    handle_server_exec_request_do(type, cmd, params, payload_len, limit);
+    return false;
+}
+
+/* Start queued requests whose service has a free instance now */
+static void start_queued_requests(void)
+{
+    int i = 0;
+
+    while (i < queued_requests_count) {
+        struct waiting_request req = queued_requests[i];
+        struct service_limit *sl = &service_limits[req.limit];
+
+        if (sl->running >= req.cmd->max_instances) {
+            i++;
+            continue;
+        }
+        memmove(&queued_requests[i], &queued_requests[i + 1],
+                (size_t)(queued_requests_count - i - 1) * sizeof(queued_requests[0]));
+        queued_requests_count--;
+        sl->queued--;
+        sl->running++;
+        sl->started++;
+        handle_server_exec_request_do(req.type, req.cmd, req.params,
+                                      req.payload_len, req.limit);
+        destroy_qrexec_parsed_command(req.cmd);
+        free(req.params);
+    }
+}
+
 static void handle_server_exec_request_do(int type,
                                           struct qrexec_parsed_command *cmd,
-                                          struct exec_params *params) {
+                                          struct exec_params *params,
+                                          size_t payload_len,
+                                          int limit) {
     int client_fd;
     pid_t child_agent;
     const char *cmdline = params->cmdline;
     size_t cmdline_len = strlen(cmdline) + 1; // size of cmdline, including \0 at the end
+    const char *payload = cmdline + cmdline_len;
 
     if (type == MSG_SERVICE_CONNECT) {
         if (sscanf(cmdline, "SOCKET%d", &client_fd) != 1)
@@ -637,6 +847,16 @@ static void handle_server_exec_request_do(int type,
                 goto bad_ident;
             /* ignore other errors */
         }
+        if (client_fd >= 0 && client_fd < MAX_FDS)
+            trigger_requests[client_fd] = TRIGGER_REQUEST_NONE;
+        if (client_fd >= 0 && client_fd < MAX_FDS &&
+                trigger_payload[client_fd] != TRIGGER_PAYLOAD_NONE) {
+            /* tell the client if it still needs to send the initial data */
+            uint32_t payload_sent = trigger_payload[client_fd] == TRIGGER_PAYLOAD_SENT;
+            if (write(client_fd, &payload_sent, sizeof(payload_sent)) < 0)
+                PERROR("write");
+            trigger_payload[client_fd] = TRIGGER_PAYLOAD_NONE;
+        }
         /* No need to send request_id (buf) - the client don't need it, there
          * is only meaningless (for the client) socket FD */
         /* Register connection even if there was an error sending params to
@@ -644,7 +864,7 @@ static void handle_server_exec_request_do(int type,
          * (close socket, send MSG_CONNECTION_TERMINATED) when qrexec-client-vm
          * will close the socket (terminate itself). */
         register_vchan_connection(-1, client_fd,
-                params->connect_domain, params->connect_port);
+                params->connect_domain, params->connect_port, -1);
         return;
     }
 
@@ -653,21 +873,45 @@ static void handle_server_exec_request_do(int type,
         /* try fork server */
         int child_socket = try_fork_server(type,
                 params->connect_domain, params->connect_port,
-                cmdline, cmdline_len, cmd->username);
+                cmdline, cmdline_len, payload_len, cmd->username);
         if (child_socket >= 0) {
             register_vchan_connection(-1, child_socket,
-                    params->connect_domain, params->connect_port);
+                    params->connect_domain, params->connect_port, limit);
             return;
         }
     }
 
-    /* No fork server case */
+    /* No fork server case; like with the fork server, the end of the call
+     * is noticed on a socket, which also carries its resource usage.  Only
+     * MSG_EXEC_CMDLINE reports usage; a MSG_JUST_EXEC command outlives its
+     * call, and must not keep the call (and its slot) open through the
+     * socket, so that one is waited for by PID as before. */
+    int usage_socket[2] = { -1, -1 };
+    if (type == MSG_EXEC_CMDLINE &&
+            socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, usage_socket)) {
+        PERROR("socketpair");
+        usage_socket[0] = usage_socket[1] = -1;
+    }
     child_agent = handle_new_process(type,
             params->connect_domain, params->connect_port,
-            cmd);
+            cmd, payload, payload_len, usage_socket[1]);
+    if (usage_socket[1] >= 0)
+        close(usage_socket[1]);
+    if (child_agent < 0 && limit >= 0) {
+        /* not running, so do not count it */
+        service_limits[limit].running--;
+        limit = -1;
+    }
 
+    if (child_agent >= 0 && usage_socket[0] >= 0) {
+        register_vchan_connection(-1, usage_socket[0],
+                params->connect_domain, params->connect_port, limit);
+        return;
+    }
+    if (usage_socket[0] >= 0)
+        close(usage_socket[0]);
     register_vchan_connection(child_agent, -1,
-            params->connect_domain, params->connect_port);
+            params->connect_domain, params->connect_port, limit);
     return;
 bad_ident:
     LOG(ERROR, "Got MSG_SERVICE_CONNECT from qrexec-daemon with invalid ident (%s), ignoring",
@@ -686,10 +930,15 @@ static void handle_service_refused(struct msg_header *hdr)
 
     if (libvchan_recv(ctrl_vchan, &params, sizeof(params)) != sizeof(params))
         handle_vchan_error("read exec params");
+    qrexec_trace_payload(&params, sizeof(params));
 
-    if (sscanf(params.ident, "SOCKET%d", &socket_fd))
+    if (sscanf(params.ident, "SOCKET%d", &socket_fd)) {
+        if (socket_fd >= 0 && socket_fd < MAX_FDS) {
+            trigger_payload[socket_fd] = TRIGGER_PAYLOAD_NONE;
+            trigger_requests[socket_fd] = TRIGGER_REQUEST_NONE;
+        }
         close(socket_fd);
-    else
+    } else
         LOG(WARNING, "Received REFUSED for unknown service request '%s'", params.ident);
 }
 
@@ -699,6 +948,7 @@ static void handle_server_cmd(void)
 
     if (libvchan_recv(ctrl_vchan, &s_hdr, sizeof(s_hdr)) != sizeof(s_hdr))
         handle_vchan_error("read s_hdr");
+    qrexec_trace_start(&s_hdr);
 
     //      fprintf(stderr, "got %x %x %x\n", s_hdr.type, s_hdr.client_id,
     //              s_hdr.len);
@@ -718,6 +968,7 @@ static void handle_server_cmd(void)
                 s_hdr.type);
             exit(1);
     }
+    qrexec_trace_end();
 }
 
 static volatile sig_atomic_t child_exited;
@@ -733,6 +984,11 @@ static void sigterm_handler(int x __attribute__((__unused__)))
     terminate_requested = 1;
 }
 
+static void sigusr2_handler(int x __attribute__((__unused__)))
+{
+    usage_dump_requested = 1;
+}
+
 static int find_connection(int pid)
 {
     int i;
@@ -746,6 +1002,11 @@ static void release_connection(int id) {
     terminate_connection(connection_info[id].connect_domain,
                          connection_info[id].connect_port);
     connection_info[id].pid = 0;
+    if (connection_info[id].limit >= 0) {
+        /* queued calls are started from the main loop */
+        service_limits[connection_info[id].limit].running--;
+        connection_info[id].limit = -1;
+    }
 }
 
 static void terminate_connection(uint32_t domain, uint32_t port) {
@@ -762,8 +1023,7 @@ static void terminate_connection(uint32_t domain, uint32_t port) {
             .connect_port = port,
         },
     };
-    if (libvchan_send(ctrl_vchan, &data, sizeof(data)) != sizeof(data))
-        handle_vchan_error("send (MSG_CONNECTION_TERMINATED)");
+    vchan_queue_append(&ctrl_queue, &data, sizeof(data));
 }
 
 static void reap_children(void)
@@ -776,13 +1036,15 @@ static void reap_children(void)
             for (id = 0; id < MAX_FDS; id++) {
                 if (!requests_waiting_for_session[id].params)
                     continue;
-                handle_server_exec_request_do(
+                if (!handle_server_exec_request_limited(
                         requests_waiting_for_session[id].type,
                         requests_waiting_for_session[id].cmd,
-                        requests_waiting_for_session[id].params);
-                destroy_qrexec_parsed_command(requests_waiting_for_session[id].cmd);
+                        requests_waiting_for_session[id].params,
+                        requests_waiting_for_session[id].payload_len)) {
+                    destroy_qrexec_parsed_command(requests_waiting_for_session[id].cmd);
+                    free(requests_waiting_for_session[id].params);
+                }
                 requests_waiting_for_session[id].cmd = NULL;
-                free(requests_waiting_for_session[id].params);
                 requests_waiting_for_session[id].params = NULL;
             }
             wait_for_session_pid = -1;
@@ -809,7 +1071,7 @@ static void handle_trigger_io(void)
         goto error;
     if (hdr.type != MSG_TRIGGER_SERVICE3 ||
             hdr.len <= sizeof(*params) ||
-            hdr.len > sizeof(*params) + MAX_SERVICE_NAME_LEN) {
+            hdr.len > sizeof(*params) + MAX_SERVICE_NAME_LEN + MAX_INLINE_PAYLOAD) {
         LOG(ERROR, "Invalid request received from qrexec-client-vm, is it outdated?");
         goto error;
     }
@@ -819,13 +1081,37 @@ static void handle_trigger_io(void)
     if (!read_all(client_fd, params, hdr.len))
         goto error;
 
+    /* the service name may be followed by initial stdin data; a missing NUL
+     * terminator is left for qrexec-daemon to reject */
+    size_t service_name_size = hdr.len - sizeof(*params);
+    size_t service_name_len = strnlen(params->service_name, service_name_size);
+    size_t payload_len = service_name_len < service_name_size ?
+                         service_name_size - service_name_len - 1 : 0;
+    if (client_fd < MAX_FDS)
+        trigger_payload[client_fd] = TRIGGER_PAYLOAD_NONE;
+    if (payload_len > 0) {
+        if (payload_len > MAX_INLINE_PAYLOAD ||
+                service_name_len > MAX_SERVICE_NAME_LEN ||
+                client_fd >= MAX_FDS) {
+            LOG(ERROR, "Invalid initial data received from qrexec-client-vm");
+            goto error;
+        }
+        if (ctrl_protocol_version >= QREXEC_PROTOCOL_V4) {
+            trigger_payload[client_fd] = TRIGGER_PAYLOAD_SENT;
+        } else {
+            /* qrexec-client-vm will send it over the data connection */
+            trigger_payload[client_fd] = TRIGGER_PAYLOAD_DROPPED;
+            hdr.len -= payload_len;
+        }
+    }
+
     int res = snprintf(params->request_id.ident, sizeof(params->request_id), "SOCKET%d", client_fd);
     if (res < 0 || res >= (int)sizeof(params->request_id))
         abort();
-    if (libvchan_send(ctrl_vchan, &hdr, sizeof(hdr)) != sizeof(hdr))
-        handle_vchan_error("write hdr");
-    if (libvchan_send(ctrl_vchan, params, hdr.len) != (int)hdr.len)
-        handle_vchan_error("write params");
+    vchan_queue_append(&ctrl_queue, &hdr, sizeof(hdr));
+    vchan_queue_append(&ctrl_queue, params, hdr.len);
+    if (client_fd < MAX_FDS && ctrl_protocol_version >= QREXEC_PROTOCOL_V5)
+        trigger_requests[client_fd] = TRIGGER_REQUEST_PENDING;
 
     free(params);
     /* do not close client_fd - we'll need it to send the connection details
@@ -837,13 +1123,169 @@ error:
     close(client_fd);
 }
 
-static void handle_terminated_fork_client(int id) {
-    ssize_t ret;
-    char buf[2];
+/* qrexec-client-vm went away before its request was answered */
+static void cancel_trigger_request(int client_fd)
+{
+    struct msg_header hdr = {
+        .type = MSG_SERVICE_CANCEL,
+        .len = sizeof(struct service_params),
+    };
+    struct service_params params = { 0 };
+
+    int res = snprintf(params.ident, sizeof(params.ident), "SOCKET%d", client_fd);
+    if (res < 0 || res >= (int)sizeof(params.ident))
+        abort();
+    vchan_queue_append(&ctrl_queue, &hdr, sizeof(hdr));
+    vchan_queue_append(&ctrl_queue, &params, sizeof(params));
+    trigger_requests[client_fd] = TRIGGER_REQUEST_CANCELLED;
+}
+
+/* Names come from a process that may run as the user (qrexec-fork-server),
+ * do not let them mess up the log. */
+static bool valid_usage_name(const char *name, size_t len)
+{
+    if (len == 0)
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '.' || c == '_' ||
+                    c == '-' || c == '+' || c == '@' || c == ':'))
+            return false;
+    }
+    return true;
+}
+
+static int find_service_usage(const char *service_name, size_t len)
+{
+    int free_slot = -1;
+
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (service_usage[i].service_name == NULL) {
+            if (free_slot < 0)
+                free_slot = i;
+        } else if (strncmp(service_usage[i].service_name, service_name, len) == 0 &&
+                   service_usage[i].service_name[len] == '\0') {
+            return i;
+        }
+    }
+    if (free_slot < 0)
+        return -1;
+    service_usage[free_slot].service_name = strndup(service_name, len);
+    if (service_usage[free_slot].service_name == NULL)
+        return -1;
+    return free_slot;
+}
+
+static void log_usage(const struct qrexec_service_usage *usage,
+                      const char *service_name, const char *source_domain)
+{
+    char line[1024];
+    int len = snprintf(line, sizeof(line),
+            "{\"time\": %lld, \"service\": \"%.*s\", \"source\": \"%.*s\", "
+            "\"exit_code\": %" PRId32 ", \"wall_us\": %" PRIu64 ", "
+            "\"user_us\": %" PRIu64 ", \"system_us\": %" PRIu64 ", "
+            "\"max_rss_kib\": %" PRIu64 ", \"blocks_in\": %" PRIu64 ", "
+            "\"blocks_out\": %" PRIu64 "}\n",
+            (long long)time(NULL),
+            (int)usage->service_name_len, service_name,
+            (int)usage->source_domain_len, source_domain,
+            usage->exit_code, usage->wall_us, usage->user_us,
+            usage->system_us, usage->max_rss_kib, usage->blocks_in,
+            usage->blocks_out);
+
+    assert(len > 0 && (size_t)len < sizeof(line));
+    /* a single write, so that lines are not mixed up */
+    if (write(usage_log_fd, line, (size_t)len) != len)
+        PERROR("write to usage log");
+}
+
+/* Count a finished call, reported by the process that handled it */
+static void account_usage(const struct qrexec_service_usage *usage,
+                          const char *names)
+{
+    const char *service_name = names;
+    const char *source_domain = names + usage->service_name_len;
+    struct service_usage *total;
+    int i;
 
-    ret = read(connection_info[id].fd, buf, sizeof(buf));
-    if (!(ret == 0 || (ret == -1 && errno == ECONNRESET)))
-        PERROR("Unexpected read on fork-server connection: %zd", ret);
+    if (!valid_usage_name(service_name, usage->service_name_len) ||
+            !valid_usage_name(source_domain, usage->source_domain_len)) {
+        LOG(ERROR, "Invalid service name or source in resource usage, ignoring");
+        return;
+    }
+    if (usage_log_fd >= 0)
+        log_usage(usage, service_name, source_domain);
+
+    i = find_service_usage(service_name, usage->service_name_len);
+    if (i < 0) {
+        LOG(WARNING, "No free slots for resource usage of %.*s",
+            (int)usage->service_name_len, service_name);
+        return;
+    }
+    total = &service_usage[i];
+    total->calls++;
+    if (usage->exit_code != 0)
+        total->failed++;
+    total->wall_us += usage->wall_us;
+    total->user_us += usage->user_us;
+    total->system_us += usage->system_us;
+    if (usage->max_rss_kib > total->max_rss_kib)
+        total->max_rss_kib = usage->max_rss_kib;
+    total->blocks_in += usage->blocks_in;
+    total->blocks_out += usage->blocks_out;
+}
+
+static int compare_usage_cpu(const void *a, const void *b)
+{
+    const struct service_usage *x = *(const struct service_usage *const *)a;
+    const struct service_usage *y = *(const struct service_usage *const *)b;
+    uint64_t cpu_x = x->user_us + x->system_us;
+    uint64_t cpu_y = y->user_us + y->system_us;
+
+    return cpu_x < cpu_y ? 1 : cpu_x > cpu_y ? -1 : 0;
+}
+
+/* Log the resource usage of every service, the most CPU-hungry first */
+static void dump_usage(void)
+{
+    struct service_usage *sorted[MAX_FDS];
+    size_t count = 0;
+
+    usage_dump_requested = 0;
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (service_usage[i].service_name != NULL)
+            sorted[count++] = &service_usage[i];
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_usage_cpu);
+    LOG(INFO, "Resource usage of %zu services since start:", count);
+    for (size_t i = 0; i < count; i++) {
+        const struct service_usage *u = sorted[i];
+        LOG(INFO, "%s: %lu calls (%lu failed), %.3f s wall, %.3f s user, "
+            "%.3f s system, max RSS %" PRIu64 " KiB, %" PRIu64 " blocks in, "
+            "%" PRIu64 " blocks out",
+            u->service_name, u->calls, u->failed, (double)u->wall_us / 1e6,
+            (double)u->user_us / 1e6, (double)u->system_us / 1e6,
+            u->max_rss_kib, u->blocks_in, u->blocks_out);
+    }
+}
+
+static void handle_terminated_data_process(int id) {
+    ssize_t ret;
+    struct {
+        struct qrexec_service_usage usage;
+        char names[2 * QREXEC_SERVICE_USAGE_MAX_NAME];
+    } msg;
+
+    /* the process handling the call sends its resource usage (if any)
+     * last, just before it exits */
+    ret = read(connection_info[id].fd, &msg, sizeof(msg));
+    if (ret >= (ssize_t)sizeof(msg.usage) &&
+            (size_t)ret == sizeof(msg.usage) + msg.usage.service_name_len +
+                           msg.usage.source_domain_len)
+        account_usage(&msg.usage, msg.names);
+    else if (!(ret == 0 || (ret == -1 && errno == ECONNRESET)))
+        PERROR("Unexpected read on connection to the process handling a call: %zd", ret);
     close(connection_info[id].fd);
     release_connection(id);
 }
@@ -853,6 +1295,8 @@ static struct option longopts[] = {
     { "agent-socket", required_argument, 0, 'a' },
     { "fork-server-socket", optional_argument, 0, 's' },
     { "no-fork-server", no_argument, 0, 'S' },
+    { "control-ring-size", required_argument, 0, 'r' },
+    { "usage-log", required_argument, 0, 'u' },
     { NULL, 0, 0, 0 },
 };
 
@@ -867,6 +1311,10 @@ static _Noreturn void usage(const char *argv0)
             QREXEC_FORK_SERVER_SOCKET);
     fprintf(stderr, "    (set empty to disable, use %%s as username)\n");
     fprintf(stderr, "  --no-fork-server - don't try to connect to fork server\n");
+    fprintf(stderr, "  --control-ring-size=BYTES - size of each direction of the control vchan ring, default: %d\n",
+            VCHAN_CTRL_RING_SIZE);
+    fprintf(stderr, "  --usage-log=PATH - append the resource usage of every finished service call to PATH\n");
+    fprintf(stderr, "    (a JSON object per line); SIGUSR2 logs the usage of each service in total\n");
     exit(2);
 }
 
@@ -875,10 +1323,11 @@ int main(int argc, char **argv)
     sigset_t selectmask;
 
     setup_logging("qrexec-agent");
+    qrexec_trace_init("qrexec-agent");
 
     int opt;
     while (1) {
-        opt = getopt_long(argc, argv, "ha:s:S", longopts, NULL);
+        opt = getopt_long(argc, argv, "ha:s:Sr:u:", longopts, NULL);
         if (opt == -1)
             break;
         switch (opt) {
@@ -891,6 +1340,29 @@ int main(int argc, char **argv)
             case 'S':
                 fork_server_path = NULL;
                 break;
+            case 'r': {
+                char *end;
+                long size;
+
+                errno = 0;
+                size = strtol(optarg, &end, 10);
+                /* a single control message must fit in the ring */
+                if (errno || *end || end == optarg ||
+                        size < VCHAN_CTRL_RING_SIZE || size > (1 << 24)) {
+                    LOG(ERROR, "Invalid control ring size: %s", optarg);
+                    usage(argv[0]);
+                }
+                ctrl_ring_size = (int)size;
+                break;
+            }
+            case 'u':
+                usage_log_fd = open(optarg, O_WRONLY | O_APPEND | O_CREAT |
+                                    O_CLOEXEC | O_NOCTTY, 0640);
+                if (usage_log_fd < 0) {
+                    PERROR("open %s", optarg);
+                    exit(1);
+                }
+                break;
             case 'h':
             case '?':
                 usage(argv[0]);
@@ -906,6 +1378,8 @@ int main(int argc, char **argv)
     sigaction(SIGCHLD, &action, NULL);
     action.sa_handler = sigterm_handler;
     sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = sigusr2_handler;
+    sigaction(SIGUSR2, &action, NULL);
     signal(SIGPIPE, SIG_IGN);
 
     sigemptyset(&selectmask);
@@ -913,20 +1387,31 @@ int main(int argc, char **argv)
     sigprocmask(SIG_BLOCK, &selectmask, NULL);
     sigemptyset(&selectmask);
 
-    struct pollfd fds[MAX_FDS + 2];
+    /* control vchan, trigger socket, connections, pending requests */
+    struct pollfd fds[2 * MAX_FDS + 2];
     fds[0] = (struct pollfd) { libvchan_fd_for_select(ctrl_vchan), POLLIN | POLLHUP, 0 };
     fds[1] = (struct pollfd) { trigger_fd, POLLIN | POLLHUP, 0 };
 
     while (!terminate_requested) {
         struct timespec timeout = { 1, 0 };
         size_t nfds = 1;
+        size_t trigger_nfds;
         int ret;
 
         if (child_exited)
             reap_children();
 
-        if (libvchan_buffer_space(ctrl_vchan) > (int)sizeof(struct msg_header)) {
-            /* vchan has space, so poll for clients */
+        if (usage_dump_requested)
+            dump_usage();
+
+        if (queued_requests_count > 0)
+            start_queued_requests();
+
+        if (vchan_queue_flush(ctrl_vchan, &ctrl_queue) < 0)
+            handle_vchan_error("send");
+
+        if (!vchan_queue_full(&ctrl_queue)) {
+            /* queue has space, so poll for clients */
 
             nfds++; /* for trigger_fd */
             for (size_t i = 0; i < MAX_FDS; i++) {
@@ -934,6 +1419,15 @@ int main(int argc, char **argv)
                     fds[nfds++] = (struct pollfd) { connection_info[i].fd, POLLIN | POLLHUP, 0 };
             }
         }
+        trigger_nfds = nfds;
+        if (!vchan_queue_full(&ctrl_queue)) {
+            /* no events requested, so only POLLHUP (qrexec-client-vm has
+             * closed the socket) or POLLERR is reported */
+            for (int fd = 0; fd < MAX_FDS; fd++) {
+                if (trigger_requests[fd] == TRIGGER_REQUEST_PENDING)
+                    fds[nfds++] = (struct pollfd) { fd, 0, 0 };
+            }
+        }
 
         ret = ppoll_vchan(ctrl_vchan, fds, nfds, &timeout, &selectmask);
         if (ret < 0) {
@@ -943,7 +1437,7 @@ int main(int argc, char **argv)
             return 1;
         }
 
-        if (nfds > 2) {
+        if (trigger_nfds > 2) {
             size_t fds_checked = 2;
 
             /*
@@ -958,19 +1452,25 @@ int main(int argc, char **argv)
              */
             for (size_t i = 0; i < MAX_FDS; i++) {
                 if (connection_info[i].pid != 0 && connection_info[i].fd != -1) {
-                    if (nfds <= fds_checked) {
-                        fprintf(stderr, "BAD: nfds (%zu) <= fds_checked (%zu), aborting!\n", nfds, fds_checked);
-                        assert(nfds > fds_checked);
+                    if (trigger_nfds <= fds_checked) {
+                        fprintf(stderr, "BAD: nfds (%zu) <= fds_checked (%zu), aborting!\n", trigger_nfds, fds_checked);
+                        assert(trigger_nfds > fds_checked);
                         abort();
                     }
                     struct pollfd fd_info = fds[fds_checked++];
                     assert(fd_info.fd == connection_info[i].fd);
                     if (fd_info.revents)
-                        handle_terminated_fork_client(i);
+                        handle_terminated_data_process(i);
                 }
             }
 
-            assert(fds_checked == nfds);
+            assert(fds_checked == trigger_nfds);
+        }
+
+        /* before handle_server_cmd(), which may answer these requests */
+        for (size_t i = trigger_nfds; i < nfds; i++) {
+            if (fds[i].revents)
+                cancel_trigger_request(fds[i].fd);
         }
 
         while (libvchan_data_ready(ctrl_vchan))
@@ -23,6 +23,7 @@
 #define QREXEC_AGENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #define QREXEC_FORK_SERVER_SOCKET "/var/run/qubes/qrexec-server.%s.sock"
@@ -36,24 +37,59 @@ void prepare_child_env(void);
 // whether qrexec-client should replace problematic bytes with _ before printing the output
 extern int replace_chars_stdout;
 extern int replace_chars_stderr;
+// whether qrexec-client-vm should handle the two data directions in separate threads
+extern bool client_threaded_io;
 
 /* true in qrexec-fork-server, false in qrexec-agent */
 extern const bool qrexec_is_fork_server;
 
+/* usage_fd: socket to qrexec-agent to send struct qrexec_service_usage to
+ * when the call is finished, -1 if none */
 pid_t handle_new_process(int type,
         int connect_domain, int connect_port,
-        struct qrexec_parsed_command *cmd);
+        struct qrexec_parsed_command *cmd,
+        const char *initial_stdin, size_t initial_stdin_len,
+        int usage_fd);
+/* Start a process that only connects to the client and reports the call as
+ * refused. Returns its PID. */
+pid_t handle_refused_process(int type,
+        int connect_domain, int connect_port);
+/* extra_data_sent: extra_data was already sent together with the service
+ * request, send it again only if the remote side does not support that */
 int handle_data_client(int type,
         int connect_domain, int connect_port,
         int stdin_fd, int stdout_fd,
-        int buffer_size, pid_t pid, const char *extra_data);
+        int buffer_size, pid_t pid, const char *extra_data,
+        bool extra_data_sent);
 
 
+/* Resources used by a service call, sent to qrexec-agent by the process
+ * handling the call (possibly started by qrexec-fork-server) just before it
+ * exits, over the socket qrexec-agent watches for the end of the call. CPU
+ * time, memory and blocks are those of the service process, 0 for socket
+ * and plugin services. */
+struct qrexec_service_usage {
+    uint64_t wall_us;
+    uint64_t user_us;
+    uint64_t system_us;
+    uint64_t max_rss_kib;
+    uint64_t blocks_in;
+    uint64_t blocks_out;
+    int32_t exit_code;
+    uint16_t service_name_len;
+    uint16_t source_domain_len;
+    /* followed by the service name and the source domain, without NUL */
+};
+
+/* longest service name (NAME_MAX) or source domain sent */
+#define QREXEC_SERVICE_USAGE_MAX_NAME 255
+
 struct qrexec_cmd_info {
 	int type;
 	int connect_domain;
 	int connect_port;
-	unsigned int cmdline_len;
+	unsigned int cmdline_len; /* including initial stdin data after the command line NUL terminator */
+	unsigned int payload_len; /* length of that initial stdin data */
 	char cmdline[];
 };
 
@@ -96,6 +96,9 @@ enum {
     opt_no_filter_stdout = 't'+128,
     opt_no_filter_stderr = 'T'+128,
     opt_use_stdin_socket = 'u'+128,
+    opt_batch = 'B'+128,
+    opt_batch_jobs = 'j'+128,
+    opt_threaded_io = 'I'+128,
 };
 
 static struct option longopts[] = {
@@ -107,14 +110,18 @@ static struct option longopts[] = {
     { "agent-socket", required_argument, 0, 'a'},
     { "prefix-data", required_argument, 0, 'p' },
     { "use-stdin-socket", no_argument, 0, opt_use_stdin_socket },
+    { "batch", required_argument, 0, opt_batch },
+    { "batch-jobs", required_argument, 0, opt_batch_jobs },
+    { "threaded-io", no_argument, 0, opt_threaded_io },
     { "help", no_argument, 0, 'h' },
     { NULL, 0, 0, 0},
 };
 
 _Noreturn static void usage(const char *argv0, int status) {
     fprintf(stderr,
-            "usage: %s [options] target_vmname program_ident [local_program [local program arguments]]\n",
-            argv0);
+            "usage: %s [options] target_vmname program_ident [local_program [local program arguments]]\n"
+            "       %s [options] --batch=FILE\n",
+            argv0, argv0);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --buffer-size=BUFFER_SIZE - minimum vchan buffer size (default: 64k)\n");
     fprintf(stderr, "  -t, --filter-escape-chars-stdout - filter non-ASCII and control characters on stdout (default if stdout is a terminal)\n");
@@ -125,17 +132,264 @@ _Noreturn static void usage(const char *argv0, int status) {
             QREXEC_AGENT_TRIGGER_PATH);
     fprintf(stderr, "  -h, --help - print this message\n");
     fprintf(stderr, "  -p PREFIX-DATA, --prefix-data=PREFIX-DATA - send the given data before the provided stdin (can only be used once)\n");
+    fprintf(stderr, "  --threaded-io - send and receive data in separate threads (for bulk transfers in both directions)\n");
+    fprintf(stderr, "  --batch=FILE - run the calls listed in FILE (\"-\" for stdin), one \"target_vmname program_ident [input_file [output_file]]\" per line\n");
+    fprintf(stderr, "  --batch-jobs=N - number of batch calls to run at the same time (default: 1)\n");
     exit(status);
 }
 
-int main(int argc, char **argv)
+static unsigned long parse_number(const char *what, const char *arg, unsigned long max)
+{
+    char *endptr;
+
+    if (*arg < '0' || *arg > '9') {
+        fprintf(stderr, "Bad %s: does not begin with a number\n", what);
+        exit(1);
+    }
+    errno = 0;
+    unsigned long res = strtoul(arg, &endptr, 0);
+    if (res > max)
+        errno = ERANGE;
+    if (errno) {
+        PERROR("strtoul");
+        exit(1);
+    }
+    if (*endptr) {
+        fprintf(stderr, "Bad %s: trailing junk\n", what);
+        exit(1);
+    }
+    return res;
+}
+
+/* Ask the agent to set up the call, exits on failure. Returns the trigger
+ * socket, which must be kept open until the call finishes. */
+static int request_service(const char *agent_trigger_path, char *target,
+                           const char *service_name, const char *prefix_data,
+                           struct exec_params *exec_params,
+                           uint32_t *prefix_data_sent)
 {
     int trigger_fd;
     struct msg_header hdr;
     struct trigger_service_params3 params;
+    size_t service_name_len, prefix_data_len = 0;
+    ssize_t ret;
+
+    service_name_len = strlen(service_name) + 1;
+
+    /* send small prefix data together with the request, so the service can
+     * get it as soon as it is started */
+    if (prefix_data && strlen(prefix_data) <= MAX_INLINE_PAYLOAD)
+        prefix_data_len = strlen(prefix_data);
+
+    trigger_fd = connect_unix_socket(agent_trigger_path);
+
+    hdr.type = MSG_TRIGGER_SERVICE3;
+    hdr.len = sizeof(params) + service_name_len + prefix_data_len;
+
+    memset(&params, 0, sizeof(params));
+
+    convert_target_name_keyword(target);
+    strncpy(params.target_domain, target,
+            sizeof(params.target_domain) - 1);
+
+    memcpy(params.request_id.ident, "SOCKET", sizeof("SOCKET"));
+
+    if (!write_all(trigger_fd, &hdr, sizeof(hdr))) {
+        PERROR("write(hdr) to agent");
+        exit(1);
+    }
+    if (!write_all(trigger_fd, &params, sizeof(params))) {
+        PERROR("write(params) to agent");
+        exit(1);
+    }
+    if (!write_all(trigger_fd, service_name, service_name_len)) {
+        PERROR("write(command) to agent");
+        exit(1);
+    }
+    if (!write_all(trigger_fd, prefix_data, prefix_data_len)) {
+        PERROR("write(prefix data) to agent");
+        exit(1);
+    }
+    ret = read(trigger_fd, exec_params, sizeof(*exec_params));
+    if (ret == 0) {
+        fprintf(stderr, "Request refused\n");
+        exit(QREXEC_EXIT_REQUEST_REFUSED);
+    }
+    if (ret < 0 || ret != sizeof(*exec_params)) {
+        PERROR("read");
+        exit(1);
+    }
+    /* the agent reports whether the prefix data went along the request */
+    *prefix_data_sent = 0;
+    if (prefix_data_len > 0 &&
+            !read_all(trigger_fd, prefix_data_sent, sizeof(*prefix_data_sent))) {
+        PERROR("read");
+        exit(1);
+    }
+    return trigger_fd;
+}
+
+struct batch_job {
+    size_t line;
+    char *target;
+    char *service_name;
+    char *input;
+    char *output;
+};
+
+/* Read the whole job list upfront, so that syntax errors are reported before
+ * any call is made and no stdio buffers are shared with the job processes. */
+static struct batch_job *read_batch_file(const char *path, size_t *njobs)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    struct batch_job *jobs = NULL;
+    size_t count = 0, line_no = 0, buf_size = 0;
+    char *buf = NULL;
+
+    if (!f)
+        err(1, "open %s", path);
+    while (getline(&buf, &buf_size, f) != -1) {
+        char *fields[5] = { NULL }, *saveptr;
+        size_t nfields = 0;
+
+        line_no++;
+        for (char *tok = strtok_r(buf, " \t\n", &saveptr);
+                tok && nfields < 5;
+                tok = strtok_r(NULL, " \t\n", &saveptr))
+            fields[nfields++] = tok;
+        if (nfields == 0 || fields[0][0] == '#')
+            continue;
+        if (nfields < 2 || nfields > 4)
+            errx(2, "%s:%zu: expected \"target_vmname program_ident "
+                 "[input_file [output_file]]\"", path, line_no);
+        if (!(jobs = reallocarray(jobs, count + 1, sizeof(*jobs))))
+            err(1, "reallocarray");
+        jobs[count] = (struct batch_job) { .line = line_no };
+        if (!(jobs[count].target = strdup(fields[0])) ||
+                !(jobs[count].service_name = strdup(fields[1])) ||
+                (fields[2] && !(jobs[count].input = strdup(fields[2]))) ||
+                (fields[3] && !(jobs[count].output = strdup(fields[3]))))
+            err(1, "strdup");
+        count++;
+    }
+    if (ferror(f))
+        err(1, "read %s", path);
+    free(buf);
+    if (f != stdin)
+        fclose(f);
+    *njobs = count;
+    return jobs;
+}
+
+_Noreturn static void run_batch_job(const struct batch_job *job,
+                                    const char *agent_trigger_path,
+                                    const char *prefix_data, int buffer_size)
+{
+    const char *input = job->input ? job->input : "/dev/null";
+    const char *output = job->output ? job->output : "/dev/null";
     struct exec_params exec_params;
-    size_t service_name_len;
-    char *service_name, *endptr;
+    uint32_t prefix_data_sent;
+    int fd;
+
+    fd = open(input, O_RDONLY | O_NOCTTY);
+    if (fd < 0 || dup2(fd, 0) != 0) {
+        PERROR("open %s", input);
+        exit(QREXEC_EXIT_PROBLEM);
+    }
+    if (fd != 0)
+        close(fd);
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0666);
+    if (fd < 0 || dup2(fd, 1) != 1) {
+        PERROR("open %s", output);
+        exit(QREXEC_EXIT_PROBLEM);
+    }
+    if (fd != 1)
+        close(fd);
+
+    request_service(agent_trigger_path, job->target, job->service_name,
+                    prefix_data, &exec_params, &prefix_data_sent);
+    exit(handle_data_client(MSG_SERVICE_CONNECT,
+                exec_params.connect_domain, exec_params.connect_port,
+                1, 0, buffer_size, 0, prefix_data, prefix_data_sent != 0));
+}
+
+/* Run the batch with up to max_jobs calls in flight, each in its own process
+ * (the data connection handling exits on error). Per-job exit codes are
+ * reported on stdout as "line exit_code", in order of completion. */
+static int run_batch(const char *batch_path, size_t max_jobs,
+                     const char *agent_trigger_path, const char *prefix_data,
+                     int buffer_size)
+{
+    struct batch_job *jobs;
+    size_t njobs, next = 0, active = 0;
+    size_t *running_job;
+    pid_t *running;
+    int failed = 0;
+
+    jobs = read_batch_file(batch_path, &njobs);
+    running = calloc(max_jobs, sizeof(*running));
+    running_job = calloc(max_jobs, sizeof(*running_job));
+    if (!running || !running_job)
+        err(1, "calloc");
+
+    while (next < njobs || active > 0) {
+        if (next < njobs && active < max_jobs) {
+            size_t slot;
+            pid_t pid;
+
+            for (slot = 0; running[slot]; slot++)
+                ;
+            fflush(stdout);
+            switch (pid = fork()) {
+                case -1:
+                    err(1, "fork");
+                case 0:
+                    run_batch_job(&jobs[next], agent_trigger_path,
+                                  prefix_data, buffer_size);
+                default:
+                    running[slot] = pid;
+                    running_job[slot] = next++;
+                    active++;
+            }
+            continue;
+        }
+
+        int status, exit_code;
+        size_t slot;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            err(1, "waitpid");
+        for (slot = 0; slot < max_jobs && running[slot] != pid; slot++)
+            ;
+        if (slot == max_jobs)
+            continue;
+        exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                      : 128 + WTERMSIG(status);
+        if (exit_code)
+            failed = 1;
+        printf("%zu %d\n", jobs[running_job[slot]].line, exit_code);
+        running[slot] = 0;
+        active--;
+    }
+    fflush(stdout);
+
+    free(running_job);
+    free(running);
+    for (size_t i = 0; i < njobs; i++) {
+        free(jobs[i].target);
+        free(jobs[i].service_name);
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int trigger_fd;
+    struct exec_params exec_params;
+    char *service_name;
     ssize_t ret;
     int i;
     int start_local_process = 0;
@@ -146,6 +400,9 @@ int main(int argc, char **argv)
     int opt;
     int stdout_fd = 1;
     const char *agent_trigger_path = QREXEC_AGENT_TRIGGER_PATH, *prefix_data = NULL;
+    const char *batch_path = NULL;
+    size_t batch_jobs = 1;
+    uint32_t prefix_data_sent = 0;
 
     setup_logging("qrexec-client-vm");
 
@@ -157,26 +414,9 @@ int main(int argc, char **argv)
         if (opt == -1)
             break;
         switch (opt) {
-            case 'b': {
-                if (*optarg < '0' || *optarg > '9') {
-                    fputs("Bad buffer size: does not begin with a number\n", stderr);
-                    exit(1);
-                }
-                errno = 0;
-                unsigned long res = strtoul(optarg, &endptr, 0);
-                if (res > INT_MAX)
-                    errno = ERANGE;
-                if (errno) {
-                    PERROR("strtoul");
-                    exit(1);
-                }
-                if (*endptr) {
-                    fputs("Bad buffer size: trailing junk\n", stderr);
-                    exit(1);
-                }
-                buffer_size = (int)res;
+            case 'b':
+                buffer_size = (int)parse_number("buffer size", optarg, INT_MAX);
                 break;
-            }
             case 't':
                 replace_chars_stdout = 1;
                 break;
@@ -219,11 +459,33 @@ int main(int argc, char **argv)
                     stdout_fd = 0;
                 }
                 break;
+            case opt_threaded_io:
+                client_threaded_io = true;
+                break;
+            case opt_batch:
+                batch_path = optarg;
+                break;
+            case opt_batch_jobs:
+                batch_jobs = parse_number("batch jobs", optarg, 1024);
+                if (batch_jobs == 0)
+                    usage(argv[0], 2);
+                break;
             case '?':
                 usage(argv[0], 2);
         }
     }
 
+    if (batch_path) {
+        if (argc != optind || stdout_fd != 1) {
+            fprintf(stderr, "--batch cannot be combined with a single call\n");
+            usage(argv[0], 2);
+        }
+        if (replace_chars_stderr == -1 && isatty(2))
+            replace_chars_stderr = 1;
+        return run_batch(batch_path, batch_jobs, agent_trigger_path,
+                         prefix_data, buffer_size);
+    }
+
     if (argc - optind < 2) {
         usage(argv[0], 2);
     }
@@ -244,42 +506,8 @@ int main(int argc, char **argv)
 
     service_name = argv[optind + 1];
 
-    service_name_len = strlen(service_name) + 1;
-
-    trigger_fd = connect_unix_socket(agent_trigger_path);
-
-    hdr.type = MSG_TRIGGER_SERVICE3;
-    hdr.len = sizeof(params) + service_name_len;
-
-    memset(&params, 0, sizeof(params));
-
-    convert_target_name_keyword(argv[optind]);
-    strncpy(params.target_domain, argv[optind],
-            sizeof(params.target_domain) - 1);
-
-    memcpy(params.request_id.ident, "SOCKET", sizeof("SOCKET"));
-
-    if (!write_all(trigger_fd, &hdr, sizeof(hdr))) {
-        PERROR("write(hdr) to agent");
-        exit(1);
-    }
-    if (!write_all(trigger_fd, &params, sizeof(params))) {
-        PERROR("write(params) to agent");
-        exit(1);
-    }
-    if (!write_all(trigger_fd, service_name, service_name_len)) {
-        PERROR("write(command) to agent");
-        exit(1);
-    }
-    ret = read(trigger_fd, &exec_params, sizeof(exec_params));
-    if (ret == 0) {
-        fprintf(stderr, "Request refused\n");
-        exit(QREXEC_EXIT_REQUEST_REFUSED);
-    }
-    if (ret < 0 || ret != sizeof(exec_params)) {
-        PERROR("read");
-        exit(1);
-    }
+    trigger_fd = request_service(agent_trigger_path, argv[optind], service_name,
+                                 prefix_data, &exec_params, &prefix_data_sent);
 
     if (start_local_process) {
         if (socketpair(AF_UNIX, SOCK_STREAM, 0, inpipe) ||
@@ -324,11 +552,13 @@ int main(int argc, char **argv)
 
         ret = handle_data_client(MSG_SERVICE_CONNECT,
                 exec_params.connect_domain, exec_params.connect_port,
-                inpipe[1], outpipe[0], buffer_size, child_pid, prefix_data);
+                inpipe[1], outpipe[0], buffer_size, child_pid, prefix_data,
+                prefix_data_sent != 0);
     } else {
         ret = handle_data_client(MSG_SERVICE_CONNECT,
                 exec_params.connect_domain, exec_params.connect_port,
-                stdout_fd, 0, buffer_size, 0, prefix_data);
+                stdout_fd, 0, buffer_size, 0, prefix_data,
+                prefix_data_sent != 0);
     }
 
     close(trigger_fd);
@@ -81,11 +81,17 @@ static void handle_single_command(int fd, struct qrexec_cmd_info *info) {
     if (!read_all(fd, cmdline, cmdline_len)) {
         goto fail;
     }
-    if (cmdline[cmdline_len - 1] != 0) {
+    /* the command line may be followed by initial stdin data */
+    if (info->payload_len >= cmdline_len) {
+        LOG(ERROR, "Initial data longer than the command line, refusing!");
+        goto fail;
+    }
+    size_t len = cmdline_len - info->payload_len - 1;
+    if (cmdline[len] != 0) {
         LOG(ERROR, "Command line not NUL terminated, refusing!");
         goto fail;
     }
-    if (strlen(cmdline) != cmdline_len - 1) {
+    if (strlen(cmdline) != len) {
         LOG(ERROR, "Command line has a NUL byte, refusing!");
         goto fail;
     }
@@ -95,7 +101,8 @@ static void handle_single_command(int fd, struct qrexec_cmd_info *info) {
         goto fail;
 
     handle_new_process(info->type, info->connect_domain,
-                       info->connect_port, cmd);
+                       info->connect_port, cmd,
+                       cmdline + len + 1, cmdline_len - len - 1, fd);
     destroy_qrexec_parsed_command(cmd);
 fail:
     free(cmdline);
@@ -0,0 +1,115 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Client side of a /dev/tcp-mux service: accept TCP connections on a local
+ * port and forward them all over the stream on stdin/stdout, which is
+ * normally a qrexec call made by qrexec-client-vm:
+ *
+ *   qrexec-client-vm sys-net qubes.ConnectTCPMux+8080 \
+ *       /usr/lib/qubes/qrexec-tcp-mux 8080
+ */
+
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "libqrexec-utils.h"
+
+static struct option longopts[] = {
+    { "bind", required_argument, 0, 'b' },
+    { "help", no_argument, 0, 'h' },
+    { NULL, 0, 0, 0 },
+};
+
+_Noreturn static void usage(const char *argv0, int status) {
+    fprintf(stderr, "usage: %s [--bind=ADDRESS] PORT\n", argv0);
+    fprintf(stderr, "Forward TCP connections accepted on PORT over stdin/stdout, to a /dev/tcp-mux qrexec service.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -b ADDRESS, --bind=ADDRESS - numeric address to listen on (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -h, --help - print this message\n");
+    exit(status);
+}
+
+static int listen_tcp(const char *address, const char *port)
+{
+    struct addrinfo hints = {
+        .ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV,
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP,
+    }, *addrs;
+    int rc = getaddrinfo(address, port, &hints, &addrs);
+    int s;
+
+    if (rc != 0) {
+        LOG(ERROR, "getaddrinfo(%s, %s) failed: %s",
+            address, port, gai_strerror(rc));
+        return -1;
+    }
+    s = socket(addrs->ai_family, addrs->ai_socktype | SOCK_CLOEXEC,
+               addrs->ai_protocol);
+    if (s < 0) {
+        PERROR("socket");
+        goto out;
+    }
+    int one = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) ||
+            bind(s, addrs->ai_addr, addrs->ai_addrlen) ||
+            listen(s, SOMAXCONN)) {
+        PERROR("listen on %s:%s", address, port);
+        close(s);
+        s = -1;
+    }
+out:
+    freeaddrinfo(addrs);
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    const char *address = "127.0.0.1";
+    int opt, s;
+
+    setup_logging("qrexec-tcp-mux");
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt_long(argc, argv, "b:h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                address = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0);
+            default:
+                usage(argv[0], 2);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0], 2);
+
+    s = listen_tcp(address, argv[optind]);
+    if (s < 0)
+        return 1;
+    return qrexec_tcp_mux_run(0, 1, s, NULL, NULL);
+}
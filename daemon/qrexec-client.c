@@ -273,12 +273,15 @@ int main(int argc, char **argv)
         rc = run_qrexec_to_dom0(&svc_params,
                            src_domain_id,
                            src_domain_name,
+                           -1,
+                           NULL,
+                           0,
                            remote_cmdline,
                            connection_timeout,
                            exit_with_code);
     } else {
         if (request_id) {
-            rc = qrexec_execute_vm(domname, false, src_domain_id,
+            rc = qrexec_execute_vm(domname, false, src_domain_id, -1,
                                    remote_cmdline, strlen(remote_cmdline) + 1,
                                    request_id, just_exec,
                                    wait_connection_end) ? 0 : 137;
@@ -3,6 +3,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -12,6 +14,8 @@
 
 const char *socket_dir = QREXEC_DAEMON_SOCKET_DIR;
 
+volatile sig_atomic_t request_cancelled;
+
 /* ask the daemon to allocate vchan port */
 bool negotiate_connection_params(int s, int other_domid, unsigned type,
         const void *cmdline_param, int cmdline_size,
@@ -91,6 +95,7 @@ int handle_daemon_handshake(int fd)
 }
 
 bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
+                       int remote_daemon_fd,
                        const char *cmd, size_t const service_length,
                        const char *request_id, bool just_exec,
                        bool wait_connection_end)
@@ -119,6 +124,8 @@ bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
         }
         // Otherwise, we kill the VM immediately after starting it.
         wait_connection_end = true;
+        if (request_cancelled)
+            return false;
         buf = qubesd_call(target + 8, "admin.vm.CreateDisposable", "", &resp_len);
         if (buf == NULL) // error already printed by qubesd_call
             return false;
@@ -135,8 +142,20 @@ bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
             return false;
         }
     }
+    /* The connection to the target's qrexec-daemon is made per call, unlike
+     * the one to the caller's daemon (remote_daemon_fd): the target daemon
+     * authenticates the caller and returns the data port on it, and closes
+     * it when the call ends, which is how disposable VMs get killed.  Sharing
+     * one connection between calls would need request tags in all of those
+     * messages. */
     int s = disposable ? -2 : connect_unix_socket(target);
     if (s == -2 && autostart) {
+        if (request_cancelled) {
+            /* not started yet, so it cannot clean up after itself */
+            if (disposable)
+                free(qubesd_call(target, "admin.vm.Remove", "", &resp_len));
+            return false;
+        }
         buf = qubesd_call(target, "admin.vm.Start", "", &resp_len);
         if (buf == NULL) // error already printed by qubesd_call
             return false;
@@ -153,7 +172,7 @@ bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
         free(buf);
         s = connect_unix_socket(target);
     }
-    if (s < 0)
+    if (s < 0 || request_cancelled)
         goto kill;
     int data_domain;
     int data_port;
@@ -174,15 +193,21 @@ bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
         close(s);
     }
 
-    s = connect_unix_socket_by_id((unsigned)remote_domain_id);
-    rc = send_service_connect(s, request_id, data_domain, data_port);
-    close(s);
+    if (remote_daemon_fd >= 0) {
+        rc = send_service_connect(remote_daemon_fd, request_id,
+                                  data_domain, data_port);
+    } else {
+        s = connect_unix_socket_by_id((unsigned)remote_domain_id);
+        rc = send_service_connect(s, request_id, data_domain, data_port);
+        close(s);
+    }
     if (wait_connection_end) {
         /* wait for EOF */
         struct pollfd fds[1] = {
             { .fd = wait_connection_fd, .events = POLLIN | POLLHUP, .revents = 0 },
         };
-        poll(fds, 1, -1);
+        while (poll(fds, 1, -1) < 0 && errno == EINTR && !request_cancelled)
+            ;
         size_t l;
 kill:
         if (disposable)
@@ -452,6 +477,9 @@ static int select_loop(const struct handshake_params *params,
 int run_qrexec_to_dom0(const struct service_params *svc_params,
                         int src_domain_id,
                         const char *src_domain_name,
+                        int src_daemon_fd,
+                        const char *initial_stdin,
+                        size_t initial_stdin_len,
                         char *remote_cmdline,
                         int connection_timeout,
                         bool exit_with_code)
@@ -463,7 +491,7 @@ int run_qrexec_to_dom0(const struct service_params *svc_params,
     libvchan_t *data_vchan = NULL;
 
     set_remote_domain(src_domain_name);
-    s = connect_unix_socket_by_id(src_domain_id);
+    s = src_daemon_fd >= 0 ? src_daemon_fd : connect_unix_socket_by_id(src_domain_id);
     if (s < 0)
         return QREXEC_EXIT_PROBLEM;
     if (!negotiate_connection_params(s,
@@ -486,6 +514,8 @@ int run_qrexec_to_dom0(const struct service_params *svc_params,
         prepare_ret = -2;
     } else {
         prepare_ret = prepare_local_fds(command, &stdin_buffer);
+        if (prepare_ret == 0 && initial_stdin_len > 0)
+            buffer_append(&stdin_buffer, initial_stdin, (int)initial_stdin_len);
     }
     int wait_fd;
     data_vchan = libvchan_client_init_async(data_domain, data_port, &wait_fd);
@@ -60,6 +60,11 @@ bool send_service_connect(int s, const char *conn_ident,
  * @param svc_params The parameters of the service.
  * @param src_domain_id The source domain ID.
  * @param src_domain_name The source domain name.
+ * @param src_daemon_fd Already established connection to the source domain's
+ * qrexec-daemon, or -1 to connect to its socket.
+ * @param initial_stdin Data to pass to the service stdin before anything
+ * received over the data connection, can be NULL.
+ * @param initial_stdin_len The size of initial_stdin.
  * @param cmd The command to execute.
  * @param connection_timeout The connection timeout in seconds.
  * @param exit_with_code \true if the return value should be the exit
@@ -70,6 +75,9 @@ __attribute__((warn_unused_result))
 int run_qrexec_to_dom0(const struct service_params *svc_params,
                        int src_domain_id,
                        const char *src_domain_name,
+                       int src_daemon_fd,
+                       const char *initial_stdin,
+                       size_t initial_stdin_len,
                        char *remote_cmdline,
                        int connection_timeout,
                        bool exit_with_code);
@@ -115,7 +123,7 @@ int handshake_and_go(struct handshake_params *params,
  * \param remote_send_first \true if the remote should send the first message,
  *        otherwise \false.
  * \return The protocol version.  Guaranteed to be either -1 (failure) or
- *         between `QREXEC_PROTOCOL_V2` and `QREXEC_PROTOCOL_V3` inclusive.
+ *         between `QREXEC_PROTOCOL_V2` and `QREXEC_PROTOCOL_VERSION` inclusive.
  */
 __attribute__((warn_unused_result))
 int handle_agent_handshake(libvchan_t *vchan, bool remote_send_first);
@@ -132,6 +140,8 @@ int prepare_local_fds(struct qrexec_parsed_command *command, struct buffer *stdi
  * \param target The target VM name.
  * \param autostart \true to start the VM if it is not already started, otherwise \false.
  * \param remote_domain_id Xen domain ID of the remote domain.
+ * \param remote_daemon_fd Already established connection to the remote
+ *        domain's qrexec-daemon, or -1 to connect to its socket.
  * \param cmd The command.
  * \param service_length The length of the command.
  * \param request_id The request ID used.
@@ -141,7 +151,14 @@ int prepare_local_fds(struct qrexec_parsed_command *command, struct buffer *stdi
  */
 __attribute__((warn_unused_result))
 bool qrexec_execute_vm(const char *target, bool autostart, int remote_domain_id,
+                       int remote_daemon_fd,
                        const char *cmd, size_t service_length, const char *request_id,
                        bool just_exec, bool wait_connection_end);
+/**
+ * Set (from a signal handler) when the caller of the service went away.
+ * qrexec_execute_vm() then gives up before starting the target, and removes
+ * a disposable VM it has already created.
+ */
+extern volatile sig_atomic_t request_cancelled;
 /** FD for stdout of remote process */
 extern int local_stdin_fd;
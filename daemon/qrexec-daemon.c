@@ -35,6 +35,7 @@
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
+#include <time.h>
 #include "qrexec.h"
 #include "libqrexec-utils.h"
 #include "../libqrexec/ioall.h"
@@ -80,10 +81,15 @@ struct _policy_pending {
     pid_t pid;
     struct service_params params;
     enum policy_response response_sent;
+    uint64_t start_us;	// for the policy latency statistics
+    bool cancelled;	// MSG_SERVICE_CANCEL received, the child was signalled
 };
 
 #define VCHAN_BASE_DATA_PORT (VCHAN_BASE_PORT+1)
 
+/* FD of the pre-connected daemon link in the service request child */
+#define DAEMON_LINK_FD 3
+
 /*
    The "clients" array is indexed by client's fd.
    Thus its size must be equal MAX_FDS; defining MAX_CLIENTS for clarity.
@@ -95,6 +101,9 @@ static struct _client clients[MAX_CLIENTS];	// data on all qrexec_client connect
 static struct _policy_pending policy_pending[MAX_CLIENTS];
 static int policy_pending_max = -1;
 
+/* counters for MSG_STATS, the gauges are filled in when sending */
+static struct qrexec_daemon_stats stats;
+
 /* indexed with vchan port number relative to VCHAN_BASE_DATA_PORT; stores
  * either VCHAN_PORT_* or remote domain id for used port */
 static int used_vchan_ports[MAX_CLIENTS];
@@ -130,6 +139,11 @@ static volatile int terminate_requested;
 static
 #endif
 libvchan_t *vchan;
+/* control messages waiting for space in the vchan ring */
+#ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+static
+#endif
+struct vchan_queue ctrl_queue;
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 static
 #endif
@@ -432,6 +446,54 @@ static void init(int xid, bool opt_direct)
     }
 }
 
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* the policy responded to a pending request, with the given response */
+static void policy_responded(struct _policy_pending *pending,
+                             enum policy_response response)
+{
+    uint64_t latency = monotonic_us() - pending->start_us;
+    int bucket = 0;
+
+    pending->response_sent = response;
+    if (response == RESPONSE_ALLOW)
+        stats.service_allowed++;
+    stats.policy_time_us += latency;
+    while (bucket < QREXEC_STATS_LATENCY_BUCKETS - 1 &&
+            latency >= (UINT64_C(1) << bucket))
+        bucket++;
+    stats.policy_latency[bucket]++;
+}
+
+static void send_stats(int fd)
+{
+    struct msg_header hdr = { .type = MSG_STATS, .len = sizeof(stats) };
+    int i;
+
+    stats.domain_id = (uint32_t)remote_domain_id;
+    stats.ports_in_use = 0;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (used_vchan_ports[i] != VCHAN_PORT_UNUSED)
+            stats.ports_in_use++;
+    stats.clients = 0;
+    for (i = 0; i <= max_client_fd; i++)
+        if (clients[i].state != CLIENT_INVALID)
+            stats.clients++;
+    stats.policy_pending = 0;
+    for (i = 0; i <= policy_pending_max; i++)
+        if (policy_pending[i].pid != 0)
+            stats.policy_pending++;
+
+    if (!write_all(fd, &hdr, sizeof(hdr)) || !write_all(fd, &stats, sizeof(stats)))
+        LOG(ERROR, "Failed to send stats to client %d", fd);
+}
+
 static int send_client_hello(int fd)
 {
     struct msg_header hdr;
@@ -508,6 +570,7 @@ static void handle_new_client(void)
     clients[fd].state = CLIENT_HELLO;
     if (fd > max_client_fd)
         max_client_fd = fd;
+    stats.client_connections++;
 }
 
 static void terminate_client(int fd)
@@ -536,7 +599,7 @@ static void release_vchan_port(int port, int expected_remote_id)
 static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
 {
     struct exec_params *params = NULL;
-    uint32_t len;
+    uint32_t len, payload_len = 0;
     char *buf;
     int use_default_user = 0;
     int i;
@@ -566,7 +629,25 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
     }
     buf = params->cmdline;
 
-    if (buf[len - 1] != '\0') {
+    if (hdr->type == MSG_EXEC_CMDLINE) {
+        /* the command line may be followed by initial stdin data */
+        const char *nul = memchr(buf, '\0', len);
+        payload_len = nul ? len - (uint32_t)(nul - buf) - 1 : 0;
+        if (payload_len > MAX_INLINE_PAYLOAD) {
+            LOG(ERROR, "Client sent too much initial data (%" PRIu32 " bytes)",
+                payload_len);
+            goto terminate;
+        }
+        if (payload_len > 0 && protocol_version < QREXEC_PROTOCOL_V4) {
+            /* the agent does not support it, the data will be sent over the
+             * data connection instead */
+            len -= payload_len;
+            hdr->len -= payload_len;
+            payload_len = 0;
+        }
+    }
+
+    if (buf[len - payload_len - 1] != '\0') {
         LOG(ERROR, "Client sent buffer of length %" PRIu32 " that is not "
             "NUL-terminated", len);
         goto terminate;
@@ -588,7 +669,7 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
                     policy_pending[i].params.ident);
             goto terminate;
         }
-        policy_pending[i].response_sent = RESPONSE_ALLOW;
+        policy_responded(&policy_pending[i], RESPONSE_ALLOW);
     } else {
         if (hdr->type != MSG_JUST_EXEC && hdr->type != MSG_EXEC_CMDLINE) {
             // Sending such a message would just cause the agent to terminate.
@@ -641,21 +722,15 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
         hdr->len -= default_user_keyword_len_without_colon;
         hdr->len += strlen(default_user);
     }
-    if (libvchan_send(vchan, hdr, sizeof(*hdr)) != sizeof(*hdr))
-        handle_vchan_error("send");
+    vchan_queue_append(&ctrl_queue, hdr, sizeof(*hdr));
     if (use_default_user) {
-        int send_len = strlen(default_user);
-        if (libvchan_send(vchan, params, sizeof(*params)) != sizeof(*params))
-            handle_vchan_error("send params");
-        if (libvchan_send(vchan, default_user, send_len) != send_len)
-            handle_vchan_error("send default_user");
-        send_len = len-default_user_keyword_len_without_colon;
-        if (libvchan_send(vchan, buf+default_user_keyword_len_without_colon,
-                    send_len) != send_len)
-            handle_vchan_error("send buf");
+        vchan_queue_append(&ctrl_queue, params, sizeof(*params));
+        vchan_queue_append(&ctrl_queue, default_user, strlen(default_user));
+        vchan_queue_append(&ctrl_queue,
+                           buf+default_user_keyword_len_without_colon,
+                           len-default_user_keyword_len_without_colon);
     } else {
-        if (libvchan_send(vchan, params, hdr->len) != (int)hdr->len)
-            handle_vchan_error("send buf");
+        vchan_queue_append(&ctrl_queue, params, hdr->len);
     }
     free(params);
     return 1;
@@ -677,6 +752,11 @@ static void handle_cmdline_message_from_client(int fd)
         case MSG_JUST_EXEC:
         case MSG_SERVICE_CONNECT:
             break;
+        case MSG_STATS:
+            if (hdr.len == 0)
+                send_stats(fd);
+            terminate_client(fd);
+            return;
         default:
             terminate_client(fd);
             return;
@@ -765,21 +845,15 @@ static void signal_handler(int sig)
     }
 }
 
-static void send_service_refused(libvchan_t *vchan, const struct service_params *untrusted_params) {
+static void send_service_refused(const struct service_params *untrusted_params) {
     struct msg_header hdr;
 
     hdr.type = MSG_SERVICE_REFUSED;
     hdr.len = sizeof(*untrusted_params);
+    stats.service_refused++;
 
-    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-        LOG(ERROR, "Failed to send MSG_SERVICE_REFUSED hdr to agent");
-        exit(1);
-    }
-
-    if (libvchan_send(vchan, untrusted_params, sizeof(*untrusted_params)) != sizeof(*untrusted_params)) {
-        LOG(ERROR, "Failed to send MSG_SERVICE_REFUSED to agent");
-        exit(1);
-    }
+    vchan_queue_append(&ctrl_queue, &hdr, sizeof(hdr));
+    vchan_queue_append(&ctrl_queue, untrusted_params, sizeof(*untrusted_params));
 }
 
 /* clean zombies, check for denied service calls */
@@ -792,20 +866,22 @@ static void reap_children(void)
     while ((pid=waitpid(-1, &status, WNOHANG)) > 0) {
         for (i = 0; i <= policy_pending_max; i++) {
             if (policy_pending[i].pid == pid) {
-                if (!WIFEXITED(status))
-                    continue;
-                status = WEXITSTATUS(status);
+                /* a cancelled child may be killed before it handles SIGTERM */
+                status = WIFEXITED(status) ? WEXITSTATUS(status) : QREXEC_EXIT_PROBLEM;
+                if (policy_pending[i].cancelled &&
+                        policy_pending[i].response_sent == RESPONSE_PENDING)
+                    stats.service_cancelled++;
                 if (status != 0) {
                     if (policy_pending[i].response_sent != RESPONSE_PENDING) {
                         LOG(ERROR, "qrexec-policy-exec for connection %s exited with code %d, but the response (%s) was already sent",
                                 policy_pending[i].params.ident, status,
                                 policy_pending[i].response_sent == RESPONSE_ALLOW ? "allow" : "deny");
                     } else {
-                        policy_pending[i].response_sent = RESPONSE_DENY;
-                        send_service_refused(vchan, &policy_pending[i].params);
+                        policy_responded(&policy_pending[i], RESPONSE_DENY);
+                        send_service_refused(&policy_pending[i].params);
                     }
-                } else {
-                    policy_pending[i].response_sent = RESPONSE_ALLOW;
+                } else if (policy_pending[i].response_sent == RESPONSE_PENDING) {
+                    policy_responded(&policy_pending[i], RESPONSE_ALLOW);
                 }
                 /* in case of allowed calls, we will do the rest in
                  * MSG_SERVICE_CONNECT from client handler */
@@ -962,7 +1038,8 @@ static void send_request_to_daemon(
     int command_size = asprintf(&command,
             "source=%s\n"
             "intended_target=%s\n"
-            "service_and_arg=%s\n\n",
+            "service_and_arg=%s\n"
+            "cancellable=yes\n\n",
             remote_domain_name,
             target_domain,
             service_name);
@@ -984,6 +1061,28 @@ static void send_request_to_daemon(
     free(command);
 }
 
+/* in the service request child: the policy is being queried */
+static volatile sig_atomic_t policy_query_in_progress;
+/* in the service request child: the fallback policy program */
+static volatile pid_t policy_program_pid;
+
+/*
+ * SIGTERM handler of the service request child, the daemon sends it when the
+ * caller has gone away (MSG_SERVICE_CANCEL).  A policy query is simply
+ * abandoned: closing the policy daemon connection aborts the evaluation there.
+ * Later on the request is only marked, qrexec_execute_vm() checks it before
+ * each step, so that it can clean up a disposable VM.
+ */
+static void cancel_request_handler(int sig __attribute__((unused)))
+{
+    if (policy_query_in_progress) {
+        if (policy_program_pid > 0)
+            kill(policy_program_pid, SIGTERM);
+        _exit(QREXEC_EXIT_REQUEST_REFUSED);
+    }
+    request_cancelled = 1;
+}
+
 static _Noreturn void null_exit(void)
 {
 #ifdef COVERAGE
@@ -1080,6 +1179,7 @@ static enum policy_response connect_daemon_socket(
             }
             daemon__exit(QREXEC_EXIT_PROBLEM);
         default:
+            policy_program_pid = pid;
             if (close(fds[1]))
                 abort();
             size_t result_bytes;
@@ -1120,25 +1220,37 @@ _Noreturn static void handle_execute_service_child(
         const char *remote_domain_name,
         const char *target_domain,
         const char *service_name,
-        const struct service_params *request_id) {
+        const struct service_params *request_id,
+        const char *payload,
+        size_t payload_len,
+        int daemon_link_fd) {
     int i;
 
+    /* keep the link to the parent daemon as FD 3, close everything else */
+    if (daemon_link_fd != DAEMON_LINK_FD) {
+        if (dup3(daemon_link_fd, DAEMON_LINK_FD, O_CLOEXEC) != DAEMON_LINK_FD) {
+            PERROR("dup3");
+            daemon__exit(QREXEC_EXIT_PROBLEM);
+        }
+    }
 #ifdef SYS_close_range
-    int close_range_res = syscall(SYS_close_range, 3, ~0U, 0);
+    int close_range_res = syscall(SYS_close_range, DAEMON_LINK_FD + 1, ~0U, 0);
 #else
     int close_range_res = -1;
 #endif
     if (close_range_res != 0)
-        for (i = 3; i < MAX_FDS; i++)
+        for (i = DAEMON_LINK_FD + 1; i < MAX_FDS; i++)
             close(i);
 
     char *user, *target, *requested_target;
     int autostart;
+    policy_query_in_progress = 1;
     int policy_response =
         connect_daemon_socket(remote_domain_name, target_domain, service_name,
                               &user, &target, &requested_target, &autostart);
+    policy_query_in_progress = 0;
 
-    if (policy_response != RESPONSE_ALLOW)
+    if (policy_response != RESPONSE_ALLOW || request_cancelled)
         daemon__exit(QREXEC_EXIT_REQUEST_REFUSED);
 
     /* Replace the target domain with the version normalized by the policy engine */
@@ -1174,6 +1286,9 @@ _Noreturn static void handle_execute_service_child(
         daemon__exit(run_qrexec_to_dom0(request_id,
                            remote_domain_id,
                            remote_domain_name,
+                           DAEMON_LINK_FD,
+                           payload,
+                           payload_len,
                            cmd,
                            5 /* 5 second timeout */,
                            false /* return 0 not remote status code */));
@@ -1185,7 +1300,16 @@ _Noreturn static void handle_execute_service_child(
                                       remote_domain_name);
         if (service_length < 0)
             daemon__exit(QREXEC_EXIT_PROBLEM);
+        if (payload_len > 0) {
+            /* pass initial stdin data after the command line NUL terminator */
+            cmd = realloc(cmd, (size_t)service_length + 1 + payload_len);
+            if (cmd == NULL)
+                daemon__exit(QREXEC_EXIT_PROBLEM);
+            memcpy(cmd + service_length + 1, payload, payload_len);
+            service_length += (int)payload_len;
+        }
         daemon__exit(qrexec_execute_vm(target, autostart, remote_domain_id,
+                                       DAEMON_LINK_FD,
                                        cmd,
                                        (size_t)service_length + 1,
                                        request_id->ident, false, false)
@@ -1198,19 +1322,51 @@ static void handle_execute_service(
         const char *remote_domain_name,
         const char *target_domain,
         const char *service_name,
-        const struct service_params *request_id)
+        const struct service_params *request_id,
+        const char *payload,
+        size_t payload_len)
 {
     int policy_pending_slot;
     pid_t pid;
-    struct sigaction sa = { .sa_handler = SIG_DFL };
+    struct sigaction sa = {
+        .sa_handler = cancel_request_handler,
+        .sa_flags = SA_RESTART,
+    };
+    sigset_t sigterm_mask, old_mask;
+
+    int link_fds[2];
 
     policy_pending_slot = find_policy_pending_slot();
     if (policy_pending_slot < 0) {
         LOG(ERROR, "Service request denied, too many pending requests");
-        send_service_refused(vchan, request_id);
+        send_service_refused(request_id);
         return;
     }
 
+    /*
+     * Pre-connected link to this daemon, used by the child to send
+     * MSG_SERVICE_CONNECT (or negotiate the data port for calls to dom0)
+     * without connecting to our socket and doing a handshake.  The parent end
+     * is registered as a client that already passed the hello phase.
+     */
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, link_fds)) {
+        PERROR("socketpair");
+        send_service_refused(request_id);
+        return;
+    }
+    if (link_fds[0] >= MAX_CLIENTS) {
+        LOG(ERROR, "Service request denied, too many clients");
+        close(link_fds[0]);
+        close(link_fds[1]);
+        send_service_refused(request_id);
+        return;
+    }
+
+    /* until the child has its own SIGTERM handler */
+    sigemptyset(&sigterm_mask);
+    sigaddset(&sigterm_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigterm_mask, &old_mask);
+
     switch (pid=fork()) {
         case -1:
             PERROR("fork");
@@ -1218,15 +1374,25 @@ static void handle_execute_service(
         case 0:
             if (atexit(null_exit))
                 _exit(QREXEC_EXIT_PROBLEM);
+            /* SIGTERM cancels the request, see cancel_request_handler() */
             if (sigaction(SIGTERM, &sa, NULL))
-                LOG(WARNING, "Failed to restore SIGTERM handler: %d", errno);
+                LOG(WARNING, "Failed to set SIGTERM handler: %d", errno);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
             handle_execute_service_child(remote_domain_id, remote_domain_name,
-                                         target_domain, service_name, request_id);
+                                         target_domain, service_name, request_id,
+                                         payload, payload_len, link_fds[1]);
             abort();
         default:
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            close(link_fds[1]);
+            clients[link_fds[0]].state = CLIENT_CMDLINE;
+            if (link_fds[0] > max_client_fd)
+                max_client_fd = link_fds[0];
             policy_pending[policy_pending_slot].pid = pid;
             policy_pending[policy_pending_slot].params = *request_id;
             policy_pending[policy_pending_slot].response_sent = RESPONSE_PENDING;
+            policy_pending[policy_pending_slot].start_us = monotonic_us();
+            policy_pending[policy_pending_slot].cancelled = false;
             return;
     }
 }
@@ -1239,6 +1405,7 @@ static void handle_connection_terminated(void)
     if (libvchan_recv(vchan, &untrusted_params, sizeof(untrusted_params))
             != sizeof(untrusted_params))
         handle_vchan_error("recv params");
+    qrexec_trace_payload(&untrusted_params, sizeof(untrusted_params));
     /* sanitize start */
     if (untrusted_params.connect_port < VCHAN_BASE_DATA_PORT ||
             untrusted_params.connect_port >= VCHAN_BASE_DATA_PORT+MAX_CLIENTS) {
@@ -1278,7 +1445,8 @@ static void sanitize_message_from_agent(struct msg_header *untrusted_header)
                 exit(1);
             }
             if (untrusted_header->len - sizeof(struct trigger_service_params3)
-                    > MAX_SERVICE_NAME_LEN) {
+                    > MAX_SERVICE_NAME_LEN +
+                      (protocol_version >= QREXEC_PROTOCOL_V4 ? MAX_INLINE_PAYLOAD : 0)) {
                 LOG(ERROR, "agent sent too large MSG_TRIGGER_SERVICE3 packet");
                 exit(1);
             }
@@ -1289,6 +1457,17 @@ static void sanitize_message_from_agent(struct msg_header *untrusted_header)
                 exit(1);
             }
             break;
+        case MSG_SERVICE_CANCEL:
+            if (protocol_version < QREXEC_PROTOCOL_V5) {
+                LOG(ERROR, "agent sent (new) MSG_SERVICE_CANCEL "
+                    "although it uses protocol %d", protocol_version);
+                exit(1);
+            }
+            if (untrusted_header->len != sizeof(struct service_params)) {
+                LOG(ERROR, "agent sent invalid MSG_SERVICE_CANCEL packet");
+                exit(1);
+            }
+            break;
         default:
             LOG(ERROR, "unknown mesage type 0x%x from agent",
                     untrusted_header->type);
@@ -1329,6 +1508,40 @@ static bool validate_request_id(struct service_params *untrusted_params, const c
     return false; // no NUL terminator
 }
 
+/* the caller went away, stop the service request child if it is still
+ * waiting for the policy or for the target to start; reap_children() then
+ * sends MSG_SERVICE_REFUSED, so the agent can release the request */
+static void handle_service_cancel(void)
+{
+    struct service_params untrusted_params, params;
+    int i;
+
+    if (libvchan_recv(vchan, &untrusted_params, sizeof(untrusted_params))
+            != sizeof(untrusted_params))
+        handle_vchan_error("recv params");
+    qrexec_trace_payload(&untrusted_params, sizeof(untrusted_params));
+    /* sanitize start */
+    if (!validate_request_id(&untrusted_params, "MSG_SERVICE_CANCEL"))
+        return;
+    params = untrusted_params;
+    /* sanitize end */
+
+    for (i = 0; i <= policy_pending_max; i++) {
+        if (policy_pending[i].pid &&
+                policy_pending[i].response_sent == RESPONSE_PENDING &&
+                !policy_pending[i].cancelled &&
+                strncmp(policy_pending[i].params.ident, params.ident,
+                        sizeof(params.ident)) == 0) {
+            LOG(INFO, "Service request %s cancelled by the caller", params.ident);
+            policy_pending[i].cancelled = true;
+            if (kill(policy_pending[i].pid, SIGTERM))
+                PERROR("kill");
+            return;
+        }
+    }
+    /* already answered, the agent handles the answer */
+}
+
 #define ENSURE_NULL_TERMINATED(x) x[sizeof(x)-1] = 0
 
 static bool validate_service_name(char *untrusted_service_name)
@@ -1360,6 +1573,7 @@ void handle_message_from_agent(void)
     sanitize_message_from_agent(&untrusted_hdr);
     hdr = untrusted_hdr;
     /* sanitize end */
+    qrexec_trace_start(&hdr);
 
     //      fprintf(stderr, "got %x %x %x\n", hdr.type, hdr.client_id,
     //              hdr.len);
@@ -1367,9 +1581,11 @@ void handle_message_from_agent(void)
     switch (hdr.type) {
         case MSG_TRIGGER_SERVICE: {
             struct trigger_service_params untrusted_params, params;
+            stats.service_calls++;
             if (libvchan_recv(vchan, &untrusted_params, sizeof(untrusted_params))
                     != sizeof(untrusted_params))
                 handle_vchan_error("recv params");
+            qrexec_trace_payload(&untrusted_params, sizeof(untrusted_params));
 
             /* sanitize start */
             ENSURE_NULL_TERMINATED(untrusted_params.service_name);
@@ -1377,12 +1593,12 @@ void handle_message_from_agent(void)
             sanitize_name(untrusted_params.service_name, "+");
             sanitize_name(untrusted_params.target_domain, "@:");
             if (!validate_request_id(&untrusted_params.request_id, "MSG_TRIGGER_SERVICE")) {
-                send_service_refused(vchan, &untrusted_params.request_id);
-                return;
+                send_service_refused(&untrusted_params.request_id);
+                break;
             }
             if (!validate_service_name(untrusted_params.service_name)) {
-                send_service_refused(vchan, &untrusted_params.request_id);
-                return;
+                send_service_refused(&untrusted_params.request_id);
+                break;
             }
             params = untrusted_params;
             /* sanitize end */
@@ -1390,28 +1606,46 @@ void handle_message_from_agent(void)
             handle_execute_service(remote_domain_id, remote_domain_name,
                     params.target_domain,
                     params.service_name,
-                    &params.request_id);
-            return;
+                    &params.request_id,
+                    NULL, 0);
+            break;
         }
         case MSG_TRIGGER_SERVICE3: {
             struct trigger_service_params3 *untrusted_params3, *params3;
+            stats.service_calls++;
 
             untrusted_params3 = malloc(hdr.len);
             if (!untrusted_params3)
                 handle_vchan_error("malloc(service_name)");
 
-            if (libvchan_recv(vchan, untrusted_params3, hdr.len)
-                    != (int)hdr.len) {
+            /* with inline data, this may be larger than the ring */
+            if (!read_vchan_all(vchan, untrusted_params3, hdr.len)) {
                 free(untrusted_params3);
                 handle_vchan_error("recv params3(service_name)");
             }
-            size_t const service_name_len = hdr.len - sizeof(*untrusted_params3) - 1;
+            qrexec_trace_payload(untrusted_params3, hdr.len);
+            size_t service_name_len = hdr.len - sizeof(*untrusted_params3) - 1;
+            size_t payload_len = 0;
 
             /* sanitize start */
             ENSURE_NULL_TERMINATED(untrusted_params3->target_domain);
             sanitize_name(untrusted_params3->target_domain, "@:");
             if (!validate_request_id(&untrusted_params3->request_id, "MSG_TRIGGER_SERVICE3"))
                 goto fail3;
+            if (protocol_version >= QREXEC_PROTOCOL_V4) {
+                /* service name may be followed by initial stdin data */
+                size_t const name_len = strnlen(untrusted_params3->service_name,
+                                                service_name_len + 1);
+                if (name_len <= service_name_len) {
+                    payload_len = service_name_len - name_len;
+                    service_name_len = name_len;
+                }
+                if (payload_len > MAX_INLINE_PAYLOAD ||
+                        service_name_len > MAX_SERVICE_NAME_LEN) {
+                    LOG(ERROR, "Initial data too large (%zu bytes)", payload_len);
+                    goto fail3;
+                }
+            }
             if (untrusted_params3->service_name[service_name_len] != 0) {
                 LOG(ERROR, "Service name not NUL-terminated");
                 goto fail3;
@@ -1430,18 +1664,24 @@ void handle_message_from_agent(void)
             handle_execute_service(remote_domain_id, remote_domain_name,
                     params3->target_domain,
                     params3->service_name,
-                    &params3->request_id);
+                    &params3->request_id,
+                    params3->service_name + service_name_len + 1,
+                    payload_len);
             free(params3);
-            return;
+            break;
 fail3:
-            send_service_refused(vchan, &untrusted_params3->request_id);
+            send_service_refused(&untrusted_params3->request_id);
             free(untrusted_params3);
-            return;
+            break;
         }
         case MSG_CONNECTION_TERMINATED:
             handle_connection_terminated();
-            return;
+            break;
+        case MSG_SERVICE_CANCEL:
+            handle_service_cancel();
+            break;
     }
+    qrexec_trace_end();
 }
 
 /* qrexec-agent has disconnected, cleanup local state and try to connect again.
@@ -1454,9 +1694,11 @@ static int handle_agent_restart(int xid) {
     unlink_qrexec_socket();
     close(qrexec_daemon_unix_socket_fd);
 
-    /* Close old (dead) vchan connection. */
+    /* Close old (dead) vchan connection, the new agent does not know about
+     * requests that were still queued for the old one. */
     libvchan_close(vchan);
     vchan = NULL;
+    vchan_queue_free(&ctrl_queue);
 
     /* Disconnect all local clients. This will look like all the qrexec
      * connections were terminated, which isn't necessary true (established
@@ -1558,6 +1800,7 @@ int main(int argc, char **argv)
     }
 
     setup_logging("qrexec-daemon");
+    qrexec_trace_init("qrexec-daemon");
 
     while ((opt=getopt_long(argc, argv, "hqp:D", longopts, NULL)) != -1) {
         switch (opt) {
@@ -1608,12 +1851,16 @@ int main(int argc, char **argv)
         if (child_exited)
             reap_children();
 
+        /* a closed vchan is handled below */
+        if (vchan_queue_flush(vchan, &ctrl_queue) < 0 && libvchan_is_open(vchan))
+            handle_vchan_error("send");
+
         size_t nfds = 0;
         struct pollfd fds[MAX_CLIENTS + 2];
         fds[nfds++] = (struct pollfd) { libvchan_fd_for_select(vchan), POLLIN | POLLHUP, 0 };
-        if (libvchan_buffer_space(vchan) > (int)sizeof(struct msg_header)) {
+        if (!vchan_queue_full(&ctrl_queue)) {
             assert(max_client_fd < MAX_CLIENTS);
-            // vchan not full, read from clients
+            // queue not full, read from clients
             fds[nfds++] = (struct pollfd) { qrexec_daemon_unix_socket_fd, POLLIN | POLLHUP, 0 };
             for (i = 0; i <= max_client_fd; i++) {
                 if (clients[i].state != CLIENT_INVALID)
@@ -0,0 +1,51 @@
+/*
+ * Complexity fuzzer for the buffer_* functions, see complexity.h.
+ *
+ * The input is a sequence of 16-bit little-endian operations: the top bit
+ * selects buffer_remove() over buffer_append(), and the low 12 bits give the
+ * number of bytes.  The work allowed is proportional to the bytes appended
+ * and removed plus a fixed cost per operation, so an implementation copying
+ * the whole buffer on every operation is reported.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libqrexec-utils.h"
+
+/* copying a byte is cheap */
+#define COMPLEXITY_DEFAULT_NS_PER_UNIT 20ULL
+#include "complexity.h"
+
+#define OP_REMOVE 0x8000
+#define OP_LEN_MASK 0x0fff
+/* units of work allowed per operation, for the allocation */
+#define OP_UNITS 64
+
+void _Noreturn fuzz_exit(int status) {
+    abort();
+}
+
+void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static char chunk[OP_LEN_MASK + 1];
+    struct buffer buf;
+    size_t units = 0;
+
+    buffer_init(&buf);
+    uint64_t start = complexity_now_ns();
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        uint16_t op = (uint16_t)(data[i] | data[i + 1] << 8);
+        int len = op & OP_LEN_MASK;
+
+        if (op & OP_REMOVE) {
+            if (len > buffer_len(&buf))
+                len = buffer_len(&buf);
+            buffer_remove(&buf, len);
+        } else {
+            buffer_append(&buf, chunk, len);
+        }
+        units += (size_t)len + OP_UNITS;
+    }
+    complexity_check("buffer_append/buffer_remove", start, units);
+    buffer_free(&buf);
+}
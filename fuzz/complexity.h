@@ -0,0 +1,60 @@
+#ifndef _COMPLEXITY_H
+#define _COMPLEXITY_H
+
+/*
+ * Work budget for the *_complexity_fuzzer harnesses.  They do not look for
+ * crashes, but for inputs taking disproportionately long to process: the CPU
+ * time spent on an input must stay below
+ *
+ *   QREXEC_FUZZ_BASE_NS + QREXEC_FUZZ_NS_PER_UNIT * units
+ *
+ * where units is the amount of work the harness asked for (usually input
+ * bytes).  Inputs over the budget abort, so that libFuzzer saves them.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* generous defaults, to allow for sanitizer overhead; a harness can define
+ * its own cost of a unit of work before including this file */
+#define COMPLEXITY_DEFAULT_BASE_NS 10000000ULL
+#ifndef COMPLEXITY_DEFAULT_NS_PER_UNIT
+#define COMPLEXITY_DEFAULT_NS_PER_UNIT 2000ULL
+#endif
+
+static inline uint64_t complexity_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t complexity_env(const char *name, uint64_t def) {
+    const char *value = getenv(name);
+
+    return value && *value ? strtoull(value, NULL, 10) : def;
+}
+
+static inline void complexity_check(const char *what, uint64_t start_ns,
+                                    size_t units) {
+    static uint64_t base_ns, ns_per_unit;
+    uint64_t elapsed = complexity_now_ns() - start_ns, budget;
+
+    if (!base_ns) {
+        base_ns = complexity_env("QREXEC_FUZZ_BASE_NS",
+                                 COMPLEXITY_DEFAULT_BASE_NS);
+        ns_per_unit = complexity_env("QREXEC_FUZZ_NS_PER_UNIT",
+                                     COMPLEXITY_DEFAULT_NS_PER_UNIT);
+    }
+    budget = base_ns + ns_per_unit * units;
+    if (elapsed > budget) {
+        fprintf(stderr, "%s: %llu ns for %zu units, over the %llu ns budget\n",
+                what, (unsigned long long)elapsed, units,
+                (unsigned long long)budget);
+        abort();
+    }
+}
+
+#endif
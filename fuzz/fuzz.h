@@ -16,6 +16,7 @@ struct fuzz_file {
 };
 
 typedef struct fuzz_file fuzz_file_t;
+struct vchan_queue;
 
 fuzz_file_t *fuzz_file_create(int fd, const void *input_data, size_t input_size);
 void fuzz_file_destroy(fuzz_file_t *file);
@@ -40,6 +41,7 @@ ssize_t fuzz_write(int fd, const void *buf, size_t count);
 void _Noreturn fuzz_exit(int status);
 
 extern fuzz_file_t *vchan;
+extern struct vchan_queue ctrl_queue;
 extern int protocol_version;
 void handle_message_from_agent(void);
 
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# The Qubes OS Project, https://www.qubes-os.org/
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <https://www.gnu.org/licenses/>.
+
+"""
+Complexity fuzzer for the policy file loader, the Python counterpart of the
+*_complexity_fuzzer harnesses (see complexity.h).  Loading a policy must take
+less CPU time than QREXEC_FUZZ_BASE_NS + QREXEC_FUZZ_NS_PER_UNIT * input
+length, otherwise the input is reported.  Requires atheris:
+
+    PYTHONPATH=.. python3 policy_complexity_fuzzer.py -runs=10000
+"""
+
+import os
+import sys
+import time
+
+import atheris
+
+with atheris.instrument_imports():
+    from qrexec import exc
+    from qrexec.policy import parser
+
+# the Python parser is much slower than the C ones
+BASE_NS = int(os.environ.get("QREXEC_FUZZ_BASE_NS") or 50_000_000)
+NS_PER_UNIT = int(os.environ.get("QREXEC_FUZZ_NS_PER_UNIT") or 50_000)
+
+
+class SlowInput(Exception):
+    pass
+
+
+def TestOneInput(data):  # pylint: disable=invalid-name
+    fdp = atheris.FuzzedDataProvider(data)
+    policy = fdp.ConsumeUnicodeNoSurrogates(len(data))
+
+    start = time.process_time_ns()
+    try:
+        parser.StringPolicy(policy=policy)
+    except exc.PolicySyntaxError:
+        pass
+    elapsed = time.process_time_ns() - start
+
+    budget = BASE_NS + NS_PER_UNIT * (len(policy) + 1)
+    if elapsed > budget:
+        raise SlowInput(
+            "policy load: {} ns for {} characters, over the {} ns budget".format(
+                elapsed, len(policy), budget
+            )
+        )
+
+
+def main():
+    atheris.Setup(sys.argv, TestOneInput)
+    atheris.Fuzz()
+
+
+if __name__ == "__main__":
+    main()
@@ -21,7 +21,7 @@ void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 
     protocol_version = data[0];
     if (protocol_version < QREXEC_PROTOCOL_V2 ||
-            protocol_version > QREXEC_PROTOCOL_V3)
+            protocol_version > QREXEC_PROTOCOL_VERSION)
         return;
 
     vchan_file = fuzz_file_create(1, data+1, size-1);
@@ -29,6 +29,7 @@ void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
 
     if (setjmp(exit_jmp)) {
         /* clean rejection of invalid data */
+        vchan_queue_free(&ctrl_queue);
         fuzz_file_destroy(vchan_file);
         return;
     }
@@ -36,5 +37,6 @@ void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
     handle_message_from_agent();
 
     /* when reached here, it was correct message */
+    vchan_queue_free(&ctrl_queue);
     fuzz_file_destroy(vchan_file);
 }
@@ -0,0 +1,65 @@
+/*
+ * Microbenchmark of parse_qubes_rpc_command() + destroy_qrexec_parsed_command()
+ * against the reference implementation allocating every string separately.
+ *
+ * Build and run with "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libqrexec-utils.h"
+#include "qubesrpc_parse_reference.h"
+
+/* this is a regular program, not a fuzzer */
+#undef main
+#undef exit
+
+#define ITERATIONS 1000000
+
+void _Noreturn fuzz_exit(int status) {
+    exit(status);
+}
+
+static const char *const cmdlines[] = {
+    "user:QUBESRPC qubes.Filecopy+ work",
+    "user:QUBESRPC qubes.StartApp+firefox personal name work",
+    "root:nogui:QUBESRPC qubes.GetDate+ disp1234 keyword default",
+    "user:QUBESRPC qubes.UpdatesProxy+ sys-whonix",
+    "user:echo hello",
+};
+#define NUM_CMDLINES (sizeof(cmdlines) / sizeof(cmdlines[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void bench(const char *name,
+                  struct qrexec_parsed_command *(*parse)(const char *, bool),
+                  void (*destroy)(struct qrexec_parsed_command *)) {
+    double start = now();
+
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        struct qrexec_parsed_command *cmd =
+            parse(cmdlines[i % NUM_CMDLINES], true);
+        if (cmd == NULL)
+            abort();
+        destroy(cmd);
+    }
+    printf("%s: %.1f ns/op\n", name, (now() - start) / ITERATIONS);
+}
+
+int main(void) {
+    /* warm up malloc */
+    bench("reference (warm-up)", reference_parse_qubes_rpc_command,
+          reference_destroy_qrexec_parsed_command);
+    bench("reference", reference_parse_qubes_rpc_command,
+          reference_destroy_qrexec_parsed_command);
+    bench("parse_qubes_rpc_command", parse_qubes_rpc_command,
+          destroy_qrexec_parsed_command);
+    return 0;
+}
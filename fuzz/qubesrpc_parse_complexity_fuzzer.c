@@ -0,0 +1,29 @@
+/*
+ * Complexity fuzzer for parse_qubes_rpc_command(), see complexity.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libqrexec-utils.h"
+#include "complexity.h"
+
+void _Noreturn fuzz_exit(int status) {
+    abort();
+}
+
+void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *cmdline = malloc(size+1);
+    if (!cmdline)
+        return;
+    memcpy(cmdline, data, size);
+    cmdline[size] = '\0';
+
+    uint64_t start = complexity_now_ns();
+    for (int strip_username = 0; strip_username <= 1; strip_username++)
+        destroy_qrexec_parsed_command(
+            parse_qubes_rpc_command(cmdline, strip_username));
+    complexity_check("parse_qubes_rpc_command", start, 2 * (size + 1));
+
+    free(cmdline);
+}
@@ -25,11 +25,41 @@
 #include <assert.h>
 
 #include "libqrexec-utils.h"
+#include "qubesrpc_parse_reference.h"
 
 void _Noreturn fuzz_exit(int status) {
     abort();
 }
 
+static void assert_same_string(const char *a, const char *b) {
+    assert((a == NULL) == (b == NULL));
+    assert(a == NULL || strcmp(a, b) == 0);
+}
+
+/* the parser must give the same result as the reference implementation */
+static void check_reference(const char *cmdline, bool strip_username,
+                            const struct qrexec_parsed_command *cmd) {
+    struct qrexec_parsed_command *ref =
+        reference_parse_qubes_rpc_command(cmdline, strip_username);
+
+    assert((cmd == NULL) == (ref == NULL));
+    if (cmd) {
+        assert(cmd->cmdline == ref->cmdline);
+        assert(cmd->command == ref->command);
+        assert(cmd->nogui == ref->nogui);
+        assert(cmd->send_service_descriptor == ref->send_service_descriptor);
+        assert_same_string(cmd->username, ref->username);
+        assert_same_string(cmd->service_descriptor, ref->service_descriptor);
+        assert_same_string(cmd->service_name, ref->service_name);
+        assert_same_string(cmd->source_domain, ref->source_domain);
+        assert_same_string(cmd->arg, ref->arg);
+        assert(cmd->arg == NULL ||
+               cmd->arg - cmd->service_descriptor ==
+               ref->arg - ref->service_descriptor);
+    }
+    reference_destroy_qrexec_parsed_command(ref);
+}
+
 void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
     char *cmdline = malloc(size+1);
     if (!cmdline)
@@ -37,7 +67,12 @@ void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
     memcpy(cmdline, data, size);
     cmdline[size] = '\0';
 
-    struct qrexec_parsed_command *cmd = parse_qubes_rpc_command(cmdline, true);
+    struct qrexec_parsed_command *cmd = parse_qubes_rpc_command(cmdline, false);
+    check_reference(cmdline, false, cmd);
+    destroy_qrexec_parsed_command(cmd);
+
+    cmd = parse_qubes_rpc_command(cmdline, true);
+    check_reference(cmdline, true, cmd);
 
     if (!cmd) {
         free(cmdline);
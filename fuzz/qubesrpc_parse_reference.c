@@ -0,0 +1,151 @@
+/*
+ * Reference implementation of parse_qubes_rpc_command(), as it was before
+ * the parsed command was allocated as a single block: every string is
+ * allocated separately.  Used to check that the current parser gives the same
+ * results, and as a baseline for its benchmark.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libqrexec-utils.h"
+#include "qubesrpc_parse_reference.h"
+
+/* Duplicates a buffer and adds a NUL terminator.
+ * Same as strndup(), except that it logs on failure (with PERROR())
+ * and always copies exactly "len" bytes, even if some of them are NUL
+ * bytes.  This guarantees that the output buffer is of the expected
+ * length and saves an unneeded call to strnlen(). */
+static char* memdupnul(const char *ptr, size_t len) {
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+        PERROR("malloc");
+        return NULL;
+    }
+    memcpy(buf, ptr, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+struct qrexec_parsed_command *reference_parse_qubes_rpc_command(
+    const char *cmdline, bool strip_username) {
+
+    struct qrexec_parsed_command *cmd;
+
+    if (!(cmd = calloc(1, sizeof(*cmd)))) {
+        PERROR("calloc");
+        return NULL;
+    }
+
+    cmd->send_service_descriptor = true;
+    cmd->cmdline = cmdline;
+
+    if (strip_username) {
+        const char *colon = strchr(cmdline, ':');
+        if (!colon) {
+            LOG(ERROR, "Bad command from dom0 (%s): no colon", cmdline);
+            goto err;
+        }
+        cmd->username = memdupnul(cmdline, (size_t)(colon - cmdline));
+        if (!cmd->username)
+            goto err;
+        cmd->command = colon + 1;
+    } else
+        cmd->command = cmdline;
+
+    if (strncmp(cmd->command, NOGUI_CMD_PREFIX, NOGUI_CMD_PREFIX_LEN) == 0) {
+        cmd->nogui = true;
+        cmd->command += NOGUI_CMD_PREFIX_LEN;
+    } else
+        cmd->nogui = false;
+
+    /* If the command starts with "QUBESRPC", parse service descriptor */
+    if (strncmp(cmd->command, RPC_REQUEST_COMMAND,
+                RPC_REQUEST_COMMAND_LEN) == 0) {
+        const char *start, *end;
+
+        /* Check for space after "QUBESRPC" */
+        if (cmd->command[RPC_REQUEST_COMMAND_LEN] != ' ') {
+            LOG(ERROR, "\"" RPC_REQUEST_COMMAND "\" not followed by space");
+            goto err;
+        }
+
+        /* Parse service descriptor ("qubes.Service+arg") */
+        start = cmd->command + RPC_REQUEST_COMMAND_LEN + 1;
+        end = strchr(start, ' ');
+        if (!end) {
+            LOG(ERROR, "No space found after service descriptor");
+            goto err;
+        }
+
+        if (end <= start) {
+            LOG(ERROR, "Service descriptor is empty (too many spaces after QUBESRPC?)");
+            goto err;
+        }
+
+        size_t const descriptor_len = (size_t)(end - start);
+        if (descriptor_len > MAX_SERVICE_NAME_LEN) {
+            LOG(ERROR, "Command too long (length %zu)", descriptor_len);
+            goto err;
+        }
+
+        /* Parse service name ("qubes.Service") */
+
+        char *const plus = memchr(start, '+', descriptor_len);
+        size_t const name_len = plus != NULL ? (size_t)(plus - start) : descriptor_len;
+        if (name_len > NAME_MAX) {
+            LOG(ERROR, "Service name too long to execute (length %zu)", name_len);
+            goto err;
+        }
+        if (name_len < 1) {
+            LOG(ERROR, "Service name empty");
+            goto err;
+        }
+        cmd->service_name = memdupnul(start, name_len);
+        if (!cmd->service_name)
+            goto err;
+
+        /* If there is no service argument, add a trailing "+" to the descriptor */
+        cmd->service_descriptor = memdupnul(start, descriptor_len + (plus == NULL));
+        if (!cmd->service_descriptor)
+            goto err;
+        if (plus == NULL)
+            cmd->service_descriptor[descriptor_len] = '+';
+        else
+            cmd->arg = cmd->service_descriptor + (plus + 1 - start);
+
+        /* Parse source domain */
+
+        start = end + 1; /* after the space */
+        end = strchrnul(start, ' ');
+        if (end <= start) {
+            LOG(ERROR, "Source domain is empty (too many spaces after service descriptor?)");
+            goto err;
+        }
+        cmd->source_domain = memdupnul(start, (size_t)(end - start));
+        if (!cmd->source_domain)
+            goto err;
+    }
+
+    return cmd;
+
+err:
+    reference_destroy_qrexec_parsed_command(cmd);
+    return NULL;
+}
+
+void reference_destroy_qrexec_parsed_command(struct qrexec_parsed_command *cmd) {
+    if (cmd == NULL)
+        return;
+    if (cmd->username)
+        free(cmd->username);
+    if (cmd->service_descriptor)
+        free(cmd->service_descriptor);
+    if (cmd->service_name)
+        free(cmd->service_name);
+    if (cmd->source_domain)
+        free(cmd->source_domain);
+    free(cmd);
+}
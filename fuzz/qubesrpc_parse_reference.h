@@ -0,0 +1,12 @@
+#ifndef QUBESRPC_PARSE_REFERENCE_H
+#define QUBESRPC_PARSE_REFERENCE_H
+
+#include <stdbool.h>
+
+struct qrexec_parsed_command;
+
+struct qrexec_parsed_command *reference_parse_qubes_rpc_command(
+    const char *cmdline, bool strip_username);
+void reference_destroy_qrexec_parsed_command(struct qrexec_parsed_command *cmd);
+
+#endif
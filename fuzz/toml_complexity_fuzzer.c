@@ -0,0 +1,48 @@
+/*
+ * Complexity fuzzer for qubes_toml_config_parse(), see complexity.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+#include "private.h"
+#include "complexity.h"
+
+void _Noreturn fuzz_exit(int status) {
+    abort();
+}
+
+void LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static int fd = -1;
+    static char path[32];
+    bool wait_for_session, send_service_descriptor, exit_on_stdout_eof = false,
+         exit_on_stdin_eof = false, threaded_io = false, accept_fds = false;
+    unsigned int max_instances = 0, max_queued = 0, cpu_weight = 0,
+                 io_weight = 0, connect_timeout = 0;
+    unsigned long long memory_high = 0;
+    char *user = NULL;
+
+    /* the parser reads a file, keep it in memory */
+    if (fd < 0) {
+        fd = memfd_create("toml_complexity_fuzzer", MFD_CLOEXEC);
+        if (fd < 0)
+            abort();
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    }
+    if (ftruncate(fd, 0) ||
+            pwrite(fd, data, size, 0) != (ssize_t)size)
+        abort();
+
+    uint64_t start = complexity_now_ns();
+    qubes_toml_config_parse(path, &wait_for_session, &user,
+                            &send_service_descriptor, &exit_on_stdout_eof,
+                            &exit_on_stdin_eof, &threaded_io, &accept_fds,
+                            &max_instances, &max_queued, &cpu_weight,
+                            &io_weight, &memory_high, &connect_timeout);
+    complexity_check("qubes_toml_config_parse", start, size + 1);
+
+    free(user);
+}
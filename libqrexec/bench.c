@@ -0,0 +1,364 @@
+/*
+ * Microbenchmarks of libqrexec primitives.
+ *
+ * Built with "make bench", which links the library objects against the
+ * vchan-socket backend, so the data path can be measured over a local vchan
+ * without any VMs.  Every benchmark prints one tab-separated line:
+ *
+ *   name  iterations  ns/op  bytes/s
+ *
+ * with "-" as bytes/s for benchmarks that do not move data.  Lines starting
+ * with '#' are comments.  If arguments are given, only benchmarks whose name
+ * contains one of them are run.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+#include "private.h"
+#include "remote.h"
+
+#define BENCH_MIN_NS 200000000ULL
+#define CHUNK_SIZE 4096
+#define VCHAN_BUFFER_SIZE 65536
+#define VCHAN_BENCH_PORT (VCHAN_BASE_PORT + 1)
+
+struct bench {
+    const char *name;
+    /* bytes processed by a single call of run(), 0 if not applicable */
+    size_t bytes;
+    void (*run)(void *ctx);
+    void *ctx;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        PERROR("clock_gettime");
+        exit(1);
+    }
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+        (unsigned long long)ts.tv_nsec;
+}
+
+static bool bench_selected(const char *name, int argc, char **argv)
+{
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; i++)
+        if (strstr(name, argv[i]))
+            return true;
+    return false;
+}
+
+static void run_bench(const struct bench *b)
+{
+    unsigned long long iterations = 1, elapsed;
+    double ns_per_op;
+
+    /* warm up, then double the iteration count until the run is long
+     * enough to give stable numbers */
+    b->run(b->ctx);
+    for (;;) {
+        unsigned long long start = now_ns();
+        for (unsigned long long i = 0; i < iterations; i++)
+            b->run(b->ctx);
+        elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MIN_NS || iterations >= ULLONG_MAX / 2)
+            break;
+        iterations *= 2;
+    }
+
+    ns_per_op = (double)elapsed / (double)iterations;
+    printf("%s\t%llu\t%.1f\t", b->name, iterations, ns_per_op);
+    if (b->bytes)
+        printf("%.0f\n", (double)b->bytes * 1e9 / ns_per_op);
+    else
+        printf("-\n");
+    fflush(stdout);
+}
+
+static char chunk[CHUNK_SIZE];
+
+/* buffer_append() + buffer_remove() */
+
+static void bench_buffer(void *ctx)
+{
+    struct buffer *buf = ctx;
+
+    buffer_append(buf, chunk, sizeof(chunk));
+    buffer_remove(buf, sizeof(chunk));
+}
+
+/* write_stdin() and flush_client_data() to /dev/null */
+
+struct stdin_ctx {
+    int fd;
+    struct buffer buf;
+};
+
+static void bench_write_stdin(void *ctx)
+{
+    struct stdin_ctx *s = ctx;
+
+    if (write_stdin(s->fd, chunk, sizeof(chunk), &s->buf) != WRITE_STDIN_OK)
+        abort();
+}
+
+static void bench_flush_client_data(void *ctx)
+{
+    struct stdin_ctx *s = ctx;
+
+    buffer_append(&s->buf, chunk, sizeof(chunk));
+    if (flush_client_data(s->fd, &s->buf) != WRITE_STDIN_OK)
+        abort();
+}
+
+/* do_replace_chars() on fresh data each time, as it modifies it in place */
+
+static void bench_replace_chars(void *ctx)
+{
+    char *buf = ctx;
+
+    memcpy(buf, chunk, sizeof(chunk));
+    do_replace_chars(buf, sizeof(chunk));
+}
+
+/* parse_qubes_rpc_command() + destroy_qrexec_parsed_command() */
+
+static void bench_parse(void *ctx)
+{
+    const char *cmdline = ctx;
+    struct qrexec_parsed_command *cmd;
+
+    cmd = parse_qubes_rpc_command(cmdline, true);
+    if (cmd == NULL)
+        abort();
+    destroy_qrexec_parsed_command(cmd);
+}
+
+/* qubes_toml_config_parse() */
+
+static void bench_toml(void *ctx)
+{
+    const char *path = ctx;
+    bool wait_for_session = false, send_service_descriptor = true,
+         exit_on_stdout_eof = false, exit_on_stdin_eof = false,
+         threaded_io = false, accept_fds = false;
+    unsigned int max_instances = 0, max_queued = 0, cpu_weight = 0,
+                 io_weight = 0, connect_timeout = 0;
+    unsigned long long memory_high = 0;
+    char *user = NULL;
+
+    if (qubes_toml_config_parse(path, &wait_for_session, &user,
+                                &send_service_descriptor,
+                                &exit_on_stdout_eof, &exit_on_stdin_eof,
+                                &threaded_io, &accept_fds,
+                                &max_instances, &max_queued,
+                                &cpu_weight, &io_weight, &memory_high,
+                                &connect_timeout) != 1)
+        abort();
+    free(user);
+}
+
+/* find_qrexec_service() for an executable service */
+
+static void bench_find_service(void *ctx)
+{
+    struct qrexec_parsed_command *cmd = ctx;
+    struct buffer stdin_buffer;
+    int socket_fd;
+
+    buffer_init(&stdin_buffer);
+    if (find_qrexec_service(cmd, &socket_fd, &stdin_buffer) != 0)
+        abort();
+    buffer_free(&stdin_buffer);
+}
+
+/* handle_input_v2() on one end of a vchan and handle_remote_data_v2() on the
+ * other */
+
+struct vchan_ctx {
+    libvchan_t *server, *client;
+    int pipe_fds[2];
+    int null_fd;
+    struct buffer stdin_buf;
+    struct buffer data_buf;
+};
+
+static void bench_vchan_data(void *ctx)
+{
+    struct vchan_ctx *v = ctx;
+    struct prefix_data prefix = { 0 };
+    int status;
+
+    if (write(v->pipe_fds[1], chunk, sizeof(chunk)) != (ssize_t)sizeof(chunk))
+        abort();
+    if (handle_input_v2(v->server, v->pipe_fds[0], MSG_DATA_STDOUT, &prefix,
+                        &v->data_buf, NULL) != REMOTE_OK)
+        abort();
+    while (libvchan_data_ready(v->client) <
+            (int)(sizeof(struct msg_header) + sizeof(chunk))) {
+        if (libvchan_wait(v->client) < 0)
+            abort();
+    }
+    if (handle_remote_data_v2(v->client, v->null_fd, &status, &v->stdin_buf,
+                              false, false, false, &v->data_buf) != REMOTE_OK)
+        abort();
+}
+
+static int setup_vchan(struct vchan_ctx *v, const char *dir)
+{
+    int wait_fd;
+
+    /* both ends live in this process, so they see the same domain */
+    if (setenv("VCHAN_SOCKET_DIR", dir, 1) || setenv("VCHAN_DOMAIN", "0", 1)) {
+        PERROR("setenv");
+        return -1;
+    }
+    v->server = libvchan_server_init(0, VCHAN_BENCH_PORT,
+                                     VCHAN_BUFFER_SIZE, VCHAN_BUFFER_SIZE);
+    if (v->server == NULL) {
+        LOG(ERROR, "libvchan_server_init failed");
+        return -1;
+    }
+    v->client = libvchan_client_init_async(0, VCHAN_BENCH_PORT, &wait_fd);
+    if (v->client == NULL) {
+        LOG(ERROR, "libvchan_client_init_async failed");
+        return -1;
+    }
+    if (qubes_wait_for_vchan_connection_with_timeout(
+                v->server, libvchan_fd_for_select(v->server), true, 5) ||
+            qubes_wait_for_vchan_connection_with_timeout(
+                v->client, wait_fd, false, 5)) {
+        LOG(ERROR, "vchan connection failed");
+        return -1;
+    }
+    if (pipe2(v->pipe_fds, O_CLOEXEC | O_NONBLOCK)) {
+        PERROR("pipe2");
+        return -1;
+    }
+    v->data_buf.buflen = (int)max_data_chunk_size(QREXEC_PROTOCOL_VERSION);
+    v->data_buf.data = malloc((size_t)v->data_buf.buflen);
+    if (v->data_buf.data == NULL) {
+        PERROR("malloc");
+        return -1;
+    }
+    buffer_init(&v->stdin_buf);
+    return 0;
+}
+
+static void write_file(const char *path, const char *content, mode_t mode)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+
+    if (fd < 0 || !write_all(fd, content, (int)strlen(content)) || close(fd)) {
+        PERROR("write %s", path);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char tmpdir[] = "/tmp/qrexec-bench-XXXXXX";
+    char service_dir[sizeof(tmpdir) + sizeof("/rpc")];
+    char service_path[sizeof(service_dir) + sizeof("/qubes.Bench")];
+    char config_path[sizeof(tmpdir) + sizeof("/qubes.Bench")];
+    static const char cmdline[] =
+        "user:QUBESRPC qubes.Bench+some-argument source-vm";
+    struct buffer buf;
+    struct stdin_ctx stdin_ctx = { 0 };
+    char replace_buf[CHUNK_SIZE];
+    struct qrexec_parsed_command *find_cmd;
+    struct vchan_ctx vchan_ctx = { 0 };
+    bool vchan_ok;
+
+    setup_logging("qrexec-bench");
+    /* mostly printable text, with some control and high bytes mixed in */
+    for (size_t i = 0; i < sizeof(chunk); i++)
+        chunk[i] = (char)(i % 61 ? 'a' + i % 26 : i % 256);
+
+    if (mkdtemp(tmpdir) == NULL) {
+        PERROR("mkdtemp");
+        return 1;
+    }
+    snprintf(service_dir, sizeof(service_dir), "%s/rpc", tmpdir);
+    snprintf(service_path, sizeof(service_path), "%s/qubes.Bench", service_dir);
+    snprintf(config_path, sizeof(config_path), "%s/qubes.Bench", tmpdir);
+    if (mkdir(service_dir, 0700)) {
+        PERROR("mkdir %s", service_dir);
+        return 1;
+    }
+    write_file(service_path, "#!/bin/sh\n", 0700);
+    write_file(config_path,
+               "# service config\n"
+               "wait-for-session = true\n"
+               "force-user = 'bench'\n"
+               "skip-service-descriptor = false\n"
+               "exit-on-service-eof = true\n"
+               "max-instances = 4\n"
+               "cpu-weight = 50\n",
+               0600);
+    if (setenv("QREXEC_SERVICE_PATH", service_dir, 1)) {
+        PERROR("setenv");
+        return 1;
+    }
+
+    buffer_init(&buf);
+    buffer_init(&stdin_ctx.buf);
+    stdin_ctx.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    vchan_ctx.null_fd = stdin_ctx.fd;
+    if (stdin_ctx.fd < 0) {
+        PERROR("open /dev/null");
+        return 1;
+    }
+    find_cmd = parse_qubes_rpc_command(cmdline, true);
+    if (find_cmd == NULL)
+        return 1;
+    vchan_ok = setup_vchan(&vchan_ctx, tmpdir) == 0;
+
+    const struct bench benches[] = {
+        { "buffer_append_remove", CHUNK_SIZE, bench_buffer, &buf },
+        { "write_stdin", CHUNK_SIZE, bench_write_stdin, &stdin_ctx },
+        { "flush_client_data", CHUNK_SIZE, bench_flush_client_data, &stdin_ctx },
+        { "do_replace_chars", CHUNK_SIZE, bench_replace_chars, replace_buf },
+        { "parse_qubes_rpc_command", 0, bench_parse, (void *)cmdline },
+        { "qubes_toml_config_parse", 0, bench_toml, config_path },
+        { "find_qrexec_service", 0, bench_find_service, find_cmd },
+        { "handle_input_v2+handle_remote_data_v2", CHUNK_SIZE,
+          bench_vchan_data, &vchan_ctx },
+    };
+
+    printf("# name\titerations\tns/op\tbytes/s\n");
+    for (size_t i = 0; i < ARRAY_SIZE(benches); i++) {
+        if (!bench_selected(benches[i].name, argc, argv))
+            continue;
+        if (benches[i].run == bench_vchan_data && !vchan_ok) {
+            printf("# %s: skipped, no vchan connection\n", benches[i].name);
+            continue;
+        }
+        run_bench(&benches[i]);
+    }
+
+    if (vchan_ctx.server)
+        libvchan_close(vchan_ctx.server);
+    if (vchan_ctx.client)
+        libvchan_close(vchan_ctx.client);
+    destroy_qrexec_parsed_command(find_cmd);
+    buffer_free(&buf);
+    unlink(service_path);
+    unlink(config_path);
+    rmdir(service_dir);
+    rmdir(tmpdir);
+    return 0;
+}
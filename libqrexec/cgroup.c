@@ -0,0 +1,169 @@
+/*
+ * Per-service cgroups.
+ *
+ * When QREXEC_SERVICE_CGROUP points to a cgroup v2 directory writable by the
+ * caller (for example delegated to qrexec-agent by systemd), services with
+ * cpu-weight, io-weight or memory-high configured are started in a child
+ * cgroup named after the service, with those values set.  Calls of the same
+ * service share the cgroup, so the weights apply to the service as a whole.
+ *
+ * The process is created directly in the cgroup with clone3(CLONE_INTO_CGROUP)
+ * where the kernel supports it, otherwise it moves itself there right after
+ * fork(), before running anything else.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/sched.h>
+#endif
+
+#include "libqrexec-utils.h"
+#include "private.h"
+
+/* Path of the cgroup the current service process was started in, empty if
+ * none.  Kept as a path, since fix_fds() closes the directory FD.  Set only
+ * between qrexec_open_service_cgroup() and qrexec_close_service_cgroup(), so
+ * that processes spawned later without a cgroup of their own do not inherit
+ * it. */
+static char service_cgroup_path[PATH_MAX];
+
+static bool cgroup_configured(const struct qrexec_parsed_command *cmd)
+{
+    return cmd->cpu_weight || cmd->io_weight || cmd->memory_high;
+}
+
+static int write_cgroup_file(int dir_fd, const char *name, const char *value)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    ssize_t len = (ssize_t)strlen(value);
+
+    if (fd < 0)
+        return -1;
+    if (write(fd, value, (size_t)len) != len) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return close(fd);
+}
+
+int qrexec_open_service_cgroup(const struct qrexec_parsed_command *cmd)
+{
+    const char *base = getenv("QREXEC_SERVICE_CGROUP");
+    char value[32];
+    int base_fd, fd;
+
+    service_cgroup_path[0] = '\0';
+    if (cmd->service_name == NULL || !cgroup_configured(cmd))
+        return -1;
+    if (base == NULL || base[0] == '\0') {
+        LOG(WARNING, "Service %s has cgroup settings, but QREXEC_SERVICE_CGROUP is not set, ignoring",
+            cmd->service_name);
+        return -1;
+    }
+
+    base_fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0) {
+        PERROR("open %s", base);
+        return -1;
+    }
+    /* controllers may be enabled already, or not available at all - the
+     * writes below will tell */
+    (void)write_cgroup_file(base_fd, "cgroup.subtree_control", "+cpu +io +memory");
+    if (mkdirat(base_fd, cmd->service_name, 0755) && errno != EEXIST) {
+        PERROR("mkdir %s/%s", base, cmd->service_name);
+        close(base_fd);
+        return -1;
+    }
+    fd = openat(base_fd, cmd->service_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(base_fd);
+    if (fd < 0) {
+        PERROR("open %s/%s", base, cmd->service_name);
+        return -1;
+    }
+
+    /* the values from the latest call apply to all running ones */
+    if (cmd->cpu_weight) {
+        snprintf(value, sizeof(value), "%u", cmd->cpu_weight);
+        if (write_cgroup_file(fd, "cpu.weight", value))
+            PERROR("Failed to set cpu.weight of %s", cmd->service_name);
+    }
+    if (cmd->io_weight) {
+        snprintf(value, sizeof(value), "default %u", cmd->io_weight);
+        if (write_cgroup_file(fd, "io.weight", value))
+            PERROR("Failed to set io.weight of %s", cmd->service_name);
+    }
+    if (cmd->memory_high) {
+        snprintf(value, sizeof(value), "%llu", cmd->memory_high);
+        if (write_cgroup_file(fd, "memory.high", value))
+            PERROR("Failed to set memory.high of %s", cmd->service_name);
+    }
+
+    if ((size_t)snprintf(service_cgroup_path, sizeof(service_cgroup_path),
+                         "%s/%s", base, cmd->service_name)
+            >= sizeof(service_cgroup_path)) {
+        LOG(ERROR, "cgroup path too long");
+        service_cgroup_path[0] = '\0';
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void qrexec_close_service_cgroup(int cgroup_fd)
+{
+    service_cgroup_path[0] = '\0';
+    close(cgroup_fd);
+}
+
+pid_t qrexec_fork_into_cgroup(int cgroup_fd)
+{
+    pid_t pid;
+
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args = {
+        .flags = CLONE_INTO_CGROUP,
+        .exit_signal = SIGCHLD,
+        .cgroup = (uint64_t)cgroup_fd,
+    };
+
+    /* the caller is single-threaded, so skipping the libc fork handlers is
+     * fine */
+    pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+        return pid;
+#else
+    (void)cgroup_fd;
+#endif
+    pid = fork();
+    if (pid == 0)
+        qrexec_rejoin_service_cgroup();
+    return pid;
+}
+
+void qrexec_rejoin_service_cgroup(void)
+{
+    char procs_path[PATH_MAX + sizeof("/cgroup.procs")];
+    int fd;
+
+    if (service_cgroup_path[0] == '\0')
+        return;
+    snprintf(procs_path, sizeof(procs_path), "%s/cgroup.procs",
+             service_cgroup_path);
+    fd = open(procs_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "0", 1) != 1)
+        PERROR("Failed to move service to %s", service_cgroup_path);
+    if (fd >= 0)
+        close(fd);
+}
@@ -36,6 +36,8 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include "qrexec.h"
 #include "libqrexec-utils.h"
 #include "private.h"
@@ -114,6 +116,7 @@ void fix_fds(int fdin, int fdout, int fderr)
 
 static int do_fork_exec(const char *user,
         const char *cmdline,
+        int cgroup_fd,
         int *pid,
         int *stdin_fd,
         int *stdout_fd,
@@ -130,7 +133,8 @@ static int do_fork_exec(const char *user,
         /* FD leaks do not matter, we exit soon anyway */
         return -2;
     }
-    switch (*pid = fork()) {
+    *pid = cgroup_fd >= 0 ? qrexec_fork_into_cgroup(cgroup_fd) : fork();
+    switch (*pid) {
         case -1:
             PERROR("fork");
             /* ditto */
@@ -201,6 +205,22 @@ out:
     return result;
 }
 
+/*
+  If the symlink target is "/dev/tcp" or "/dev/tcp-mux", optionally followed
+  by "/" and more, return the length of that prefix, otherwise 0.
+ */
+static size_t tcp_symlink_prefix_len(const char *target, size_t target_len) {
+    static const char *const prefixes[] = { "/dev/tcp", "/dev/tcp-mux" };
+
+    for (size_t i = 0; i < ARRAY_SIZE(prefixes); i++) {
+        size_t len = strlen(prefixes[i]);
+        if (target_len >= len && memcmp(target, prefixes[i], len) == 0 &&
+            (target_len == len || target[len] == '/'))
+            return len;
+    }
+    return 0;
+}
+
 /*
   Find a file in the ':'-delimited list of paths given in path_list.
   Returns 0 on success, -1 if the file is definitely absent in all of the
@@ -210,7 +230,8 @@ out:
   will contain the path to the file, while statbuf will contain metadata
   about the file as reported by stat(2).
   If statbuf is not NULL, buffer may be filled with string starting
-  with "/dev/tcp/", which corresponds to the target of the symbolic link.
+  with "/dev/tcp" or "/dev/tcp-mux", which corresponds to the target of the
+  symbolic link.
   In this case, statbuf will contain the metadata for the symlink itself,
   not its (hopefully nonexistent) target.
  */
@@ -267,15 +288,16 @@ static int find_file(
                     goto done;
                 }
                 size_t target_len = (size_t)res;
-                if ((target_len >= sizeof("/dev/tcp") && memcmp(buf, "/dev/tcp/", sizeof("/dev/tcp")) == 0) ||
-                    (target_len == sizeof("/dev/tcp") - 1 && memcmp(buf, "/dev/tcp/", sizeof("/dev/tcp") - 1) == 0))
+                size_t prefix_len = tcp_symlink_prefix_len(buf, target_len);
+                if (prefix_len)
                 {
                     if (target_len >= buffer_size) {
                         /* buffer too small */
                         LOG(ERROR, "Buffer size %zu too small for target length %zu", buffer_size, target_len);
                         rc = -2;
-                    } else if (target_len == sizeof("/dev/tcp")) {
-                        LOG(ERROR, "/dev/tcp/ not followed by host");
+                    } else if (target_len == prefix_len + 1) {
+                        LOG(ERROR, "%.*s not followed by host",
+                            (int)target_len, buf);
                         rc = -2;
                     } else {
                         memcpy(buffer, buf, target_len);
@@ -332,14 +354,24 @@ static int load_service_config_raw(struct qrexec_parsed_command *cmd,
     return qubes_toml_config_parse(config_full_path, &cmd->wait_for_session, user,
                                    &cmd->send_service_descriptor,
                                    &cmd->exit_on_stdout_eof,
-                                   &cmd->exit_on_stdin_eof);
+                                   &cmd->exit_on_stdin_eof,
+                                   &cmd->threaded_io,
+                                   &cmd->accept_fds,
+                                   &cmd->max_instances,
+                                   &cmd->max_queued,
+                                   &cmd->cpu_weight,
+                                   &cmd->io_weight,
+                                   &cmd->memory_high,
+                                   &cmd->connect_timeout);
 }
 
 bool qrexec_cmd_use_fork_server(const struct qrexec_parsed_command *cmd) {
     if (cmd == NULL)
         return false;
+    /* the fork server cannot start services in their own cgroup */
     return !cmd->nogui && cmd->send_service_descriptor && !cmd->exit_on_stdin_eof &&
-           !cmd->exit_on_stdout_eof;
+           !cmd->exit_on_stdout_eof && !cmd->threaded_io &&
+           !cmd->cpu_weight && !cmd->io_weight && !cmd->memory_high;
 }
 
 int load_service_config_v2(struct qrexec_parsed_command *cmd) {
@@ -362,8 +394,10 @@ int load_service_config_v2(struct qrexec_parsed_command *cmd) {
                 "exit-on-service-eof=true", cmd->service_descriptor);
             return -1;
         }
-        free(cmd->username);
+        if (cmd->username_allocated)
+            free(cmd->username);
         cmd->username = tmp_user;
+        cmd->username_allocated = true;
     }
     return res;
 }
@@ -378,19 +412,15 @@ int load_service_config(struct qrexec_parsed_command *cmd,
     return rc;
 }
 
-/* Duplicates a buffer and adds a NUL terminator.
- * Same as strndup(), except that it logs on failure (with PERROR())
- * and always copies exactly "len" bytes, even if some of them are NUL
- * bytes.  This guarantees that the output buffer is of the expected
- * length and saves an unneeded call to strnlen(). */
-static char* memdupnul(const char *ptr, size_t len) {
-    char *buf = malloc(len + 1);
-    if (buf == NULL) {
-        PERROR("malloc");
-        return NULL;
-    }
+/* Copies a buffer to *dest* and adds a NUL terminator, advancing *dest* past
+ * it.  Always copies exactly "len" bytes, even if some of them are NUL bytes.
+ * This guarantees that the output buffer is of the expected length and saves
+ * an unneeded call to strnlen(). */
+static char *copy_string(char **dest, const char *ptr, size_t len) {
+    char *buf = *dest;
     memcpy(buf, ptr, len);
     buf[len] = '\0';
+    *dest = buf + len + 1;
     return buf;
 }
 
@@ -398,120 +428,132 @@ struct qrexec_parsed_command *parse_qubes_rpc_command(
     const char *cmdline, bool strip_username) {
 
     struct qrexec_parsed_command *cmd;
-
-    if (!(cmd = calloc(1, sizeof(*cmd)))) {
-        PERROR("calloc");
-        return NULL;
-    }
-
-    cmd->send_service_descriptor = true;
-    cmd->cmdline = cmdline;
+    /* parts of cmdline copied into the same allocation as cmd */
+    size_t username_len = 0, descriptor_len = 0, name_len = 0, domain_len = 0;
+    const char *command, *descriptor = NULL, *plus = NULL, *domain = NULL;
+    size_t size;
+    bool nogui;
+    char *strings;
 
     if (strip_username) {
         const char *colon = strchr(cmdline, ':');
         if (!colon) {
             LOG(ERROR, "Bad command from dom0 (%s): no colon", cmdline);
-            goto err;
+            return NULL;
         }
-        cmd->username = memdupnul(cmdline, (size_t)(colon - cmdline));
-        if (!cmd->username)
-            goto err;
-        cmd->command = colon + 1;
+        username_len = (size_t)(colon - cmdline);
+        command = colon + 1;
     } else
-        cmd->command = cmdline;
+        command = cmdline;
 
-    if (strncmp(cmd->command, NOGUI_CMD_PREFIX, NOGUI_CMD_PREFIX_LEN) == 0) {
-        cmd->nogui = true;
-        cmd->command += NOGUI_CMD_PREFIX_LEN;
-    } else
-        cmd->nogui = false;
+    nogui = strncmp(command, NOGUI_CMD_PREFIX, NOGUI_CMD_PREFIX_LEN) == 0;
+    if (nogui)
+        command += NOGUI_CMD_PREFIX_LEN;
 
     /* If the command starts with "QUBESRPC", parse service descriptor */
-    if (strncmp(cmd->command, RPC_REQUEST_COMMAND,
+    if (strncmp(command, RPC_REQUEST_COMMAND,
                 RPC_REQUEST_COMMAND_LEN) == 0) {
-        const char *start, *end;
+        const char *end;
 
         /* Check for space after "QUBESRPC" */
-        if (cmd->command[RPC_REQUEST_COMMAND_LEN] != ' ') {
+        if (command[RPC_REQUEST_COMMAND_LEN] != ' ') {
             LOG(ERROR, "\"" RPC_REQUEST_COMMAND "\" not followed by space");
-            goto err;
+            return NULL;
         }
 
         /* Parse service descriptor ("qubes.Service+arg") */
-        start = cmd->command + RPC_REQUEST_COMMAND_LEN + 1;
-        end = strchr(start, ' ');
+        descriptor = command + RPC_REQUEST_COMMAND_LEN + 1;
+        end = strchr(descriptor, ' ');
         if (!end) {
             LOG(ERROR, "No space found after service descriptor");
-            goto err;
+            return NULL;
         }
 
-        if (end <= start) {
+        if (end <= descriptor) {
             LOG(ERROR, "Service descriptor is empty (too many spaces after QUBESRPC?)");
-            goto err;
+            return NULL;
         }
 
-        size_t const descriptor_len = (size_t)(end - start);
+        descriptor_len = (size_t)(end - descriptor);
         if (descriptor_len > MAX_SERVICE_NAME_LEN) {
             LOG(ERROR, "Command too long (length %zu)", descriptor_len);
-            goto err;
+            return NULL;
         }
 
         /* Parse service name ("qubes.Service") */
 
-        char *const plus = memchr(start, '+', descriptor_len);
-        size_t const name_len = plus != NULL ? (size_t)(plus - start) : descriptor_len;
+        plus = memchr(descriptor, '+', descriptor_len);
+        name_len = plus != NULL ? (size_t)(plus - descriptor) : descriptor_len;
         if (name_len > NAME_MAX) {
             LOG(ERROR, "Service name too long to execute (length %zu)", name_len);
-            goto err;
+            return NULL;
         }
         if (name_len < 1) {
             LOG(ERROR, "Service name empty");
-            goto err;
+            return NULL;
+        }
+        /* the name is used as a file name, for example of the cgroup */
+        if ((name_len == 1 && descriptor[0] == '.') ||
+                (name_len == 2 && memcmp(descriptor, "..", 2) == 0)) {
+            LOG(ERROR, "Invalid service name");
+            return NULL;
         }
-        cmd->service_name = memdupnul(start, name_len);
-        if (!cmd->service_name)
-            goto err;
-
-        /* If there is no service argument, add a trailing "+" to the descriptor */
-        cmd->service_descriptor = memdupnul(start, descriptor_len + (plus == NULL));
-        if (!cmd->service_descriptor)
-            goto err;
-        if (plus == NULL)
-            cmd->service_descriptor[descriptor_len] = '+';
-        else
-            cmd->arg = cmd->service_descriptor + (plus + 1 - start);
 
         /* Parse source domain */
 
-        start = end + 1; /* after the space */
-        end = strchrnul(start, ' ');
-        if (end <= start) {
+        domain = end + 1; /* after the space */
+        end = strchrnul(domain, ' ');
+        if (end <= domain) {
             LOG(ERROR, "Source domain is empty (too many spaces after service descriptor?)");
-            goto err;
+            return NULL;
         }
-        cmd->source_domain = memdupnul(start, (size_t)(end - start));
-        if (!cmd->source_domain)
-            goto err;
+        domain_len = (size_t)(end - domain);
     }
 
-    return cmd;
+    /* The structure and all its strings are allocated at once, each string
+     * with its NUL terminator.  If there is no service argument, the
+     * descriptor gets a trailing "+". */
+    size = sizeof(*cmd);
+    if (strip_username)
+        size += username_len + 1;
+    if (descriptor)
+        size += (descriptor_len + (plus == NULL) + 1) + (name_len + 1) +
+                (domain_len + 1);
+    if (!(cmd = calloc(1, size))) {
+        PERROR("calloc");
+        return NULL;
+    }
+    strings = (char *)(cmd + 1);
 
-err:
-    destroy_qrexec_parsed_command(cmd);
-    return NULL;
+    cmd->send_service_descriptor = true;
+    cmd->cmdline = cmdline;
+    cmd->command = command;
+    cmd->nogui = nogui;
+    if (strip_username)
+        cmd->username = copy_string(&strings, cmdline, username_len);
+    if (descriptor) {
+        cmd->service_name = copy_string(&strings, descriptor, name_len);
+        cmd->service_descriptor = copy_string(&strings, descriptor,
+                                              descriptor_len + (plus == NULL));
+        if (plus == NULL)
+            cmd->service_descriptor[descriptor_len] = '+';
+        else
+            cmd->arg = cmd->service_descriptor + (plus + 1 - descriptor);
+        cmd->source_domain = copy_string(&strings, domain, domain_len);
+    }
+    assert(strings == (char *)cmd + size);
+
+    return cmd;
 }
 
 void destroy_qrexec_parsed_command(struct qrexec_parsed_command *cmd) {
     if (cmd == NULL)
         return;
-    if (cmd->username)
+    /* replaced by force-user from the service config */
+    if (cmd->username_allocated)
         free(cmd->username);
-    if (cmd->service_descriptor)
-        free(cmd->service_descriptor);
-    if (cmd->service_name)
-        free(cmd->service_name);
-    if (cmd->source_domain)
-        free(cmd->source_domain);
+    if (cmd->plugin)
+        qrexec_free_plugin(cmd->plugin);
     free(cmd);
 }
 
@@ -550,11 +592,15 @@ int execute_parsed_qubes_rpc_command(
             *pid = 0;
             return 0;
         }
-        return do_fork_exec(cmd->username, cmd->command,
-                           pid, stdin_fd, stdout_fd, stderr_fd);
+        int cgroup_fd = qrexec_open_service_cgroup(cmd);
+        int ret = do_fork_exec(cmd->username, cmd->command, cgroup_fd,
+                               pid, stdin_fd, stdout_fd, stderr_fd);
+        if (cgroup_fd >= 0)
+            qrexec_close_service_cgroup(cgroup_fd);
+        return ret;
     } else {
         // Legacy qrexec behavior: spawn shell directly
-        return do_fork_exec(cmd->username, cmd->command,
+        return do_fork_exec(cmd->username, cmd->command, -1,
                            pid, stdin_fd, stdout_fd, stderr_fd);
     }
 }
@@ -577,8 +623,74 @@ static bool validate_port(const char *port) {
 #undef MAXPORTLEN
 }
 
-static int qubes_tcp_connect(const char *host, const char *port)
+/* Delay before starting a connection to the next address while the previous
+ * ones are still in progress (RFC 8305). */
+#define TCP_CONNECT_ATTEMPT_DELAY_MS 250
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        abort();
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Order the addresses to try, alternating between the address families,
+ * starting with the family of the first address (RFC 8305 section 4). */
+static size_t tcp_connect_order(struct addrinfo *addrs,
+                                struct addrinfo **order)
+{
+    struct addrinfo *first[TCP_CONNECT_MAX_ADDRS], *other[TCP_CONNECT_MAX_ADDRS];
+    size_t nfirst = 0, nother = 0, count = 0;
+
+    for (struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+        if (addr->ai_family == addrs->ai_family) {
+            if (nfirst < TCP_CONNECT_MAX_ADDRS)
+                first[nfirst++] = addr;
+        } else if (nother < TCP_CONNECT_MAX_ADDRS) {
+            other[nother++] = addr;
+        }
+    }
+    for (size_t i = 0; count < TCP_CONNECT_MAX_ADDRS &&
+                       (i < nfirst || i < nother); i++) {
+        if (i < nfirst)
+            order[count++] = first[i];
+        if (i < nother && count < TCP_CONNECT_MAX_ADDRS)
+            order[count++] = other[i];
+    }
+    return count;
+}
+
+/* Start a non-blocking connection, returns the socket or -1 with errno
+ * set. */
+static int tcp_connect_start(const struct addrinfo *addr)
+{
+    int one = 1;
+    int sockfd = socket(addr->ai_family,
+                        addr->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        addr->ai_protocol);
+
+    if (sockfd < 0)
+        return -1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) != 0)
+        abort();
+    if (connect(sockfd, addr->ai_addr, addr->ai_addrlen) != 0 &&
+            errno != EINPROGRESS) {
+        int err = errno;
+        close(sockfd);
+        errno = err;
+        return -1;
+    }
+    return sockfd;
+}
+
+int qubes_tcp_connect_begin(struct qubes_tcp_connect *conn, const char *host,
+                            const char *port, bool allow_names,
+                            unsigned int timeout)
 {
+    conn->addrs = NULL;
+    conn->active = 0;
     // Work around a glibc bug: overly-large port numbers not rejected
     if (!validate_port(port)) {
         LOG(ERROR, "Invalid port number %s", port);
@@ -596,37 +708,136 @@ static int qubes_tcp_connect(const char *host, const char *port)
         .ai_family = must_be_ipv6_addr ? AF_INET6 : AF_UNSPEC,
         .ai_socktype = SOCK_STREAM,
         .ai_protocol = IPPROTO_TCP,
-    }, *addrs;
-    int rc = getaddrinfo(host, port, &hints, &addrs);
+    };
+    int rc = getaddrinfo(host, port, &hints, &conn->addrs);
+    if (rc == EAI_NONAME && allow_names) {
+        /* Not an address, resolve it as a name.  No AI_ADDRCONFIG: it counts
+         * only non-loopback addresses, so it would drop ::1 on a host without
+         * global IPv6.  An address family that is not configured just fails
+         * its connection attempt, and the next address is tried. */
+        hints.ai_flags = AI_NUMERICSERV;
+        rc = getaddrinfo(host, port, &hints, &conn->addrs);
+    }
     if (rc != 0) {
         /* data comes from symlink or from qrexec service argument, which has already
          * been sanitized */
         LOG(ERROR, "getaddrinfo(%s, %s) failed: %s", host, port, gai_strerror(rc));
         return -1;
     }
-    rc = -1;
-    assert(addrs != NULL && "getaddrinfo() returned zero addresses");
-    assert(addrs->ai_next == NULL &&
-           "getaddrinfo() returned multiple addresses despite AI_NUMERICHOST | AI_NUMERICSERV");
-    int sockfd = socket(addrs->ai_family,
-                        addrs->ai_socktype | SOCK_CLOEXEC,
-                        addrs->ai_protocol);
-    if (sockfd < 0)
-        goto freeaddrs;
-    {
-        int one = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) != 0)
-            abort();
+    assert(conn->addrs != NULL && "getaddrinfo() returned zero addresses");
+
+    conn->host = host;
+    conn->port = port;
+    conn->count = tcp_connect_order(conn->addrs, conn->order);
+    conn->started = conn->active = 0;
+    conn->next_start = monotonic_ms();
+    conn->deadline = timeout ? conn->next_start + (long long)timeout * 1000 : -1;
+    conn->last_error = 0;
+    return 0;
+}
+
+/*
+ * Connect to the addresses in parallel: start with the first one, and start
+ * the next one whenever an attempt fails or the previous one did not finish
+ * in TCP_CONNECT_ATTEMPT_DELAY_MS.  The first connection established wins.
+ * A single unreachable address thus does not delay the service start for a
+ * whole TCP timeout.
+ */
+int qubes_tcp_connect_step(struct qubes_tcp_connect *conn, int *timeout_ms)
+{
+    long long now = monotonic_ms();
+    int rc = -1;
+
+    for (size_t i = 0; i < conn->active; ) {
+        if (!conn->fds[i].revents) {
+            i++;
+            continue;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+            err = errno;
+        if (err == 0) {
+            rc = conn->fds[i].fd;
+            conn->fds[i] = conn->fds[--conn->active];
+            goto out;
+        }
+        conn->last_error = err;
+        close(conn->fds[i].fd);
+        conn->fds[i] = conn->fds[--conn->active];
+        /* try the next address right away */
+        conn->next_start = now;
     }
-    int res = connect(sockfd, addrs->ai_addr, addrs->ai_addrlen);
-    if (res != 0) {
-        PERROR("connect");
-        close(sockfd);
-    } else {
-        rc = sockfd;
+    while (conn->started < conn->count &&
+           (conn->active == 0 || now >= conn->next_start)) {
+        int sockfd = tcp_connect_start(conn->order[conn->started++]);
+        if (sockfd < 0) {
+            conn->last_error = errno;
+            continue;
+        }
+        conn->fds[conn->active++] = (struct pollfd) {
+            .fd = sockfd,
+            .events = POLLOUT,
+        };
+        conn->next_start = now + TCP_CONNECT_ATTEMPT_DELAY_MS;
+    }
+    if (conn->active == 0)
+        goto out;
+    if (conn->deadline >= 0 && now >= conn->deadline) {
+        conn->last_error = ETIMEDOUT;
+        goto out;
+    }
+
+    long long wait = -1;
+    if (conn->started < conn->count)
+        wait = conn->next_start - now;
+    if (conn->deadline >= 0 && (wait < 0 || conn->deadline - now < wait))
+        wait = conn->deadline - now;
+    *timeout_ms = (int)wait;
+    return -2;
+
+out:
+    if (rc < 0) {
+        bool const ipv6 = strchr(conn->host, ':') != NULL ||
+                          strchr(conn->host, '%') != NULL;
+        LOG(ERROR, "connect to %s%s%s:%s failed: %s",
+            ipv6 ? "[" : "",
+            conn->host,
+            ipv6 ? "]" : "",
+            conn->port, strerror(conn->last_error));
+    }
+    qubes_tcp_connect_cancel(conn);
+    return rc;
+}
+
+void qubes_tcp_connect_cancel(struct qubes_tcp_connect *conn)
+{
+    for (size_t i = 0; i < conn->active; i++)
+        close(conn->fds[i].fd);
+    conn->active = 0;
+    if (conn->addrs) {
+        freeaddrinfo(conn->addrs);
+        conn->addrs = NULL;
+    }
+}
+
+int qubes_tcp_connect(const char *host, const char *port, bool allow_names,
+                      unsigned int timeout)
+{
+    struct qubes_tcp_connect conn;
+    int rc, wait;
+
+    if (qubes_tcp_connect_begin(&conn, host, port, allow_names, timeout) < 0)
+        return -1;
+    while ((rc = qubes_tcp_connect_step(&conn, &wait)) == -2) {
+        if (poll(conn.fds, conn.active, wait) < 0 && errno != EINTR) {
+            PERROR("poll");
+            qubes_tcp_connect_cancel(&conn);
+            return -1;
+        }
     }
-freeaddrs:
-    freeaddrinfo(addrs);
+    if (rc >= 0)
+        set_block(rc);
     return rc;
 }
 
@@ -651,6 +862,22 @@ int find_qrexec_service(
         ret = find_file(qrexec_service_path, cmd->service_name,
                         path_buffer.data, (size_t)path_buffer.buflen,
                         &statbuf);
+    if (ret == -1) {
+        /* Plugin service */
+        char plugin_name[NAME_MAX + sizeof(".so")];
+        const char *names[] = { cmd->service_descriptor, cmd->service_name };
+
+        for (size_t i = 0; ret == -1 && i < ARRAY_SIZE(names); i++) {
+            snprintf(plugin_name, sizeof(plugin_name), "%s.so", names[i]);
+            ret = find_file(qrexec_service_path, plugin_name,
+                            path_buffer.data, (size_t)path_buffer.buflen,
+                            &statbuf);
+        }
+        if (ret == 0 && S_ISREG(statbuf.st_mode))
+            return qrexec_start_plugin(cmd, path_buffer.data, socket_fd);
+        if (ret == 0)
+            ret = -1;
+    }
     if (ret < 0) {
         if (ret == -1)
             LOG(ERROR, "Service not found: %s", cmd->service_descriptor);
@@ -682,10 +909,14 @@ int find_qrexec_service(
         return 0;
     } else if (S_ISLNK(statbuf.st_mode)) {
         /* TCP-based service */
-        assert(path_buffer.buflen >= (int)sizeof("/dev/tcp") - 1);
-        assert(memcmp(path_buffer.data, "/dev/tcp", sizeof("/dev/tcp") - 1) == 0);
-        char *address = path_buffer.data + (sizeof("/dev/tcp") - 1);
+        size_t prefix_len = tcp_symlink_prefix_len(path_buffer.data,
+                                                   strlen(path_buffer.data));
+        assert(prefix_len > 0);
+        bool mux = prefix_len > sizeof("/dev/tcp") - 1;
+        char *address = path_buffer.data + prefix_len;
         char *host = NULL, *port = NULL;
+        /* only the service configuration may use host names */
+        bool allow_names = false;
         if (*address == '/') {
             host = address + 1;
             char *slash = strchr(host, '/');
@@ -693,6 +924,7 @@ int find_qrexec_service(
                 *slash = '\0';
                 port = slash + 1;
             }
+            allow_names = true;
         } else {
             assert(*address == '\0');
         }
@@ -705,6 +937,7 @@ int find_qrexec_service(
             if (host == NULL) {
                 /* Get both host and port from service arguments */
                 host = cmd->arg;
+                allow_names = false;
                 port = strrchr(cmd->arg, '+');
                 if (port == NULL) {
                     LOG(ERROR, "No port provided, cannot connect to %s", cmd->arg);
@@ -731,13 +964,31 @@ int find_qrexec_service(
             }
         }
 
+        if (cmd->accept_fds) {
+            LOG(WARNING, "Warning: ignoring accept-fds=true "
+                         "for TCP service %s",
+                path_buffer.data);
+            cmd->accept_fds = false;
+        }
+
+        if (mux) {
+            /* the stream carries frames only, never the descriptor */
+            if (!validate_port(port)) {
+                LOG(ERROR, "Invalid port number %s", port);
+                return -2;
+            }
+            return qrexec_start_tcp_mux(cmd, host, port, allow_names,
+                                        socket_fd);
+        }
+
         if (cmd->send_service_descriptor) {
             /* send part after "QUBESRPC ", including trailing NUL */
             const char *desc = cmd->command + RPC_REQUEST_COMMAND_LEN + 1;
             buffer_append(stdin_buffer, desc, strlen(desc) + 1);
         }
 
-        int res = qubes_tcp_connect(host, port);
+        int res = qubes_tcp_connect(host, port, allow_names,
+                                    cmd->connect_timeout);
         if (res == -1)
             return -2;
         *socket_fd = res;
@@ -763,6 +1014,12 @@ int find_qrexec_service(
                 path_buffer.data);
             cmd->exit_on_stdin_eof = false;
         }
+        if (cmd->accept_fds) {
+            LOG(WARNING, "Warning: ignoring accept-fds=true "
+                         "for executable service %s",
+                path_buffer.data);
+            cmd->accept_fds = false;
+        }
         return 0;
     }
 
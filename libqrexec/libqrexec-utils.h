@@ -27,9 +27,11 @@
 #define _GNU_SOURCE 1
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <libvchan.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 
 #include <libvchan.h>
@@ -60,7 +62,7 @@ struct qrexec_parsed_command {
     const char *cmdline;
 
     /* Username ("user", NULL when strip_username is false).
-     * Always safe to pass to free(). */
+     * Owned by the parsed command, do not free. */
     char *username;
 
     /* Override to disable "wait for session" */
@@ -90,6 +92,14 @@ struct qrexec_parsed_command {
     /* For socket-based services: Should the service descriptor be sent? */
     bool send_service_descriptor;
 
+    /* Maximum number of concurrently running calls of the service, 0 for no
+     * limit. */
+    unsigned int max_instances;
+
+    /* Number of calls that may wait for a running one to finish once
+     * max_instances is reached; further calls are refused. */
+    unsigned int max_queued;
+
     /* Remaining fields are private to libqrexec-utils.  Do not access them
      * directly - they may change in any update. */
 
@@ -104,8 +114,133 @@ struct qrexec_parsed_command {
     /* Pointer to the argument, or NULL if there is no argument.
      * Same buffer as "service_descriptor". */
     char *arg;
+
+    /* Should the two directions of data be handled by separate threads? */
+    bool threaded_io;
+
+    /* For socket-based services: May the service pass file descriptors to
+     * be sent to the client? */
+    bool accept_fds;
+
+    /* For plugin services: the running plugin, NULL otherwise. */
+    struct qrexec_plugin *plugin;
+
+    /* Was username replaced with a separately allocated string? Otherwise
+     * it is stored together with the structure, like the other strings. */
+    bool username_allocated;
+
+    /* cgroup v2 settings of the service, 0 if not set. */
+    unsigned int cpu_weight;
+    unsigned int io_weight;
+    unsigned long long memory_high;
+
+    /* For TCP-based services: seconds to wait for the connection, 0 for the
+     * kernel timeout. */
+    unsigned int connect_timeout;
+};
+
+/*
+ * Plugin services.
+ *
+ * A plugin is a shared object named after the service with ".so" appended
+ * ("qubes.Service+arg.so" or "qubes.Service.so"), placed in the service
+ * path.  Executable and socket services of the same name take precedence.
+ * Instead of forking and executing a program, it is loaded into the process
+ * handling the connection and its entry point is called on a separate
+ * thread, as the user running that process (qrexec-fork-server if it
+ * handles the call, otherwise qrexec-agent or qrexec-daemon).  Calls for
+ * any other user fail instead of loading the plugin.  Meant for trivial
+ * services, where process startup is most of the cost.
+ *
+ * The plugin must export:
+ *
+ *   const unsigned int qrexec_plugin_abi_version = QREXEC_PLUGIN_ABI_VERSION;
+ *   int qrexec_plugin_call(const struct qrexec_plugin_call *call);
+ *
+ * qrexec_plugin_call() returns the service exit code.  The streams are closed
+ * by qrexec after it returns; the plugin must not close them itself, nor call
+ * exit() or change process-wide state.
+ */
+#define QREXEC_PLUGIN_ABI_VERSION 1
+#define QREXEC_PLUGIN_ABI_VERSION_SYMBOL "qrexec_plugin_abi_version"
+#define QREXEC_PLUGIN_ENTRY_SYMBOL "qrexec_plugin_call"
+
+struct qrexec_plugin_call {
+    /* "qubes.Service+arg" */
+    const char *service_descriptor;
+    /* "qubes.Service" */
+    const char *service_name;
+    /* Service argument, NULL if none */
+    const char *arg;
+    /* Calling domain */
+    const char *source_domain;
+    /* Data from the client, EOF when the client closes its output */
+    FILE *stdin_stream;
+    /* Data to the client */
+    FILE *stdout_stream;
 };
 
+typedef int qrexec_plugin_entry_t(const struct qrexec_plugin_call *call);
+
+/*
+ * TCP connection multiplexing.
+ *
+ * A /dev/tcp-mux service (see find_qrexec_service()) carries many TCP
+ * connections over one qrexec stream, as frames made of a struct
+ * qrexec_tcp_mux_header followed by len bytes of data.  The client side
+ * (qrexec-tcp-mux) accepts TCP connections and opens them with
+ * QREXEC_TCP_MUX_OPEN; the service side connects to the service's host and
+ * port for each one.
+ *
+ * Each side may send at most QREXEC_TCP_MUX_WINDOW bytes of data for a
+ * connection before the other side grants more with QREXEC_TCP_MUX_CREDIT,
+ * so a slow connection never stops the stream.  A connection ends when EOF
+ * went both ways (and the data was written out), or at once with
+ * QREXEC_TCP_MUX_CLOSE.  The end of the stream counts as an EOF on every
+ * connection still open.  Connection IDs are chosen by the client and not
+ * reused; frames for an unknown ID are ignored.
+ */
+enum qrexec_tcp_mux_type {
+    /* client to service: connect, no data */
+    QREXEC_TCP_MUX_OPEN = 1,
+    /* connection data, 1 to QREXEC_TCP_MUX_MAX_DATA bytes */
+    QREXEC_TCP_MUX_DATA = 2,
+    /* no more data from the sender (shutdown(SHUT_WR)) */
+    QREXEC_TCP_MUX_EOF = 3,
+    /* connection failed or refused, drop it with any unwritten data; no
+     * reply */
+    QREXEC_TCP_MUX_CLOSE = 4,
+    /* data: uint32_t, number of bytes the receiver may send in addition */
+    QREXEC_TCP_MUX_CREDIT = 5,
+};
+
+struct qrexec_tcp_mux_header {
+    uint32_t type;
+    uint32_t id;
+    uint32_t len;
+};
+
+#define QREXEC_TCP_MUX_MAX_DATA 65536
+#define QREXEC_TCP_MUX_WINDOW (256 * 1024)
+#define QREXEC_TCP_MUX_MAX_CONNECTIONS 1024
+
+/**
+ * Run one side of a multiplexed stream until the peer closes it and the data
+ * queued by then is written out.
+ *
+ * @param in_fd Stream from the peer.
+ * @param out_fd Stream to the peer.
+ * @param listen_fd Client side: listening socket to accept connections
+ *        from.  -1 on the service side.
+ * @param host Service side: numeric address to connect to, NULL on the client
+ *        side.
+ * @param port Service side: port to connect to, NULL on the client side.
+ * @return 0 when the peer closed the stream, 1 on error.
+ */
+__attribute__((visibility("default")))
+int qrexec_tcp_mux_run(int in_fd, int out_fd, int listen_fd,
+                       const char *host, const char *port);
+
 /* Parse a command, return NULL on failure. Uses cmd->cmdline
    (do not free until destroy is called) */
 __attribute__((visibility("default")))
@@ -140,6 +275,14 @@ int load_service_config_v2(struct qrexec_parsed_command *cmd_name);
 typedef void (do_exec_t)(const char *cmdline, const char *user);
 __attribute__((visibility("default")))
 void register_exec_func(do_exec_t *func);
+/*
+ * Move the calling service process back to the cgroup it was started in (see
+ * the cpu-weight, io-weight and memory-high service settings), for *do_exec*
+ * functions running PAM session modules that may move it elsewhere. Does
+ * nothing if the service has no cgroup of its own.
+ */
+__attribute__((visibility("default")))
+void qrexec_rejoin_service_cgroup(void);
 /*
  * exec() qubes-rpc-multiplexer if *prog* starts with magic "QUBESRPC" keyword,
  * do not return in that case; pass *envp* to execve() as en environment
@@ -158,11 +301,15 @@ __attribute__((visibility("default")))
 void buffer_init(struct buffer *b);
 /* Free a buffer, setting its pointer to NULL and length to zero. */
 void buffer_free(struct buffer *b);
+/* Append data to a buffer */
+__attribute__((visibility("default")))
 void buffer_append(struct buffer *b, const char *data, int len);
 void buffer_remove(struct buffer *b, int len);
 int buffer_len(struct buffer *b);
 void *buffer_data(struct buffer *b);
 
+/* Write as much of the buffered data to a non-blocking fd as possible */
+__attribute__((visibility("default")))
 int flush_client_data(int fd, struct buffer *buffer);
 int write_stdin(int fd, const char *data, int len, struct buffer *buffer);
 
@@ -238,12 +385,54 @@ __attribute__((visibility("default")))
 int read_vchan_all(libvchan_t *vchan, void *data, size_t size);
 __attribute__((visibility("default")))
 int write_vchan_all(libvchan_t *vchan, const void *data, size_t size);
+
+/*
+ * Control messages waiting for space in the control vchan ring.  Messages are
+ * appended whole (header and body) and written out in order once the ring has
+ * room for the complete message, so the sender never blocks in the middle of
+ * a message.  A message larger than the ring is written out in pieces as
+ * space becomes available.
+ */
+struct vchan_queue {
+    struct buffer buf;
+    /* bytes of the first queued message already written */
+    size_t head_sent;
+    /* largest free space seen in the ring, a lower bound of its size */
+    int ring_space;
+};
+
+/* Queued bytes above which callers should stop accepting new requests */
+#define VCHAN_QUEUE_LIMIT (256 * 1024)
+
+/* Default size of each direction of the control vchan ring */
+#define VCHAN_CTRL_RING_SIZE 4096
+
+__attribute__((visibility("default")))
+void vchan_queue_init(struct vchan_queue *queue);
+/* Drop all queued messages, for example after the peer reconnected */
+__attribute__((visibility("default")))
+void vchan_queue_free(struct vchan_queue *queue);
+__attribute__((visibility("default")))
+void vchan_queue_append(struct vchan_queue *queue, const void *data, size_t size);
+/*
+ * Write as many complete queued messages as the ring has space for, and
+ * as much of a message that can never fit as possible.
+ * Returns 0 on success (even if some messages are still queued), -1 on vchan
+ * error.
+ */
+__attribute__((visibility("default")))
+int vchan_queue_flush(libvchan_t *vchan, struct vchan_queue *queue);
+__attribute__((visibility("default")))
+bool vchan_queue_empty(const struct vchan_queue *queue);
+__attribute__((visibility("default")))
+bool vchan_queue_full(const struct vchan_queue *queue);
 __attribute__((visibility("default")))
 int read_all(int fd, void *buf, int size);
 __attribute__((visibility("default")))
 int write_all(int fd, const void *buf, int size);
 __attribute__((visibility("default")))
 void fix_fds(int fdin, int fdout, int fderr);
+__attribute__((visibility("default")))
 void set_nonblock(int fd);
 void set_block(int fd);
 
@@ -317,6 +506,14 @@ struct process_io_request {
     // can be NULL
     volatile sig_atomic_t *sigusr1;
     struct prefix_data prefix_data;
+
+    /* Pass data from vchan to the local process on a separate thread, so
+     * that bulk transfers in both directions do not stall each other. */
+    bool threaded_io;
+
+    // can be NULL; filled with the resource usage of local_pid once it
+    // has been waited for
+    struct rusage *local_rusage;
 };
 
 /*
@@ -371,6 +568,23 @@ void qrexec_log(int level, int errnoval, const char *file, int line,
 __attribute__((visibility("default")))
 void setup_logging(const char *program_name);
 
+/*
+ * Control message tracing.  If QREXEC_TRACE_FILE is set, every control
+ * message handled between qrexec_trace_start() and qrexec_trace_end() is
+ * appended to that file, with its arrival time, the time it took to handle
+ * and the payload passed to qrexec_trace_payload().  Payloads are left out if
+ * QREXEC_TRACE_REDACT=1.  The trace can be fed to a daemon or agent again by
+ * qrexec/tests/socket/replay.py.
+ */
+__attribute__((visibility("default")))
+void qrexec_trace_init(const char *program_name);
+__attribute__((visibility("default")))
+void qrexec_trace_start(const struct msg_header *hdr);
+__attribute__((visibility("default")))
+void qrexec_trace_payload(const void *data, size_t len);
+__attribute__((visibility("default")))
+void qrexec_trace_end(void);
+
 /**
  * Make an Admin API call to qubesd.  The returned buffer must be released by
  * the caller using free().
@@ -0,0 +1,215 @@
+/*
+ * Plugin services: shared objects loaded into the process handling the
+ * connection, instead of forking and executing a program.
+ *
+ * The plugin runs on its own thread and talks to the client over one end of
+ * a socketpair. The other end is handed back to the caller of
+ * find_qrexec_service() as if it was a socket service, so the data is passed
+ * by the usual qrexec_process_io() loop.
+ *
+ * Services built into libqrexec (such as /dev/tcp-mux) run the same way,
+ * with an entry point taking a private argument instead of a loaded object.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+#include "private.h"
+
+struct qrexec_plugin {
+    pthread_t thread;
+    void *handle;
+    qrexec_plugin_entry_t *entry;
+    /* for services built into libqrexec instead of entry */
+    qrexec_builtin_entry_t *builtin;
+    void *data;
+    struct qrexec_plugin_call call;
+    bool joined;
+    int exit_code;
+};
+
+static void *plugin_thread(void *arg)
+{
+    struct qrexec_plugin *plugin = arg;
+
+    if (plugin->builtin)
+        plugin->exit_code = plugin->builtin(&plugin->call, plugin->data);
+    else
+        plugin->exit_code = plugin->entry(&plugin->call);
+    /* the client gets EOF once both streams are closed */
+    fclose(plugin->call.stdin_stream);
+    fclose(plugin->call.stdout_stream);
+    return NULL;
+}
+
+static void free_plugin_state(struct qrexec_plugin *plugin)
+{
+    if (plugin->handle)
+        dlclose(plugin->handle);
+    free(plugin->data);
+    free(plugin);
+}
+
+/* Start the plugin thread; frees the plugin on failure. */
+static int start_plugin_thread(struct qrexec_plugin *plugin,
+                               struct qrexec_parsed_command *cmd,
+                               int *socket_fd)
+{
+    int fds[2] = { -1, -1 }, out_fd = -1;
+    sigset_t all, old;
+    int err;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        PERROR("socketpair");
+        goto fail;
+    }
+    out_fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 0);
+    if (out_fd < 0) {
+        PERROR("fcntl(F_DUPFD_CLOEXEC)");
+        goto fail;
+    }
+    plugin->call = (struct qrexec_plugin_call) {
+        .service_descriptor = cmd->service_descriptor,
+        .service_name = cmd->service_name,
+        .arg = cmd->arg,
+        .source_domain = cmd->source_domain,
+        .stdin_stream = fdopen(fds[1], "r"),
+        .stdout_stream = fdopen(out_fd, "w"),
+    };
+    if (plugin->call.stdin_stream == NULL ||
+            plugin->call.stdout_stream == NULL) {
+        PERROR("fdopen");
+        goto fail;
+    }
+
+    /* signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&plugin->thread, NULL, plugin_thread, plugin);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        PERROR("pthread_create");
+        goto fail;
+    }
+
+    cmd->plugin = plugin;
+    *socket_fd = fds[0];
+    return 0;
+
+fail:
+    if (plugin->call.stdin_stream)
+        fclose(plugin->call.stdin_stream);
+    else if (fds[1] >= 0)
+        close(fds[1]);
+    if (plugin->call.stdout_stream)
+        fclose(plugin->call.stdout_stream);
+    else if (out_fd >= 0)
+        close(out_fd);
+    if (fds[0] >= 0)
+        close(fds[0]);
+    free_plugin_state(plugin);
+    return -2;
+}
+
+/* The plugin runs in this process, so it can only run as the user running
+ * it.  Calls for other users (such as calls to the default user handled by
+ * qrexec-agent itself, running as root) are refused rather than run with
+ * the wrong privileges. */
+static bool plugin_user_allowed(const struct qrexec_parsed_command *cmd,
+                                const char *path)
+{
+    struct passwd *pw;
+
+    if (cmd->username == NULL)
+        return true;
+    pw = getpwuid(geteuid());
+    if (pw != NULL && strcmp(pw->pw_name, cmd->username) == 0)
+        return true;
+    LOG(ERROR, "Plugin %s would run as %s instead of %s, refusing to load it",
+        path, pw != NULL ? pw->pw_name : "(unknown)", cmd->username);
+    return false;
+}
+
+int qrexec_start_plugin(struct qrexec_parsed_command *cmd, const char *path,
+                        int *socket_fd)
+{
+    struct qrexec_plugin *plugin;
+    const unsigned int *abi_version;
+
+    if (!plugin_user_allowed(cmd, path))
+        return -2;
+
+    plugin = calloc(1, sizeof(*plugin));
+    if (plugin == NULL) {
+        LOG(ERROR, "Cannot allocate plugin state");
+        return -2;
+    }
+
+    plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin->handle == NULL) {
+        LOG(ERROR, "Cannot load plugin %s: %s", path, dlerror());
+        goto fail;
+    }
+    abi_version = dlsym(plugin->handle, QREXEC_PLUGIN_ABI_VERSION_SYMBOL);
+    if (abi_version == NULL || *abi_version != QREXEC_PLUGIN_ABI_VERSION) {
+        LOG(ERROR, "Plugin %s does not declare ABI version %d",
+            path, QREXEC_PLUGIN_ABI_VERSION);
+        goto fail;
+    }
+    plugin->entry = (qrexec_plugin_entry_t *)dlsym(plugin->handle,
+                                                   QREXEC_PLUGIN_ENTRY_SYMBOL);
+    if (plugin->entry == NULL) {
+        LOG(ERROR, "Plugin %s has no %s function",
+            path, QREXEC_PLUGIN_ENTRY_SYMBOL);
+        goto fail;
+    }
+
+    return start_plugin_thread(plugin, cmd, socket_fd);
+
+fail:
+    free_plugin_state(plugin);
+    return -2;
+}
+
+int qrexec_start_builtin(struct qrexec_parsed_command *cmd,
+                         qrexec_builtin_entry_t *entry, void *data,
+                         int *socket_fd)
+{
+    struct qrexec_plugin *plugin;
+
+    plugin = calloc(1, sizeof(*plugin));
+    if (plugin == NULL) {
+        LOG(ERROR, "Cannot allocate plugin state");
+        free(data);
+        return -2;
+    }
+    plugin->builtin = entry;
+    plugin->data = data;
+    return start_plugin_thread(plugin, cmd, socket_fd);
+}
+
+int qrexec_wait_plugin(struct qrexec_plugin *plugin)
+{
+    if (!plugin->joined) {
+        pthread_join(plugin->thread, NULL);
+        plugin->joined = true;
+    }
+    return plugin->exit_code;
+}
+
+void qrexec_free_plugin(struct qrexec_plugin *plugin)
+{
+    (void)qrexec_wait_plugin(plugin);
+    free_plugin_state(plugin);
+}
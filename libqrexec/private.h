@@ -1,7 +1,81 @@
 #pragma once
+#include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 int qubes_toml_config_parse(const char *config_full_path, bool *wait_for_session,
                             char **user,
                             bool *send_service_descriptor,
                             bool *exit_on_stdout_eof,
-                            bool *exit_on_stdin_eof);
+                            bool *exit_on_stdin_eof,
+                            bool *threaded_io,
+                            bool *accept_fds,
+                            unsigned int *max_instances,
+                            unsigned int *max_queued,
+                            unsigned int *cpu_weight,
+                            unsigned int *io_weight,
+                            unsigned long long *memory_high,
+                            unsigned int *connect_timeout);
+
+/* Create (if needed) and configure the cgroup for cmd. Returns its directory
+ * FD, or -1 if cmd should run in the current cgroup. */
+int qrexec_open_service_cgroup(const struct qrexec_parsed_command *cmd);
+/* fork() with the child placed in the cgroup opened above. The caller must
+ * be single-threaded. */
+pid_t qrexec_fork_into_cgroup(int cgroup_fd);
+/* Close the cgroup opened above, once the service is started in it. */
+void qrexec_close_service_cgroup(int cgroup_fd);
+
+/* Load the plugin at path and start it for cmd. On success, *socket_fd is
+ * connected to the plugin streams. Returns 0 or -2 on error. */
+int qrexec_start_plugin(struct qrexec_parsed_command *cmd, const char *path,
+                        int *socket_fd);
+/* Wait for the plugin to finish and return its exit code. */
+int qrexec_wait_plugin(struct qrexec_plugin *plugin);
+/* Wait for the plugin to finish and unload it. */
+void qrexec_free_plugin(struct qrexec_plugin *plugin);
+
+/* Services built into libqrexec, run on a thread like plugins. data is
+ * passed to entry and freed with free() once the service is freed (also on
+ * failure). */
+typedef int qrexec_builtin_entry_t(const struct qrexec_plugin_call *call,
+                                   void *data);
+int qrexec_start_builtin(struct qrexec_parsed_command *cmd,
+                         qrexec_builtin_entry_t *entry, void *data,
+                         int *socket_fd);
+
+/* Connect to host and port, as a /dev/tcp service does. host must be a
+ * numeric address unless allow_names is set. Gives up after timeout seconds,
+ * 0 means the kernel timeout. Returns the socket, or -1 on error. */
+int qubes_tcp_connect(const char *host, const char *port, bool allow_names,
+                      unsigned int timeout);
+
+/* The most addresses of a host tried by qubes_tcp_connect() */
+#define TCP_CONNECT_MAX_ADDRS 16
+
+/* qubes_tcp_connect() split up, for callers with their own poll() loop */
+struct qubes_tcp_connect {
+    const char *host, *port;
+    struct addrinfo *addrs;
+    struct addrinfo *order[TCP_CONNECT_MAX_ADDRS];
+    size_t count, started;
+    /* the attempts in progress, to poll for the events requested */
+    struct pollfd fds[TCP_CONNECT_MAX_ADDRS];
+    size_t active;
+    long long next_start, deadline;
+    int last_error;
+};
+/* Resolve host. host and port must stay valid until the connection is done.
+ * Returns 0, or -1 on error. */
+int qubes_tcp_connect_begin(struct qubes_tcp_connect *conn, const char *host,
+                            const char *port, bool allow_names,
+                            unsigned int timeout);
+/* Handle the events polled for on conn->fds and start the attempts that are
+ * due. Returns the connected non-blocking socket, -1 on error, or -2 if still
+ * connecting; then poll again, for at most *timeout_ms (-1: no limit). */
+int qubes_tcp_connect_step(struct qubes_tcp_connect *conn, int *timeout_ms);
+/* Give up connecting. */
+void qubes_tcp_connect_cancel(struct qubes_tcp_connect *conn);
+/* Start a /dev/tcp-mux service connecting to host and port, with the connect
+ * timeout of cmd. Returns 0 or -2 on error, like qrexec_start_plugin(). */
+int qrexec_start_tcp_mux(struct qrexec_parsed_command *cmd, const char *host,
+                         const char *port, bool allow_names, int *socket_fd);
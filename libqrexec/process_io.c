@@ -24,8 +24,12 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -86,6 +90,179 @@ enum {
     FD_NUM
 };
 
+/*
+ * Threaded mode: the vchan -> stdin_fd direction runs on a separate thread,
+ * while the main loop keeps reading the local FDs and sending to vchan.
+ *
+ * The receiver thread is the only one waiting on the vchan event channel
+ * (libvchan_wait() is not safe to call from two threads, each could consume
+ * the other's notification). After every vchan event it kicks the main loop
+ * through an eventfd, so the main loop can see new buffer space without
+ * touching the event channel. The main loop never sends anything to vchan
+ * other than data while the thread runs, and all the messages that need to
+ * be ordered with incoming data (EOF, exit code) are sent after the thread
+ * has been joined, by the same code as in single-threaded mode.
+ *
+ * No lock is shared: each thread uses its own half of the vchan.  The
+ * thread only waits and receives (libvchan_wait(), libvchan_is_open(),
+ * libvchan_data_ready(), libvchan_recv()), the main loop only sends
+ * (libvchan_buffer_space(), libvchan_send()); the two rings of a vchan have
+ * one reader and one writer each.  Neither thread can block inside libvchan
+ * either: the thread receives only what libvchan_data_ready() reports, and
+ * the main loop sends only what libvchan_buffer_space() allows, so whether
+ * the implementation would otherwise block (or wait for an event, which
+ * only the thread may do) does not matter.
+ *
+ * The thread stops on anything other than data (EOF, remote exit, error,
+ * closed vchan) or when asked to, and reports the handle_remote_data_v2()
+ * result. Then the main loop continues alone.
+ */
+struct receiver {
+    pthread_t thread;
+    libvchan_t *vchan;
+    int stdin_fd;
+    int *remote_status;
+    struct buffer *stdin_buf;
+    bool replace_chars_stdout;
+    bool replace_chars_stderr;
+    bool is_service;
+    struct buffer buffer;
+    /* main loop -> receiver: stop requested */
+    int wake_fd;
+    /* receiver -> main loop: vchan event, or receiver done */
+    int notify_fd;
+    atomic_bool stop;
+    atomic_bool done;
+    /* handle_remote_data_v2() result, valid once done is set */
+    int result;
+};
+
+static void eventfd_kick(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        PERROR("write(eventfd)");
+}
+
+static void eventfd_drain(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        PERROR("read(eventfd)");
+}
+
+static void *receiver_thread(void *arg)
+{
+    struct receiver *rx = arg;
+    struct pollfd fds[3];
+    int rc = REMOTE_OK;
+
+    while (!atomic_load(&rx->stop)) {
+        bool closed = !libvchan_is_open(rx->vchan) &&
+                !libvchan_data_ready(rx->vchan);
+        bool data_ready = libvchan_data_ready(rx->vchan) > 0;
+        if (closed && !buffer_len(rx->stdin_buf))
+            /* let the main loop report it */
+            break;
+
+        fds[0].fd = rx->stdin_fd;
+        fds[0].events = buffer_len(rx->stdin_buf) > 0 ? POLLOUT : 0;
+        fds[1].fd = libvchan_fd_for_select(rx->vchan);
+        fds[1].events = POLLIN;
+        fds[2].fd = rx->wake_fd;
+        fds[2].events = POLLIN;
+
+        int ret = poll(fds, 3,
+                       !buffer_len(rx->stdin_buf) && data_ready ? 0 : 10000);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            PERROR("poll");
+            rc = REMOTE_ERROR;
+            break;
+        }
+        if (fds[1].revents) {
+            if (libvchan_wait(rx->vchan) < 0) {
+                rc = REMOTE_ERROR;
+                break;
+            }
+            /* there may be more space to send data too */
+            eventfd_kick(rx->notify_fd);
+        }
+        if (fds[2].revents)
+            eventfd_drain(rx->wake_fd);
+        if (fds[0].revents & (POLLHUP | POLLERR)) {
+            rc = REMOTE_EOF;
+            break;
+        }
+        rc = handle_remote_data_v2(rx->vchan, rx->stdin_fd, rx->remote_status,
+                                   rx->stdin_buf, rx->replace_chars_stdout,
+                                   rx->replace_chars_stderr, rx->is_service,
+                                   &rx->buffer);
+        if (rc != REMOTE_OK)
+            break;
+    }
+    rx->result = rc;
+    atomic_store(&rx->done, true);
+    eventfd_kick(rx->notify_fd);
+    return NULL;
+}
+
+static bool start_receiver(struct receiver *rx, size_t max_chunk_size)
+{
+    sigset_t all, old;
+    int err;
+
+    rx->buffer.data = malloc(max_chunk_size);
+    rx->buffer.buflen = max_chunk_size;
+    if (rx->buffer.data == NULL)
+        handle_vchan_error("receiver buffer alloc");
+    rx->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    rx->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (rx->wake_fd < 0 || rx->notify_fd < 0) {
+        PERROR("eventfd");
+        goto fail;
+    }
+    atomic_init(&rx->stop, false);
+    atomic_init(&rx->done, false);
+
+    /* signals are handled by the main loop only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&rx->thread, NULL, receiver_thread, rx);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        PERROR("pthread_create");
+        goto fail;
+    }
+    return true;
+fail:
+    if (rx->wake_fd >= 0)
+        close(rx->wake_fd);
+    if (rx->notify_fd >= 0)
+        close(rx->notify_fd);
+    free(rx->buffer.data);
+    return false;
+}
+
+/* Join the receiver thread (asking it to stop first if stop is true) and
+ * return its result. */
+static int join_receiver(struct receiver *rx, bool stop)
+{
+    if (stop) {
+        atomic_store(&rx->stop, true);
+        eventfd_kick(rx->wake_fd);
+    }
+    pthread_join(rx->thread, NULL);
+    close(rx->wake_fd);
+    close(rx->notify_fd);
+    free(rx->buffer.data);
+    return rx->result;
+}
+
 int process_io(const struct process_io_request *req) {
     return qrexec_process_io(req, NULL);
 }
@@ -104,14 +281,19 @@ int qrexec_process_io(const struct process_io_request *req,
     bool replace_chars_stderr = req->replace_chars_stderr;
     bool const exit_on_stdin_eof = cmd != NULL && cmd->exit_on_stdin_eof;
     bool const exit_on_stdout_eof = cmd != NULL && cmd->exit_on_stdout_eof;
+    bool const threaded_io = req->threaded_io || (cmd != NULL && cmd->threaded_io);
+    bool const accept_fds = cmd != NULL && cmd->accept_fds && req->local_pid == 0;
     const int data_protocol_version = req->data_protocol_version;
     const size_t max_chunk_size = max_data_chunk_size(data_protocol_version);
     pid_t local_pid = req->local_pid;
     volatile sig_atomic_t *sigchld = req->sigchld;
     volatile sig_atomic_t *sigusr1 = req->sigusr1;
+    struct rusage *local_rusage = req->local_rusage;
 
     pid_t local_status = -1;
     pid_t remote_status = -1;
+    /* exit code of a service without a local process */
+    int service_status = 0;
     /* Saved version of stdin_fd.  If we get SIGHUP,
      * this replaces stdout_fd.  Set to -1 only if stdin_fd
      * is closed, not merely shut down. */
@@ -123,6 +305,12 @@ int qrexec_process_io(const struct process_io_request *req,
     struct timespec zero_timeout = { 0, 0 };
     struct timespec normal_timeout = { 10, 0 };
     struct prefix_data empty = { 0, 0 }, prefix = req->prefix_data;
+    struct receiver rx;
+    bool rx_running = false;
+    int remote_rc;
+    /* descriptor passed by a socket service, sent before reading more from
+     * the socket */
+    int passed_fd = -1;
 
     if (is_service && stderr_fd == -1) {
         struct msg_header hdr = { .type = MSG_DATA_STDERR, .len = 0 };
@@ -202,15 +390,38 @@ int qrexec_process_io(const struct process_io_request *req,
 } while (0)
 #pragma GCC poison close_stdio
 
+    if (threaded_io && stdin_fd >= 0) {
+        rx = (struct receiver) {
+            .vchan = vchan,
+            .stdin_fd = stdin_fd,
+            .remote_status = &remote_status,
+            .stdin_buf = stdin_buf,
+            .replace_chars_stdout = replace_chars_stdout,
+            .replace_chars_stderr = replace_chars_stderr,
+            .is_service = is_service,
+            .wake_fd = -1,
+            .notify_fd = -1,
+        };
+        rx_running = start_receiver(&rx, max_chunk_size);
+    }
+
     while(1) {
+        remote_rc = REMOTE_OK;
+
         /* React to SIGCHLD */
         if (*sigchld) {
             int status;
-            if (local_pid > 0 && waitpid(local_pid, &status, WNOHANG) > 0) {
+            if (local_pid > 0 &&
+                    wait4(local_pid, &status, WNOHANG, local_rusage) > 0) {
                 if (WIFSIGNALED(status))
                     local_status = 128 + WTERMSIG(status);
                 else
                     local_status = WEXITSTATUS(status);
+                if (rx_running) {
+                    /* its result is handled below */
+                    remote_rc = join_receiver(&rx, true);
+                    rx_running = false;
+                }
                 close_stdin();
             }
             *sigchld = 0;
@@ -221,7 +432,10 @@ int qrexec_process_io(const struct process_io_request *req,
             if (is_service) {
                 /* wait for local process, send exit code */
                 if (!local_pid || local_status >= 0) {
-                    if (send_exit_code(vchan, local_pid ? local_status : 0) < 0)
+                    /* plugin services run in this process */
+                    if (!local_pid && cmd != NULL && cmd->plugin != NULL)
+                        service_status = qrexec_wait_plugin(cmd->plugin);
+                    if (send_exit_code(vchan, local_pid ? local_status : service_status) < 0)
                         handle_vchan_error("exit code");
                     break;
                 }
@@ -241,7 +455,8 @@ int qrexec_process_io(const struct process_io_request *req,
          * waitpid() below); it's pretty confusing and it's not clear what is
          * expected behaviour and what is an error.
          */
-        if (!libvchan_is_open(vchan) &&
+        if (!rx_running &&
+                !libvchan_is_open(vchan) &&
                 !libvchan_data_ready(vchan) &&
                 !buffer_len(stdin_buf)) {
             bool all_closed = stdin_fd == -1 && stdout_fd == -1 && stderr_fd == -1;
@@ -263,7 +478,7 @@ int qrexec_process_io(const struct process_io_request *req,
 
         /* otherwise handle the events */
         fds[FD_STDIN].fd = -1;
-        if (stdin_fd >= 0) {
+        if (stdin_fd >= 0 && !rx_running) {
             fds[FD_STDIN].fd = stdin_fd;
             if (buffer_len(stdin_buf) > 0)
                 fds[FD_STDIN].events = POLLOUT;
@@ -277,7 +492,7 @@ int qrexec_process_io(const struct process_io_request *req,
         fds[FD_STDERR].fd = -1;
         if (libvchan_buffer_space(vchan) > (int)sizeof(struct msg_header)) {
             if (prefix.len == 0 && stdout_fd >= 0) {
-                fds[FD_STDOUT].fd = stdout_fd;
+                fds[FD_STDOUT].fd = passed_fd >= 0 ? passed_fd : stdout_fd;
                 fds[FD_STDOUT].events = POLLIN;
             }
             if (stderr_fd >= 0) {
@@ -286,10 +501,12 @@ int qrexec_process_io(const struct process_io_request *req,
             }
         }
 
-        fds[FD_VCHAN].fd = libvchan_fd_for_select(vchan);
+        /* while the receiver runs, it waits for vchan events and passes
+         * them on */
+        fds[FD_VCHAN].fd = rx_running ? rx.notify_fd : libvchan_fd_for_select(vchan);
         fds[FD_VCHAN].events = POLLIN;
 
-        if (!buffer_len(stdin_buf) && libvchan_data_ready(vchan) > 0)
+        if (!rx_running && !buffer_len(stdin_buf) && libvchan_data_ready(vchan) > 0)
             /* check for other FDs, but exit immediately */
             ret = ppoll(fds, FD_NUM, &zero_timeout, &pollmask);
         else
@@ -305,23 +522,36 @@ int qrexec_process_io(const struct process_io_request *req,
             }
         }
 
-        /* clear event pending flag */
-        if (fds[FD_VCHAN].revents)
-            if (libvchan_wait(vchan) < 0)
-                handle_vchan_error("wait");
-
-        if (fds[FD_STDIN].revents & (POLLHUP | POLLERR))
-            close_stdin();
-
-        /* handle_remote_data will check if any data is available */
-        switch (handle_remote_data_v2(
-                    vchan, stdin_fd,
-                    &remote_status,
-                    stdin_buf,
-                    replace_chars_stdout > 0,
-                    replace_chars_stderr > 0,
-                    is_service,
-                    &remote_buffer)) {
+        if (rx_running) {
+            if (fds[FD_VCHAN].revents) {
+                eventfd_drain(rx.notify_fd);
+                if (atomic_load(&rx.done)) {
+                    remote_rc = join_receiver(&rx, false);
+                    rx_running = false;
+                    /* stdin_fd hangup is reported as REMOTE_EOF */
+                }
+            }
+        } else {
+            /* clear event pending flag */
+            if (fds[FD_VCHAN].revents)
+                if (libvchan_wait(vchan) < 0)
+                    handle_vchan_error("wait");
+
+            if (fds[FD_STDIN].revents & (POLLHUP | POLLERR))
+                close_stdin();
+
+            /* handle_remote_data will check if any data is available */
+            if (remote_rc == REMOTE_OK)
+                remote_rc = handle_remote_data_v2(
+                        vchan, stdin_fd,
+                        &remote_status,
+                        stdin_buf,
+                        replace_chars_stdout > 0,
+                        replace_chars_stderr > 0,
+                        is_service,
+                        &remote_buffer);
+        }
+        switch (remote_rc) {
             case REMOTE_ERROR:
                 handle_vchan_error("read");
                 break;
@@ -341,10 +571,23 @@ int qrexec_process_io(const struct process_io_request *req,
                 close_stdout();
                 break;
         }
-        if (prefix.len > 0 || (stdout_fd >= 0 && fds[FD_STDOUT].revents)) {
+        if (passed_fd >= 0 && stdout_fd >= 0 && fds[FD_STDOUT].revents) {
+            switch (handle_passed_fd_input(
+                        vchan, passed_fd, stdout_msg_type, &remote_buffer)) {
+                case REMOTE_ERROR:
+                    handle_vchan_error("send(handle_input passed fd)");
+                    break;
+                case REMOTE_EOF:
+                    /* done with it, back to the socket */
+                    close(passed_fd);
+                    passed_fd = -1;
+                    break;
+            }
+        } else if (prefix.len > 0 || (stdout_fd >= 0 && fds[FD_STDOUT].revents)) {
             switch (handle_input_v2(
                         vchan, stdout_fd, stdout_msg_type,
-                        &prefix, &remote_buffer)) {
+                        &prefix, &remote_buffer,
+                        accept_fds ? &passed_fd : NULL)) {
                 case REMOTE_ERROR:
                     handle_vchan_error("send(handle_input stdout)");
                     break;
@@ -352,11 +595,14 @@ int qrexec_process_io(const struct process_io_request *req,
                     close_stdout();
                     break;
             }
+            /* a pipe or socket could block the loop otherwise */
+            if (passed_fd >= 0)
+                set_nonblock(passed_fd);
         }
         if (stderr_fd >= 0 && fds[FD_STDERR].revents) {
             switch (handle_input_v2(
                         vchan, stderr_fd, MSG_DATA_STDERR,
-                        &empty, &remote_buffer)) {
+                        &empty, &remote_buffer, NULL)) {
                 case REMOTE_ERROR:
                     handle_vchan_error("send(handle_input stderr)");
                     break;
@@ -367,6 +613,10 @@ int qrexec_process_io(const struct process_io_request *req,
             }
         }
     }
+    if (rx_running)
+        (void)join_receiver(&rx, true);
+    if (passed_fd >= 0)
+        close(passed_fd);
     /* make sure that all the pipes/sockets are closed, so the child process
      * (if any) will know that the connection is terminated */
     close_stdin();
@@ -376,7 +626,7 @@ int qrexec_process_io(const struct process_io_request *req,
     /* wait for local process, in case we exited early */
     if (local_pid && local_status < 0) {
         int status;
-        if (waitpid(local_pid, &status, 0) > 0) {
+        if (wait4(local_pid, &status, 0, local_rusage) > 0) {
             if (WIFSIGNALED(status))
                 local_status = 128 + WTERMSIG(status);
             else
@@ -389,5 +639,5 @@ int qrexec_process_io(const struct process_io_request *req,
 
     if (!is_service && remote_status)
         return remote_status;
-    return local_pid ? local_status : 0;
+    return local_pid ? local_status : service_status;
 }
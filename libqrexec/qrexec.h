@@ -29,7 +29,7 @@
 
 #include <stdint.h>
 
-#define QREXEC_PROTOCOL_VERSION 3
+#define QREXEC_PROTOCOL_VERSION 5
 #define MAX_FDS 256
 /* protocol version 2 */
 #define MAX_DATA_CHUNK_V2 4096
@@ -40,6 +40,10 @@
  * message header */
 #define MAX_SERVICE_NAME_LEN 65000
 
+/* protocol version 4+: maximum size of initial stdin data sent together with
+ * MSG_TRIGGER_SERVICE3 and MSG_EXEC_CMDLINE */
+#define MAX_INLINE_PAYLOAD 1024
+
 #define RPC_REQUEST_COMMAND "QUBESRPC"
 #define RPC_REQUEST_COMMAND_LEN (sizeof(RPC_REQUEST_COMMAND)-1)
 #define NOGUI_CMD_PREFIX "nogui:"
@@ -67,6 +71,18 @@ enum {
      * Qubes >= R4.1
      */
     QREXEC_PROTOCOL_V3 = 3,
+
+    /* Changes:
+     *  - initial stdin data (up to MAX_INLINE_PAYLOAD) can follow the
+     *    service name in MSG_TRIGGER_SERVICE3 and the command line in
+     *    MSG_EXEC_CMDLINE
+     */
+    QREXEC_PROTOCOL_V4 = 4,
+
+    /* Changes:
+     *  - MSG_SERVICE_CANCEL
+     */
+    QREXEC_PROTOCOL_V5 = 5,
 };
 
 /* Messages sent over control vchan between daemon(dom0) and agent(vm).
@@ -107,10 +123,23 @@ enum {
      * struct trigger_service_params3 passed as data */
     MSG_TRIGGER_SERVICE3,
 
+    /* agent->daemon messages */
+    /* the caller of a service went away before the call was connected or
+     * refused (protocol 5+), struct service_params passed as data to identify
+     * the request; the daemon still answers it with MSG_SERVICE_CONNECT or
+     * MSG_SERVICE_REFUSED */
+    MSG_SERVICE_CANCEL,
+
     /* common messages */
     /* initialize connection, struct peer_info passed as data
      * should be sent as the first message (server first, then client) */
     MSG_HELLO = 0x300,
+
+    /* client->daemon messages */
+    /* request statistics of the daemon, sent after MSG_HELLO instead of
+     * a command, without data; the daemon replies with the same type and
+     * struct qrexec_daemon_stats as data, then closes the connection */
+    MSG_STATS,
 };
 
 /* uniform for all peers, data type depends on message type */
@@ -123,7 +152,8 @@ struct msg_header {
 struct exec_params {
     uint32_t connect_domain; /* target domain name */
     uint32_t connect_port;   /* target vchan port for i/o exchange */
-    char cmdline[];          /* command line to execute, null terminated, size = msg_header.len - sizeof(struct exec_params) */
+    char cmdline[];          /* command line to execute, null terminated, size = msg_header.len - sizeof(struct exec_params);
+                                for MSG_EXEC_CMDLINE (protocol 4+) optionally followed by initial stdin data */
 };
 
 struct service_params {
@@ -139,13 +169,34 @@ struct trigger_service_params {
 struct trigger_service_params3 {
     char target_domain[64];           /* null terminated ASCII string */
     struct service_params request_id; /* service request id */
-    char service_name[];              /* null terminated ASCII string, size = msg_header.len - sizeof(struct trigger_service_params3) */
+    char service_name[];              /* null terminated ASCII string, size = msg_header.len - sizeof(struct trigger_service_params3);
+                                         (protocol 4+) optionally followed by initial stdin data */
 };
 
 struct peer_info {
     uint32_t version; /* qrexec protocol version */
 };
 
+#define QREXEC_STATS_LATENCY_BUCKETS 24
+
+/* counters are since the daemon start */
+struct qrexec_daemon_stats {
+    uint32_t domain_id;           /* domain the daemon is for */
+    uint32_t ports_in_use;        /* allocated data vchan ports */
+    uint32_t clients;             /* connected clients */
+    uint32_t policy_pending;      /* service calls waiting for the policy */
+    uint64_t service_calls;       /* service calls from the domain */
+    uint64_t service_allowed;
+    uint64_t service_refused;     /* by the policy, or invalid */
+    uint64_t service_cancelled;   /* abandoned by the caller */
+    uint64_t client_connections;  /* clients accepted */
+    uint64_t policy_time_us;      /* sum of policy latencies */
+    /* policy latency histogram: bucket i counts latencies under 2^i us and,
+     * except for bucket 0, at least 2^(i-1) us; the last bucket counts all
+     * the longer ones too */
+    uint64_t policy_latency[QREXEC_STATS_LATENCY_BUCKETS];
+};
+
 /* data vchan client<->agent, separate for each VM process */
 enum {
     /* stdin dom0->VM */
@@ -147,10 +147,50 @@ out:
     return rc;
 }
 
-int handle_input_v2(
+/* read() from fd, also accepting a passed file descriptor if passed_fd is
+ * not NULL; see handle_input_v2() */
+static ssize_t read_input(int fd, char *buf, size_t len, int *passed_fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    if (passed_fd == NULL)
+        return read(fd, buf, len);
+
+    ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (ret <= 0)
+        return ret;
+    if (msg.msg_flags & MSG_CTRUNC)
+        LOG(ERROR, "Service passed more than one file descriptor at once, "
+                   "extra ones dropped");
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+            /* The descriptor comes with the last byte read, as the kernel
+             * does not merge data from after it. Drop that marker byte. */
+            ret--;
+        }
+    }
+    return ret;
+}
+
+static int handle_input_common(
     libvchan_t *vchan, int fd, int msg_type,
     struct prefix_data *prefix_data,
-    const struct buffer *buffer)
+    const struct buffer *buffer,
+    int *passed_fd, bool send_eof)
 {
     const size_t max_len = (size_t)buffer->buflen;
     char *buf = buffer->data;
@@ -174,7 +214,7 @@ int handle_input_v2(
             prefix_data->data += len;
             prefix_data->len -= len;
         } else {
-            len = read(fd, buf, len);
+            len = read_input(fd, buf, len, passed_fd);
             /* If the other side of the socket is a process that is already dead,
              * read from such socket could fail with ECONNRESET instead of
              * just 0. */
@@ -186,6 +226,22 @@ int handle_input_v2(
                 /* otherwise keep rc = REMOTE_ERROR */
                 goto out;
             }
+            if (passed_fd && *passed_fd >= 0) {
+                /* send the data before the descriptor, and let the caller
+                 * stream the descriptor content first */
+                if (len > 0) {
+                    hdr.len = (uint32_t)len;
+                    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+                            !write_vchan_all(vchan, buf, len))
+                        goto out;
+                }
+                rc = REMOTE_OK;
+                goto out;
+            }
+            if (len == 0 && !send_eof) {
+                rc = REMOTE_EOF;
+                goto out;
+            }
         }
         hdr.len = (uint32_t)len;
         /* do not fail on sending EOF (think: close()), it will be handled just below */
@@ -205,6 +261,26 @@ out:
     return rc;
 }
 
+int handle_input_v2(
+    libvchan_t *vchan, int fd, int msg_type,
+    struct prefix_data *prefix_data,
+    const struct buffer *buffer,
+    int *passed_fd)
+{
+    return handle_input_common(vchan, fd, msg_type, prefix_data, buffer,
+                               passed_fd, true);
+}
+
+int handle_passed_fd_input(
+    libvchan_t *vchan, int fd, int msg_type,
+    const struct buffer *buffer)
+{
+    struct prefix_data empty = { 0, 0 };
+
+    return handle_input_common(vchan, fd, msg_type, &empty, buffer, NULL,
+                               false);
+}
+
 int send_exit_code(libvchan_t *vchan, int status)
 {
     struct msg_header hdr;
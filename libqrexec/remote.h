@@ -73,9 +73,25 @@ int handle_remote_data_v2(
  * initialized, and will _not_ be anything meaningful on return.  The
  * buffer pointer and length will not be freed or reallocated, though.
  * In Rust terms: this is an &mut [MaybeUninit<u8>].
+ *
+ * If passed_fd is not NULL, fd must be a Unix socket, which may pass a file
+ * descriptor (SCM_RIGHTS) together with a single marker byte.  The marker
+ * byte is dropped, the data before it is sent, and the received descriptor
+ * is stored in *passed_fd (which must be -1 on entry).  The caller should
+ * then send the descriptor content before reading fd again.
  */
 int handle_input_v2(
     libvchan_t *vchan, int fd, int msg_type,
     struct prefix_data *prefix_data,
+    const struct buffer *buffer,
+    int *passed_fd);
+
+/*
+ * Like handle_input_v2(), for the content of a descriptor passed by a
+ * service.  It is part of the service stdout, so its EOF is only reported
+ * (REMOTE_EOF), not sent.
+ */
+int handle_passed_fd_input(
+    libvchan_t *vchan, int fd, int msg_type,
     const struct buffer *buffer);
 #pragma GCC visibility pop
@@ -0,0 +1,703 @@
+/*
+ * TCP connection multiplexing over a single qrexec stream.
+ *
+ * Forwarding TCP with a /dev/tcp service costs a whole qrexec call (policy
+ * evaluation, process start, vchan setup) per TCP connection.  With a
+ * /dev/tcp-mux service, the client keeps one call open and opens any number
+ * of connections inside it; the frame format is described in
+ * libqrexec-utils.h.
+ *
+ * Both sides run the same single-threaded poll() loop: the service side in
+ * a builtin plugin thread of the process handling the call, the client side
+ * in qrexec-tcp-mux, started by qrexec-client-vm.  The service side connects
+ * to the target from that loop too, so a slow connection does not hold up
+ * the others (only resolving a host name, if allowed, still blocks).
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+#include "private.h"
+
+/* stop reading from the connections when that much is waiting for the
+ * stream */
+#define MUX_OUT_HIGH (256 * 1024)
+/* grant credit back in chunks, not for every write */
+#define MUX_CREDIT_THRESHOLD (QREXEC_TCP_MUX_WINDOW / 4)
+#define MUX_IN_SIZE (2 * (sizeof(struct qrexec_tcp_mux_header) + \
+                          QREXEC_TCP_MUX_MAX_DATA))
+
+struct mux_buffer {
+    char *data;
+    size_t start, len, size;
+};
+
+struct mux_conn {
+    uint32_t id;
+    /* -1 while connecting */
+    int fd;
+    /* connection to the target in progress, and how long it may wait */
+    struct qubes_tcp_connect *connecting;
+    int connect_wait;
+    /* next connection in the same slot */
+    struct mux_conn *next;
+    /* position in mux.active */
+    size_t index;
+    /* EOF read from the socket (and sent to the peer) */
+    bool read_eof;
+    /* EOF received from the peer, the socket is shut down once pending is
+     * written */
+    bool peer_eof;
+    /* bytes we may still send to the peer */
+    uint32_t credit;
+    /* bytes written to the socket and not granted back to the peer yet */
+    uint32_t unacked;
+    /* data from the peer not written to the socket yet */
+    struct mux_buffer pending;
+};
+
+struct mux {
+    int in_fd, out_fd, listen_fd;
+    const char *host, *port;
+    bool allow_names;
+    unsigned int connect_timeout;
+    /* by id % QREXEC_TCP_MUX_MAX_CONNECTIONS; the service may still be
+     * writing out a connection the client already forgot, so a slot can
+     * hold more than one */
+    struct mux_conn *slots[QREXEC_TCP_MUX_MAX_CONNECTIONS];
+    struct mux_conn *active[QREXEC_TCP_MUX_MAX_CONNECTIONS];
+    size_t nactive;
+    uint32_t next_id;
+    /* the stream ended, only what is already queued is written out */
+    bool stream_eof;
+    struct mux_buffer out;
+    char in[MUX_IN_SIZE];
+    size_t in_len;
+    /* stream, listening socket, then the connections, each with one socket
+     * or all its connection attempts */
+    struct pollfd fds[3 + QREXEC_TCP_MUX_MAX_CONNECTIONS *
+                      TCP_CONNECT_MAX_ADDRS];
+};
+
+static void mux_buffer_reserve(struct mux_buffer *b, size_t len)
+{
+    if (b->size - b->start - b->len >= len)
+        return;
+    if (b->start) {
+        memmove(b->data, b->data + b->start, b->len);
+        b->start = 0;
+        if (b->size - b->len >= len)
+            return;
+    }
+    size_t size = b->size ? b->size : 4096;
+    while (size - b->len < len)
+        size *= 2;
+    char *data = realloc(b->data, size);
+    if (data == NULL) {
+        LOG(ERROR, "Cannot allocate %zu bytes", size);
+        abort();
+    }
+    b->data = data;
+    b->size = size;
+}
+
+static void mux_buffer_append(struct mux_buffer *b, const void *data,
+                              size_t len)
+{
+    mux_buffer_reserve(b, len);
+    memcpy(b->data + b->start + b->len, data, len);
+    b->len += len;
+}
+
+static void mux_buffer_consume(struct mux_buffer *b, size_t len)
+{
+    assert(len <= b->len);
+    b->len -= len;
+    b->start = b->len ? b->start + len : 0;
+}
+
+static void mux_send_frame(struct mux *mux, uint32_t type, uint32_t id,
+                           const void *data, uint32_t len)
+{
+    struct qrexec_tcp_mux_header hdr = { .type = type, .id = id, .len = len };
+
+    mux_buffer_append(&mux->out, &hdr, sizeof(hdr));
+    if (len)
+        mux_buffer_append(&mux->out, data, len);
+}
+
+static struct mux_conn *mux_find(struct mux *mux, uint32_t id)
+{
+    struct mux_conn *conn = mux->slots[id % QREXEC_TCP_MUX_MAX_CONNECTIONS];
+
+    while (conn && conn->id != id)
+        conn = conn->next;
+    return conn;
+}
+
+static struct mux_conn *mux_add(struct mux *mux, uint32_t id, int fd)
+{
+    struct mux_conn *conn = calloc(1, sizeof(*conn));
+
+    if (conn == NULL) {
+        LOG(ERROR, "Cannot allocate connection state");
+        return NULL;
+    }
+    conn->id = id;
+    conn->fd = fd;
+    conn->credit = QREXEC_TCP_MUX_WINDOW;
+    conn->index = mux->nactive;
+    mux->active[mux->nactive++] = conn;
+    conn->next = mux->slots[id % QREXEC_TCP_MUX_MAX_CONNECTIONS];
+    mux->slots[id % QREXEC_TCP_MUX_MAX_CONNECTIONS] = conn;
+    return conn;
+}
+
+/* Forget the connection, telling the peer with a CLOSE frame if notify is
+ * set. */
+static void mux_remove(struct mux *mux, struct mux_conn *conn, bool notify)
+{
+    struct mux_conn **link = &mux->slots[conn->id %
+                                         QREXEC_TCP_MUX_MAX_CONNECTIONS];
+
+    if (notify)
+        mux_send_frame(mux, QREXEC_TCP_MUX_CLOSE, conn->id, NULL, 0);
+    if (conn->connecting) {
+        qubes_tcp_connect_cancel(conn->connecting);
+        free(conn->connecting);
+    }
+    if (conn->fd >= 0)
+        close(conn->fd);
+    while (*link != conn)
+        link = &(*link)->next;
+    *link = conn->next;
+    mux->active[conn->index] = mux->active[--mux->nactive];
+    mux->active[conn->index]->index = conn->index;
+    free(conn->pending.data);
+    free(conn);
+}
+
+/* Close the connection once both directions are done. The peer does the
+ * same on its side, so no CLOSE is needed. Returns true if it was closed. */
+static bool mux_maybe_finish(struct mux *mux, struct mux_conn *conn)
+{
+    if (!conn->read_eof || !conn->peer_eof || conn->pending.len)
+        return false;
+    mux_remove(mux, conn, false);
+    return true;
+}
+
+static void mux_grant(struct mux *mux, struct mux_conn *conn, uint32_t len)
+{
+    conn->unacked += len;
+    if (conn->unacked >= MUX_CREDIT_THRESHOLD && !conn->peer_eof) {
+        mux_send_frame(mux, QREXEC_TCP_MUX_CREDIT, conn->id,
+                       &conn->unacked, sizeof(conn->unacked));
+        conn->unacked = 0;
+    }
+}
+
+/* Write as much of data as the socket takes. Returns the number of bytes
+ * written, or -1 if the connection failed. */
+static ssize_t mux_conn_write(struct mux_conn *conn, const char *data,
+                              size_t len)
+{
+    ssize_t res = send(conn->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        LOG(DEBUG, "Connection %u: send: %m", conn->id);
+        return -1;
+    }
+    return res;
+}
+
+/* Returns true if the connection is still open. */
+static bool mux_conn_flush(struct mux *mux, struct mux_conn *conn)
+{
+    if (conn->pending.len) {
+        ssize_t res = mux_conn_write(
+            conn, conn->pending.data + conn->pending.start, conn->pending.len);
+        if (res < 0) {
+            mux_remove(mux, conn, true);
+            return false;
+        }
+        mux_buffer_consume(&conn->pending, (size_t)res);
+        mux_grant(mux, conn, (uint32_t)res);
+    }
+    if (!conn->pending.len && conn->peer_eof) {
+        shutdown(conn->fd, SHUT_WR);
+        return !mux_maybe_finish(mux, conn);
+    }
+    return true;
+}
+
+static void mux_conn_read(struct mux *mux, struct mux_conn *conn)
+{
+    struct qrexec_tcp_mux_header hdr = {
+        .type = QREXEC_TCP_MUX_DATA,
+        .id = conn->id,
+    };
+    size_t len = conn->credit < QREXEC_TCP_MUX_MAX_DATA ?
+        conn->credit : QREXEC_TCP_MUX_MAX_DATA;
+    ssize_t res;
+
+    /* read straight into the output buffer, behind the header */
+    mux_buffer_reserve(&mux->out, sizeof(hdr) + len);
+    res = recv(conn->fd, mux->out.data + mux->out.start + mux->out.len +
+               sizeof(hdr), len, MSG_DONTWAIT);
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        LOG(DEBUG, "Connection %u: recv: %m", conn->id);
+        mux_remove(mux, conn, true);
+        return;
+    }
+    if (res == 0) {
+        conn->read_eof = true;
+        mux_send_frame(mux, QREXEC_TCP_MUX_EOF, conn->id, NULL, 0);
+        mux_maybe_finish(mux, conn);
+        return;
+    }
+    hdr.len = (uint32_t)res;
+    memcpy(mux->out.data + mux->out.start + mux->out.len, &hdr, sizeof(hdr));
+    mux->out.len += sizeof(hdr) + (size_t)res;
+    conn->credit -= (uint32_t)res;
+}
+
+/* Continue connecting to the target, once the connection attempts got an
+ * event or their time is up. Returns true if the connection is still open. */
+static bool mux_conn_connect(struct mux *mux, struct mux_conn *conn)
+{
+    int fd = qubes_tcp_connect_step(conn->connecting, &conn->connect_wait);
+
+    if (fd == -2)
+        return true;
+    free(conn->connecting);
+    conn->connecting = NULL;
+    if (fd < 0) {
+        mux_remove(mux, conn, true);
+        return false;
+    }
+    conn->fd = fd;
+    /* data and EOF from the peer may be waiting already */
+    return mux_conn_flush(mux, conn);
+}
+
+static void mux_open(struct mux *mux, uint32_t id)
+{
+    struct mux_conn *conn;
+
+    if (mux->nactive == QREXEC_TCP_MUX_MAX_CONNECTIONS) {
+        LOG(ERROR, "Too many connections, refusing connection %u", id);
+        mux_send_frame(mux, QREXEC_TCP_MUX_CLOSE, id, NULL, 0);
+        return;
+    }
+    conn = mux_add(mux, id, -1);
+    if (conn == NULL) {
+        mux_send_frame(mux, QREXEC_TCP_MUX_CLOSE, id, NULL, 0);
+        return;
+    }
+    conn->connecting = malloc(sizeof(*conn->connecting));
+    if (conn->connecting == NULL) {
+        LOG(ERROR, "Cannot allocate connection state");
+        mux_remove(mux, conn, true);
+        return;
+    }
+    if (qubes_tcp_connect_begin(conn->connecting, mux->host, mux->port,
+                                mux->allow_names, mux->connect_timeout) < 0) {
+        free(conn->connecting);
+        conn->connecting = NULL;
+        mux_remove(mux, conn, true);
+        return;
+    }
+    mux_conn_connect(mux, conn);
+}
+
+/* Returns false on a protocol error. */
+static bool mux_handle_frame(struct mux *mux,
+                             const struct qrexec_tcp_mux_header *hdr,
+                             const char *data)
+{
+    struct mux_conn *conn = mux_find(mux, hdr->id);
+    uint32_t credit;
+
+    switch (hdr->type) {
+    case QREXEC_TCP_MUX_OPEN:
+        if (mux->listen_fd >= 0 || hdr->len || conn) {
+            LOG(ERROR, "Unexpected OPEN of connection %u", hdr->id);
+            return false;
+        }
+        mux_open(mux, hdr->id);
+        return true;
+    case QREXEC_TCP_MUX_DATA:
+        if (conn == NULL)
+            return true; /* already closed */
+        if (!hdr->len || conn->peer_eof ||
+                conn->pending.len + conn->unacked + hdr->len >
+                QREXEC_TCP_MUX_WINDOW) {
+            LOG(ERROR, "Connection %u: unexpected data", hdr->id);
+            return false;
+        }
+        if (!conn->pending.len && !conn->connecting) {
+            ssize_t res = mux_conn_write(conn, data, hdr->len);
+            if (res < 0) {
+                mux_remove(mux, conn, true);
+                return true;
+            }
+            data += res;
+            mux_grant(mux, conn, (uint32_t)res);
+            mux_buffer_append(&conn->pending, data, hdr->len - (size_t)res);
+        } else {
+            mux_buffer_append(&conn->pending, data, hdr->len);
+        }
+        return true;
+    case QREXEC_TCP_MUX_EOF:
+        if (hdr->len || (conn && conn->peer_eof)) {
+            LOG(ERROR, "Connection %u: unexpected EOF", hdr->id);
+            return false;
+        }
+        if (conn) {
+            conn->peer_eof = true;
+            if (!conn->connecting)
+                mux_conn_flush(mux, conn);
+        }
+        return true;
+    case QREXEC_TCP_MUX_CLOSE:
+        if (hdr->len) {
+            LOG(ERROR, "Connection %u: invalid CLOSE", hdr->id);
+            return false;
+        }
+        if (conn)
+            mux_remove(mux, conn, false);
+        return true;
+    case QREXEC_TCP_MUX_CREDIT:
+        if (hdr->len != sizeof(credit)) {
+            LOG(ERROR, "Connection %u: invalid CREDIT", hdr->id);
+            return false;
+        }
+        memcpy(&credit, data, sizeof(credit));
+        if (conn == NULL)
+            return true;
+        if (credit > QREXEC_TCP_MUX_WINDOW - conn->credit) {
+            LOG(ERROR, "Connection %u: credit over the window", hdr->id);
+            return false;
+        }
+        conn->credit += credit;
+        return true;
+    default:
+        LOG(ERROR, "Unknown frame type %u", hdr->type);
+        return false;
+    }
+}
+
+/* Returns 1 on EOF, -1 on error, 0 otherwise. */
+static int mux_read_stream(struct mux *mux)
+{
+    struct qrexec_tcp_mux_header hdr;
+    ssize_t res;
+    size_t pos = 0;
+
+    res = read(mux->in_fd, mux->in + mux->in_len, sizeof(mux->in) - mux->in_len);
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        PERROR("read");
+        return -1;
+    }
+    if (res == 0)
+        return 1;
+    mux->in_len += (size_t)res;
+
+    while (mux->in_len - pos >= sizeof(hdr)) {
+        memcpy(&hdr, mux->in + pos, sizeof(hdr));
+        if (hdr.len > QREXEC_TCP_MUX_MAX_DATA) {
+            LOG(ERROR, "Frame too long: %u bytes", hdr.len);
+            return -1;
+        }
+        if (mux->in_len - pos - sizeof(hdr) < hdr.len)
+            break;
+        if (!mux_handle_frame(mux, &hdr, mux->in + pos + sizeof(hdr)))
+            return -1;
+        pos += sizeof(hdr) + hdr.len;
+    }
+    memmove(mux->in, mux->in + pos, mux->in_len - pos);
+    mux->in_len -= pos;
+    return 0;
+}
+
+static void mux_accept(struct mux *mux)
+{
+    while (mux->nactive < QREXEC_TCP_MUX_MAX_CONNECTIONS) {
+        int fd = accept4(mux->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                PERROR("accept");
+            return;
+        }
+        /* IDs only grow, so late frames of a finished connection never
+         * match a new one */
+        while (mux_find(mux, mux->next_id))
+            mux->next_id++;
+        uint32_t id = mux->next_id++;
+        if (mux_add(mux, id, fd) == NULL) {
+            close(fd);
+            return;
+        }
+        mux_send_frame(mux, QREXEC_TCP_MUX_OPEN, id, NULL, 0);
+    }
+}
+
+/* No more frames come from the peer: treat it as an EOF on every connection,
+ * so that their sockets are shut down for writing once the data queued for
+ * them is written. */
+static void mux_stream_eof(struct mux *mux)
+{
+    mux->stream_eof = true;
+    /* removing a connection moves the last one into its place, so go
+     * backwards */
+    for (size_t i = mux->nactive; i-- > 0;) {
+        struct mux_conn *conn = mux->active[i];
+
+        if (conn->peer_eof)
+            continue;
+        conn->peer_eof = true;
+        if (!conn->connecting)
+            mux_conn_flush(mux, conn);
+    }
+}
+
+/* Returns true once everything queued after the end of the stream is
+ * written out. A connection still being made is waited for only if there is
+ * data for it. */
+static bool mux_drained(struct mux *mux)
+{
+    if (mux->out.len)
+        return false;
+    for (size_t i = 0; i < mux->nactive; i++) {
+        if (mux->active[i]->pending.len)
+            return false;
+    }
+    return true;
+}
+
+/* Returns false if the stream failed. */
+static bool mux_flush_stream(struct mux *mux)
+{
+    while (mux->out.len) {
+        ssize_t res = write(mux->out_fd, mux->out.data + mux->out.start,
+                            mux->out.len);
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
+            PERROR("write");
+            return false;
+        }
+        mux_buffer_consume(&mux->out, (size_t)res);
+    }
+    return true;
+}
+
+static int mux_loop(struct mux *mux)
+{
+    struct pollfd *fds = mux->fds;
+    struct mux_conn *polled[QREXEC_TCP_MUX_MAX_CONNECTIONS];
+    /* position and number of the entries of each connection in fds */
+    size_t first[QREXEC_TCP_MUX_MAX_CONNECTIONS];
+    size_t count[QREXEC_TCP_MUX_MAX_CONNECTIONS];
+
+    for (;;) {
+        /* after the end of the stream nothing new is read, the peer would
+         * not grant credit for it anyway */
+        bool reading = !mux->stream_eof && mux->out.len < MUX_OUT_HIGH;
+        size_t npolled = mux->nactive, nfds = 3;
+        int timeout = -1;
+        int res;
+
+        if (mux->stream_eof && mux_drained(mux))
+            return 0;
+        fds[0] = (struct pollfd) {
+            .fd = mux->stream_eof ? -1 : mux->in_fd,
+            .events = POLLIN,
+        };
+        fds[1] = (struct pollfd) {
+            .fd = mux->out.len ? mux->out_fd : -1,
+            .events = POLLOUT,
+        };
+        if (mux->listen_fd >= 0 && reading &&
+                mux->nactive < QREXEC_TCP_MUX_MAX_CONNECTIONS)
+            fds[2] = (struct pollfd) { .fd = mux->listen_fd, .events = POLLIN };
+        else
+            fds[2] = (struct pollfd) { .fd = -1 };
+        for (size_t i = 0; i < npolled; i++) {
+            struct mux_conn *conn = mux->active[i];
+            short events = 0;
+
+            polled[i] = conn;
+            first[i] = nfds;
+            if (conn->connecting) {
+                count[i] = conn->connecting->active;
+                memcpy(fds + nfds, conn->connecting->fds,
+                       count[i] * sizeof(*fds));
+                nfds += count[i];
+                if (conn->connect_wait >= 0 &&
+                        (timeout < 0 || conn->connect_wait < timeout))
+                    timeout = conn->connect_wait;
+                continue;
+            }
+            if (reading && !conn->read_eof && conn->credit)
+                events |= POLLIN;
+            if (conn->pending.len)
+                events |= POLLOUT;
+            /* a connection not waited for is ignored, even if it failed;
+             * that is noticed when it is used again */
+            fds[nfds++] = (struct pollfd) {
+                .fd = events ? conn->fd : -1,
+                .events = events,
+            };
+            count[i] = 1;
+        }
+
+        res = poll(fds, nfds, timeout);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            PERROR("poll");
+            return 1;
+        }
+
+        if ((fds[1].revents & POLLOUT) && !mux_flush_stream(mux))
+            return 1;
+        if (fds[1].revents & (POLLERR | POLLHUP)) {
+            LOG(ERROR, "Stream closed by the peer");
+            return 1;
+        }
+
+        /* a connection can only remove itself here, so the others in
+         * polled stay valid */
+        for (size_t i = 0; i < npolled; i++) {
+            struct mux_conn *conn = polled[i];
+            struct pollfd *pfd = fds + first[i];
+            short revents = pfd->revents;
+
+            if (conn->connecting) {
+                /* also when the time to start another attempt is up */
+                for (size_t j = 0; j < count[i]; j++)
+                    conn->connecting->fds[j].revents = pfd[j].revents;
+                mux_conn_connect(mux, conn);
+                continue;
+            }
+            if (!revents)
+                continue;
+            if ((pfd->events & POLLOUT) &&
+                    (revents & (POLLOUT | POLLERR | POLLHUP)) &&
+                    !mux_conn_flush(mux, conn))
+                continue;
+            if ((pfd->events & POLLIN) &&
+                    (revents & (POLLIN | POLLERR | POLLHUP)))
+                mux_conn_read(mux, conn);
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            res = mux_read_stream(mux);
+            if (res > 0)
+                mux_stream_eof(mux);
+            if (res < 0)
+                return 1;
+        }
+
+        if (fds[2].revents & POLLIN)
+            mux_accept(mux);
+
+        /* send what is ready right away, most of the time it fits */
+        if (mux->out.len && !mux_flush_stream(mux))
+            return 1;
+    }
+}
+
+static int tcp_mux_run(int in_fd, int out_fd, int listen_fd,
+                       const char *host, const char *port, bool allow_names,
+                       unsigned int connect_timeout)
+{
+    struct mux *mux = calloc(1, sizeof(*mux));
+    int rc;
+
+    if (mux == NULL) {
+        LOG(ERROR, "Cannot allocate multiplexer state");
+        return 1;
+    }
+    assert(listen_fd >= 0 || (host != NULL && port != NULL));
+    mux->in_fd = in_fd;
+    mux->out_fd = out_fd;
+    mux->listen_fd = listen_fd;
+    mux->host = host;
+    mux->port = port;
+    mux->allow_names = allow_names;
+    mux->connect_timeout = connect_timeout;
+    set_nonblock(in_fd);
+    set_nonblock(out_fd);
+    if (listen_fd >= 0)
+        set_nonblock(listen_fd);
+
+    rc = mux_loop(mux);
+
+    while (mux->nactive)
+        mux_remove(mux, mux->active[0], false);
+    free(mux->out.data);
+    free(mux);
+    return rc;
+}
+
+int qrexec_tcp_mux_run(int in_fd, int out_fd, int listen_fd,
+                       const char *host, const char *port)
+{
+    return tcp_mux_run(in_fd, out_fd, listen_fd, host, port, false, 0);
+}
+
+struct tcp_mux_target {
+    char *host, *port;
+    bool allow_names;
+    unsigned int connect_timeout;
+    char strings[];
+};
+
+static int tcp_mux_service(const struct qrexec_plugin_call *call, void *data)
+{
+    const struct tcp_mux_target *target = data;
+
+    LOG(INFO, "Multiplexing TCP connections to %s:%s for %s",
+        target->host, target->port, call->source_domain);
+    return tcp_mux_run(fileno(call->stdin_stream),
+                       fileno(call->stdout_stream), -1,
+                       target->host, target->port, target->allow_names,
+                       target->connect_timeout);
+}
+
+int qrexec_start_tcp_mux(struct qrexec_parsed_command *cmd, const char *host,
+                         const char *port, bool allow_names, int *socket_fd)
+{
+    size_t host_len = strlen(host) + 1, port_len = strlen(port) + 1;
+    struct tcp_mux_target *target =
+        malloc(sizeof(*target) + host_len + port_len);
+
+    if (target == NULL) {
+        LOG(ERROR, "Cannot allocate %zu bytes", host_len + port_len);
+        return -2;
+    }
+    target->host = memcpy(target->strings, host, host_len);
+    target->port = memcpy(target->strings + host_len, port, port_len);
+    target->allow_names = allow_names;
+    target->connect_timeout = cmd->connect_timeout;
+    return qrexec_start_builtin(cmd, tcp_mux_service, target, socket_fd);
+}
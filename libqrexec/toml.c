@@ -172,7 +172,12 @@ static void toml_value_free(union toml_data *value, enum toml_type ty) {
 }
 
 int qubes_toml_config_parse(const char *config_full_path, bool *wait_for_session, char **user, bool *send_service_descriptor,
-                            bool *exit_on_service_eof, bool *exit_on_client_eof)
+                            bool *exit_on_service_eof, bool *exit_on_client_eof,
+                            bool *threaded_io, bool *accept_fds,
+                            unsigned int *max_instances, unsigned int *max_queued,
+                            unsigned int *cpu_weight, unsigned int *io_weight,
+                            unsigned long long *memory_high,
+                            unsigned int *connect_timeout)
 {
     int result = -1; /* assume problem */
     FILE *config_file = fopen(config_full_path, "re");
@@ -190,6 +195,14 @@ int qubes_toml_config_parse(const char *config_full_path, bool *wait_for_session
     bool seen_skip_service_descriptor = false;
     bool seen_exit_on_client_eof = false;
     bool seen_exit_on_service_eof = false;
+    bool seen_threaded_io = false;
+    bool seen_accept_fds = false;
+    bool seen_max_instances = false;
+    bool seen_max_queued = false;
+    bool seen_cpu_weight = false;
+    bool seen_io_weight = false;
+    bool seen_memory_high = false;
+    bool seen_connect_timeout = false;
     *wait_for_session = 0;
     *send_service_descriptor = true;
 #define CHECK_DUP_KEY(v) do {                                               \
@@ -305,6 +318,68 @@ int qubes_toml_config_parse(const char *config_full_path, bool *wait_for_session
             CHECK_DUP_KEY(seen_skip_service_descriptor);
             CHECK_TYPE(TOML_TYPE_BOOL, "skip-service-descriptor");
             *send_service_descriptor = !value.boolean;
+        } else if (strcmp(current_line, "threaded-io") == 0) {
+            CHECK_DUP_KEY(seen_threaded_io);
+            CHECK_TYPE(TOML_TYPE_BOOL, "threaded-io");
+            *threaded_io = value.boolean;
+        } else if (strcmp(current_line, "accept-fds") == 0) {
+            CHECK_DUP_KEY(seen_accept_fds);
+            CHECK_TYPE(TOML_TYPE_BOOL, "accept-fds");
+            *accept_fds = value.boolean;
+        } else if (strcmp(current_line, "max-instances") == 0) {
+            CHECK_DUP_KEY(seen_max_instances);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "max-instances");
+            if (value.integer > MAX_FDS) {
+                LOG(ERROR, "%s:%zu: Value %llu for max-instances too large (max %d)",
+                    config_full_path, lineno, value.integer, MAX_FDS);
+                goto bad;
+            }
+            *max_instances = (unsigned int)value.integer;
+        } else if (strcmp(current_line, "max-queued") == 0) {
+            CHECK_DUP_KEY(seen_max_queued);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "max-queued");
+            if (value.integer > MAX_FDS) {
+                LOG(ERROR, "%s:%zu: Value %llu for max-queued too large (max %d)",
+                    config_full_path, lineno, value.integer, MAX_FDS);
+                goto bad;
+            }
+            *max_queued = (unsigned int)value.integer;
+        } else if (strcmp(current_line, "cpu-weight") == 0) {
+            CHECK_DUP_KEY(seen_cpu_weight);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "cpu-weight");
+            if (value.integer < 1 || value.integer > 10000) {
+                LOG(ERROR, "%s:%zu: Value %llu for cpu-weight out of range (1-10000)",
+                    config_full_path, lineno, value.integer);
+                goto bad;
+            }
+            *cpu_weight = (unsigned int)value.integer;
+        } else if (strcmp(current_line, "io-weight") == 0) {
+            CHECK_DUP_KEY(seen_io_weight);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "io-weight");
+            if (value.integer < 1 || value.integer > 10000) {
+                LOG(ERROR, "%s:%zu: Value %llu for io-weight out of range (1-10000)",
+                    config_full_path, lineno, value.integer);
+                goto bad;
+            }
+            *io_weight = (unsigned int)value.integer;
+        } else if (strcmp(current_line, "memory-high") == 0) {
+            CHECK_DUP_KEY(seen_memory_high);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "memory-high");
+            if (value.integer < 1) {
+                LOG(ERROR, "%s:%zu: Value 0 for memory-high not allowed",
+                    config_full_path, lineno);
+                goto bad;
+            }
+            *memory_high = value.integer;
+        } else if (strcmp(current_line, "connect-timeout") == 0) {
+            CHECK_DUP_KEY(seen_connect_timeout);
+            CHECK_TYPE(TOML_TYPE_INTEGER, "connect-timeout");
+            if (value.integer < 1 || value.integer > 3600) {
+                LOG(ERROR, "%s:%zu: Value %llu for connect-timeout out of range (1-3600)",
+                    config_full_path, lineno, value.integer);
+                goto bad;
+            }
+            *connect_timeout = (unsigned int)value.integer;
         } else if (strcmp(current_line, "force-user") == 0) {
             CHECK_DUP_KEY(seen_user);
             CHECK_TYPE(TOML_TYPE_STRING, "user name or user ID");
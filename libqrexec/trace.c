@@ -0,0 +1,114 @@
+/*
+ * Control message tracing, for reproducing a load with
+ * qrexec/tests/socket/replay.py.
+ *
+ * The trace is a text file, with a line per control message handled:
+ *
+ *   offset_ns handle_ns type len payload
+ *
+ * offset_ns is the arrival time since the start of the trace, handle_ns the
+ * time it took to handle the message, type is in hex, and payload is the hex
+ * encoded message payload (missing if empty), or "-" if redacted.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libqrexec-utils.h"
+
+static FILE *trace_file;
+static bool trace_redact;
+static uint64_t trace_start_ns;
+
+/* message being handled */
+static struct msg_header trace_hdr;
+static uint64_t trace_hdr_ns;
+static bool trace_active;
+static unsigned char *trace_payload;
+static size_t trace_payload_len, trace_payload_size;
+
+static uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void qrexec_trace_init(const char *program_name)
+{
+    const char *path = getenv("QREXEC_TRACE_FILE");
+    const char *redact = getenv("QREXEC_TRACE_REDACT");
+
+    if (path == NULL || path[0] == '\0')
+        return;
+    trace_file = fopen(path, "ae");
+    if (trace_file == NULL) {
+        PERROR("Cannot open trace file %s", path);
+        return;
+    }
+    /* a complete line per write, so that forked children do not inherit
+     * anything to flush */
+    setvbuf(trace_file, NULL, _IOLBF, 0);
+    trace_redact = redact != NULL && strcmp(redact, "1") == 0;
+    trace_start_ns = trace_now_ns();
+    fprintf(trace_file, "# qrexec-trace 1 %s%s\n", program_name,
+            trace_redact ? " redacted" : "");
+}
+
+void qrexec_trace_start(const struct msg_header *hdr)
+{
+    if (trace_file == NULL)
+        return;
+    trace_hdr = *hdr;
+    trace_hdr_ns = trace_now_ns();
+    trace_payload_len = 0;
+    trace_active = true;
+}
+
+void qrexec_trace_payload(const void *data, size_t len)
+{
+    if (!trace_active || trace_redact)
+        return;
+    if (trace_payload_len + len > trace_payload_size) {
+        size_t new_size = trace_payload_len + len;
+        unsigned char *new_payload = realloc(trace_payload, new_size);
+
+        if (new_payload == NULL) {
+            LOG(ERROR, "Cannot allocate trace buffer, payload not recorded");
+            return;
+        }
+        trace_payload = new_payload;
+        trace_payload_size = new_size;
+    }
+    memcpy(trace_payload + trace_payload_len, data, len);
+    trace_payload_len += len;
+}
+
+void qrexec_trace_end(void)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint64_t now;
+
+    if (!trace_active)
+        return;
+    now = trace_now_ns();
+    trace_active = false;
+    fprintf(trace_file, "%llu %llu 0x%x %u",
+            (unsigned long long)(trace_hdr_ns - trace_start_ns),
+            (unsigned long long)(now - trace_hdr_ns),
+            trace_hdr.type, trace_hdr.len);
+    if (trace_redact) {
+        fputs(" -", trace_file);
+    } else if (trace_payload_len > 0) {
+        fputc(' ', trace_file);
+        for (size_t i = 0; i < trace_payload_len; i++) {
+            fputc(hex[trace_payload[i] >> 4], trace_file);
+            fputc(hex[trace_payload[i] & 0xf], trace_file);
+        }
+    }
+    fputc('\n', trace_file);
+}
@@ -19,9 +19,11 @@
  *
  */
 
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <libvchan.h>
@@ -76,3 +78,91 @@ int read_vchan_all(libvchan_t *vchan, void *data, size_t size) {
     }
     return 1;
 }
+
+void vchan_queue_init(struct vchan_queue *queue) {
+    buffer_init(&queue->buf);
+    queue->head_sent = 0;
+    queue->ring_space = 0;
+}
+
+void vchan_queue_free(struct vchan_queue *queue) {
+    buffer_free(&queue->buf);
+    queue->head_sent = 0;
+    queue->ring_space = 0;
+}
+
+void vchan_queue_append(struct vchan_queue *queue, const void *data, size_t size) {
+    if (size > INT_MAX) {
+        LOG(ERROR, "Control message too large: %zu", size);
+        exit(1);
+    }
+    buffer_append(&queue->buf, data, (int)size);
+}
+
+int vchan_queue_flush(libvchan_t *vchan, struct vchan_queue *queue) {
+    const char *data = buffer_data(&queue->buf);
+    size_t len = (size_t)buffer_len(&queue->buf);
+    size_t pos = 0;
+    int ret = 0;
+
+    while (len - pos >= sizeof(struct msg_header)) {
+        struct msg_header hdr;
+        size_t msg_len;
+        int space, written;
+
+        memcpy(&hdr, data + pos, sizeof(hdr));
+        msg_len = sizeof(hdr) + hdr.len;
+        /* the rest of the message is not queued yet */
+        if (len - pos < msg_len)
+            break;
+        space = libvchan_buffer_space(vchan);
+        if (space < 0) {
+            ret = -1;
+            break;
+        }
+        if (space > queue->ring_space)
+            queue->ring_space = space;
+        if (queue->head_sent == 0 && (size_t)space >= msg_len) {
+            if (libvchan_send(vchan, data + pos, msg_len) != (int)msg_len) {
+                ret = -1;
+                break;
+            }
+            pos += msg_len;
+            continue;
+        }
+        /*
+         * Wait for the whole message to fit, unless it is larger than the
+         * ring has ever been seen to be - then it never will, so write it
+         * out in pieces.  The receiver reads such messages with
+         * read_vchan_all().
+         */
+        if (queue->head_sent == 0 && msg_len <= (size_t)queue->ring_space)
+            break;
+        if (space == 0)
+            break;
+        if ((size_t)space > msg_len - queue->head_sent)
+            space = (int)(msg_len - queue->head_sent);
+        written = libvchan_write(vchan, data + pos + queue->head_sent, space);
+        if (written < 0) {
+            ret = -1;
+            break;
+        }
+        queue->head_sent += (size_t)written;
+        if (queue->head_sent < msg_len)
+            break;
+        queue->head_sent = 0;
+        pos += msg_len;
+    }
+    /* remove everything sent at once, to avoid copying the rest repeatedly */
+    if (pos > 0)
+        buffer_remove(&queue->buf, (int)pos);
+    return ret;
+}
+
+bool vchan_queue_empty(const struct vchan_queue *queue) {
+    return queue->buf.buflen == 0;
+}
+
+bool vchan_queue_full(const struct vchan_queue *queue) {
+    return queue->buf.buflen >= VCHAN_QUEUE_LIMIT;
+}
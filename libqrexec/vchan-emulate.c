@@ -0,0 +1,253 @@
+/*
+ * vchan emulation shim, for benchmarking on a plain Linux box.
+ *
+ * The vchan-socket backend has much cheaper notifications and more bandwidth
+ * than Xen vchan, which hides the costs that batching and pooling are meant
+ * to save.  Preloading this library into qrexec programs built with
+ * BACKEND_VMM=socket wraps the libvchan calls they make, to add those costs
+ * back:
+ *
+ *   LD_PRELOAD=libqrexec/libvchan-emulate.so \
+ *   QREXEC_VCHAN_LATENCY_US=20 QREXEC_VCHAN_BANDWIDTH=1000000000 ...
+ *
+ * The following variables are read once, unset or 0 disables the feature:
+ *
+ *   QREXEC_VCHAN_LATENCY_US - delay before libvchan_wait() returns, that is
+ *     the time it takes a notification to wake up the receiving side
+ *   QREXEC_VCHAN_NOTIFY_COST_US - CPU time spent (busy waiting) on every
+ *     libvchan_send() and libvchan_write(), for the notification hypercall
+ *   QREXEC_VCHAN_RING_SIZE - upper limit of libvchan_buffer_space() and of
+ *     the size of a single libvchan_write(); data sent earlier and not read
+ *     by the other side yet is not accounted for
+ *   QREXEC_VCHAN_BANDWIDTH - bytes per second each vchan can send; a sender
+ *     going faster is delayed until its data would have been transferred
+ */
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libvchan.h>
+
+#define EMU_EXPORT __attribute__((visibility("default")))
+
+/* How long a sender may stay idle and then send at more than the configured
+ * bandwidth.  Also makes up for sleeps taking longer than asked. */
+#define BANDWIDTH_BURST_NS 1000000ULL
+
+struct emu_vchan {
+    libvchan_t *vchan;
+    /* time when the data sent so far is transferred at the configured
+     * bandwidth */
+    unsigned long long busy_until_ns;
+    struct emu_vchan *next;
+};
+
+static struct {
+    unsigned long long latency_ns;
+    unsigned long long notify_cost_ns;
+    unsigned long long ring_size;
+    unsigned long long bandwidth;
+} config;
+
+static __typeof__(libvchan_send) *real_send;
+static __typeof__(libvchan_write) *real_write;
+static __typeof__(libvchan_wait) *real_wait;
+static __typeof__(libvchan_buffer_space) *real_buffer_space;
+static __typeof__(libvchan_close) *real_close;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t vchans_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct emu_vchan *vchans;
+/* set while calling into the backend, whose functions may call each other
+ * through this library again */
+static __thread bool in_backend;
+
+static unsigned long long env_value(const char *name)
+{
+    const char *value = getenv(name);
+    char *end;
+    unsigned long long ret;
+
+    if (value == NULL || *value == '\0')
+        return 0;
+    ret = strtoull(value, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "vchan-emulate: invalid %s value %s, ignoring\n",
+                name, value);
+        return 0;
+    }
+    return ret;
+}
+
+static void *resolve(const char *name)
+{
+    void *sym = dlsym(RTLD_NEXT, name);
+
+    if (sym == NULL) {
+        fprintf(stderr, "vchan-emulate: cannot find %s: %s\n", name, dlerror());
+        abort();
+    }
+    return sym;
+}
+
+static void emu_init(void)
+{
+    config.latency_ns = env_value("QREXEC_VCHAN_LATENCY_US") * 1000;
+    config.notify_cost_ns = env_value("QREXEC_VCHAN_NOTIFY_COST_US") * 1000;
+    config.ring_size = env_value("QREXEC_VCHAN_RING_SIZE");
+    config.bandwidth = env_value("QREXEC_VCHAN_BANDWIDTH");
+
+    real_send = resolve("libvchan_send");
+    real_write = resolve("libvchan_write");
+    real_wait = resolve("libvchan_wait");
+    real_buffer_space = resolve("libvchan_buffer_space");
+    real_close = resolve("libvchan_close");
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+        (unsigned long long)ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long ns)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t)(ns / 1000000000ULL),
+        .tv_nsec = (long)(ns % 1000000000ULL),
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static void busy_wait(unsigned long long ns)
+{
+    unsigned long long end = now_ns() + ns;
+
+    while (now_ns() < end)
+        ;
+}
+
+/* Account for size bytes sent over vchan, and return when they would have
+ * been transferred. */
+static void throttle(libvchan_t *vchan, size_t size)
+{
+    struct emu_vchan *v;
+    unsigned long long now = now_ns(), until;
+
+    pthread_mutex_lock(&vchans_lock);
+    for (v = vchans; v != NULL; v = v->next)
+        if (v->vchan == vchan)
+            break;
+    if (v == NULL) {
+        v = calloc(1, sizeof(*v));
+        if (v == NULL) {
+            pthread_mutex_unlock(&vchans_lock);
+            return;
+        }
+        v->vchan = vchan;
+        v->next = vchans;
+        vchans = v;
+    }
+    if (v->busy_until_ns + BANDWIDTH_BURST_NS < now)
+        v->busy_until_ns = now - BANDWIDTH_BURST_NS;
+    v->busy_until_ns += (unsigned long long)size * 1000000000ULL /
+        config.bandwidth;
+    until = v->busy_until_ns;
+    pthread_mutex_unlock(&vchans_lock);
+
+    if (until > now)
+        sleep_until(until);
+}
+
+static void after_send(libvchan_t *vchan, int ret)
+{
+    if (ret <= 0)
+        return;
+    if (config.notify_cost_ns)
+        busy_wait(config.notify_cost_ns);
+    if (config.bandwidth)
+        throttle(vchan, (size_t)ret);
+}
+
+EMU_EXPORT int libvchan_send(libvchan_t *ctrl, const void *data, size_t size)
+{
+    int ret;
+
+    pthread_once(&init_once, emu_init);
+    if (in_backend)
+        return real_send(ctrl, data, size);
+    in_backend = true;
+    ret = real_send(ctrl, data, size);
+    in_backend = false;
+    after_send(ctrl, ret);
+    return ret;
+}
+
+EMU_EXPORT int libvchan_write(libvchan_t *ctrl, const void *data, size_t size)
+{
+    int ret;
+
+    pthread_once(&init_once, emu_init);
+    if (!in_backend && config.ring_size && size > config.ring_size)
+        size = config.ring_size;
+    if (in_backend)
+        return real_write(ctrl, data, size);
+    in_backend = true;
+    ret = real_write(ctrl, data, size);
+    in_backend = false;
+    after_send(ctrl, ret);
+    return ret;
+}
+
+EMU_EXPORT int libvchan_wait(libvchan_t *ctrl)
+{
+    int ret;
+
+    pthread_once(&init_once, emu_init);
+    if (in_backend)
+        return real_wait(ctrl);
+    in_backend = true;
+    ret = real_wait(ctrl);
+    in_backend = false;
+    if (ret >= 0 && config.latency_ns)
+        sleep_until(now_ns() + config.latency_ns);
+    return ret;
+}
+
+EMU_EXPORT int libvchan_buffer_space(libvchan_t *ctrl)
+{
+    int ret;
+
+    pthread_once(&init_once, emu_init);
+    ret = real_buffer_space(ctrl);
+    if (config.ring_size && ret > 0 &&
+            (unsigned long long)ret > config.ring_size)
+        ret = (int)config.ring_size;
+    return ret;
+}
+
+EMU_EXPORT void libvchan_close(libvchan_t *ctrl)
+{
+    struct emu_vchan **p, *v;
+
+    pthread_once(&init_once, emu_init);
+    pthread_mutex_lock(&vchans_lock);
+    for (p = &vchans; *p != NULL; p = &(*p)->next) {
+        if ((*p)->vchan == ctrl) {
+            v = *p;
+            *p = v->next;
+            free(v);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vchans_lock);
+    real_close(ctrl);
+}
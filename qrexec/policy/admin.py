@@ -43,11 +43,28 @@ class PolicyAdminTokenException(Exception):
     """
 
 
-def method(service_name, *, no_arg=False, no_payload=False):
+def method(
+    service_name,
+    *,
+    no_arg=False,
+    no_payload=False,
+    read_only=False,
+    parsed_policy=False,
+):
+    """Mark an API method.
+
+    read_only methods take a shared lock on the policy directory only.
+    parsed_policy methods only look at the parsed policy, so with a
+    :py:class:`qrexec.policy.utils.PolicyCache` they need no lock at all, and
+    the policy daemon can serve them.
+    """
+
     def decorator(func):
         func.api_service_name = service_name
         func.api_no_arg = no_arg
         func.api_no_payload = no_payload
+        func.api_read_only = read_only or parsed_policy
+        func.api_parsed_policy = parsed_policy
         return func
 
     return decorator
@@ -74,9 +91,15 @@ class PolicyAdmin:
 
     # pylint: disable=no-self-use
 
-    def __init__(self, policy_path):
+    def __init__(self, policy_path, policy_cache=None):
+        """With policy_cache, methods reading the parsed policy use its
+        snapshot instead of parsing the whole directory for each call."""
         self.policy_path = policy_path
         self.include_path = policy_path / "include"
+        self.policy_cache = policy_cache
+        # results derived from the policy_cache snapshot
+        self.cache_generation = None
+        self.files_cache = {}
 
     def handle_request(
         self, service_name: str, arg: str, payload: bytes
@@ -89,7 +112,7 @@ class PolicyAdmin:
 
         assert all(char in RPCNAME_ALLOWED_CHARSET for char in arg)
 
-        func = self._find_method(service_name)
+        func = self.find_method(service_name)
         if not func:
             raise PolicyAdminException(
                 "unrecognized method: {}".format(service_name)
@@ -109,38 +132,58 @@ class PolicyAdmin:
         else:
             args.append(payload)
 
-        with self._lock():
+        if func.api_parsed_policy and self.policy_cache is not None:
+            return func(*args)
+        with self._lock(shared=func.api_read_only):
             return func(*args)
 
-    def _find_method(self, service_name):
-        for attr in dir(self):
-            func = getattr(self, attr)
-            if callable(func) and hasattr(func, "api_service_name"):
-                if func.api_service_name == service_name:
-                    return func
-
-        return None
+    def find_method(self, service_name):
+        """The bound method implementing service_name, or None"""
+        attr = self._method_table().get(service_name)
+        return getattr(self, attr) if attr else None
+
+    @classmethod
+    def _method_table(cls):
+        """Service name to attribute name, built once per class"""
+        table = cls.__dict__.get("_methods")
+        if table is None:
+            table = {}
+            for attr in dir(cls):
+                func = getattr(cls, attr)
+                if callable(func) and hasattr(func, "api_service_name"):
+                    table[func.api_service_name] = attr
+            cls._methods = table
+        return table
 
     @contextlib.contextmanager
-    def _lock(self):
+    def _lock(self, shared=False):
         """
-        Acquire an exclusive lock to policy directory.
+        Acquire an exclusive (or shared) lock to policy directory.
         """
 
         lock_fd = os.open(str(self.policy_path), os.O_DIRECTORY)
         try:
-            fcntl.flock(lock_fd, fcntl.LOCK_EX)
+            fcntl.flock(lock_fd, fcntl.LOCK_SH if shared else fcntl.LOCK_EX)
             yield
         finally:
             os.close(lock_fd)
 
+    def _get_policy(self):
+        if self.policy_cache is None:
+            return FilePolicy(policy_path=self.policy_path)
+        policy = self.policy_cache.get_policy()
+        if self.cache_generation != self.policy_cache.generation:
+            self.cache_generation = self.policy_cache.generation
+            self.files_cache.clear()
+        return policy
+
     # List
 
-    @method("policy.List", no_arg=True, no_payload=True)
+    @method("policy.List", no_arg=True, no_payload=True, read_only=True)
     def policy_list(self):
         return self._common_list(self.policy_path, ".policy")
 
-    @method("policy.include.List", no_arg=True, no_payload=True)
+    @method("policy.include.List", no_arg=True, no_payload=True, read_only=True)
     def policy_include_list(self):
         return self._common_list(self.include_path, "")
 
@@ -160,12 +203,12 @@ class PolicyAdmin:
 
     # Get
 
-    @method("policy.Get", no_payload=True)
+    @method("policy.Get", no_payload=True, read_only=True)
     def policy_get(self, arg):
         path = self._get_path(arg, self.policy_path, ".policy")
         return self._common_get(path)
 
-    @method("policy.include.Get", no_payload=True)
+    @method("policy.include.Get", no_payload=True, read_only=True)
     def policy_include_get(self, arg):
         path = self._get_path(arg, self.include_path, "")
         return self._common_get(path)
@@ -236,7 +279,7 @@ class PolicyAdmin:
 
     # List files
 
-    @method("policy.GetFiles", no_payload=True)
+    @method("policy.GetFiles", no_payload=True, parsed_policy=True)
     def policy_get_files(self, arg):
         if not isinstance(arg, str) or not arg:
             raise PolicyAdminException('Service cannot be empty.')
@@ -248,7 +291,9 @@ class PolicyAdmin:
 
         service = arg
 
-        policy = FilePolicy(policy_path=self.policy_path)
+        policy = self._get_policy()
+        if service in self.files_cache:
+            return self.files_cache[service]
         rules = policy.find_rules_for_service(service)
 
         file_list = []
@@ -262,7 +307,14 @@ class PolicyAdmin:
             if path_to_append not in file_list:
                 file_list.append(path_to_append)
 
-        return ("".join(f"{f}\n" for f in file_list)).encode('utf-8')
+        result = ("".join(f"{f}\n" for f in file_list)).encode('utf-8')
+        if self.policy_cache is not None:
+            # service names come from the caller, do not let them grow the
+            # cache without bounds
+            if len(self.files_cache) >= 1024:
+                self.files_cache.clear()
+            self.files_cache[service] = result
+        return result
 
     # helpers
 
@@ -0,0 +1,214 @@
+#
+# The Qubes OS Project, https://www.qubes-os.org/
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <https://www.gnu.org/licenses/>.
+#
+
+"""Asynchronous logging of policy decisions.
+
+Every decision of the policy daemon is logged (see
+:py:class:`qrexec.tools.qrexec_policy_exec.LogAllowedResolution` and
+:py:func:`qrexec.tools.qrexec_policy_exec.handle_request`).  Writing to the
+log synchronously from the event loop makes every request wait for syslog or
+journald.  :py:class:`AuditHandler` only queues the records, and a
+background task writes them in batches, outside of the event loop.
+
+Identical records (same level and message, i.e. the same decision for the
+same call) are summarized: after *burst* of them in *interval* seconds, the
+rest is only counted, and reported by a single record when the interval
+ends.  When the queue is full, records are dropped and the number of dropped
+records is reported as soon as there is space again.
+"""
+
+import asyncio
+import logging
+import time
+from typing import Dict, Iterable, List, Optional, Tuple
+
+
+class _Repeats:
+    # pylint: disable=too-few-public-methods
+    __slots__ = ("start", "count", "record")
+
+    def __init__(self, start: float, record: logging.LogRecord):
+        self.start = start
+        self.count = 1
+        #: last suppressed record, a template for the summary
+        self.record = record
+
+
+class AuditHandler(logging.Handler):
+    """Queue log records and write them to *handlers* from a background
+    task, see the module documentation.
+
+    Until :py:meth:`start` is called (for example in one-shot tools without
+    a running event loop), records are written synchronously.
+    """
+
+    # pylint: disable=too-many-instance-attributes,too-many-arguments
+    def __init__(
+        self,
+        handlers: Iterable[logging.Handler],
+        *,
+        queue_size: int = 4096,
+        batch_size: int = 256,
+        interval: float = 60.0,
+        burst: int = 10,
+        max_tracked: int = 1024,
+    ):
+        super().__init__()
+        self.handlers = list(handlers)
+        self.queue_size = queue_size
+        self.batch_size = batch_size
+        self.interval = interval
+        self.burst = burst
+        self.max_tracked = max_tracked
+        self.queue: Optional[asyncio.Queue] = None
+        self.task: Optional[asyncio.Task] = None
+        self.repeats: Dict[Tuple[int, str], _Repeats] = {}
+        self.summaries: List[logging.LogRecord] = []
+        #: records dropped because the queue was full, since the start
+        self.dropped = 0
+        self.reported_dropped = 0
+        #: records not written, but counted in a summary, since the start
+        self.suppressed = 0
+        self.written = 0
+
+    def start(self):
+        """Start the writer task, must be called from the event loop"""
+        self.queue = asyncio.Queue(self.queue_size)
+        self.task = asyncio.get_running_loop().create_task(self._writer())
+
+    async def stop(self):
+        """Write out the queued records and summaries, and stop the writer"""
+        if self.task is None:
+            return
+        await self.queue.join()
+        self.task.cancel()
+        try:
+            await self.task
+        except asyncio.CancelledError:
+            pass
+        self.task = None
+        self.queue = None
+        self._write(self._take_summaries(expired_only=False))
+
+    def emit(self, record: logging.LogRecord):
+        keep = self._count_repeat(record)
+        if self.queue is None:
+            records, self.summaries = self.summaries, []
+            if keep:
+                records.append(record)
+            self._write(records)
+            return
+        if not keep:
+            return
+        try:
+            self.queue.put_nowait(record)
+        except asyncio.QueueFull:
+            self.dropped += 1
+
+    def _count_repeat(self, record: logging.LogRecord) -> bool:
+        """Returns False if the record should only be counted"""
+        now = time.monotonic()
+        key = (record.levelno, record.getMessage())
+        repeats = self.repeats.get(key)
+        if repeats is not None:
+            if now - repeats.start < self.interval:
+                repeats.count += 1
+                if repeats.count <= self.burst:
+                    return True
+                repeats.record = record
+                self.suppressed += 1
+                return False
+            # the interval is over, start a new one
+            del self.repeats[key]
+            self.summaries.extend(self._summary(repeats, now))
+        if len(self.repeats) < self.max_tracked:
+            self.repeats[key] = _Repeats(now, record)
+        return True
+
+    def _summary(self, repeats: _Repeats, now: float) -> List[logging.LogRecord]:
+        if repeats.count <= self.burst:
+            return []
+        summary = logging.makeLogRecord(repeats.record.__dict__)
+        summary.msg = "%s [%d more times in %d s]"
+        summary.args = (
+            repeats.record.getMessage(),
+            repeats.count - self.burst,
+            round(now - repeats.start),
+        )
+        summary.exc_info = summary.exc_text = None
+        return [summary]
+
+    def _take_summaries(self, expired_only=True) -> List[logging.LogRecord]:
+        """Summaries of the finished intervals, and of the dropped records"""
+        now = time.monotonic()
+        records, self.summaries = self.summaries, []
+        for key, repeats in list(self.repeats.items()):
+            if expired_only and now - repeats.start < self.interval:
+                continue
+            del self.repeats[key]
+            records.extend(self._summary(repeats, now))
+        if self.dropped != self.reported_dropped:
+            records.append(
+                logging.makeLogRecord(
+                    {
+                        "name": "policy",
+                        "levelno": logging.WARNING,
+                        "levelname": "WARNING",
+                        "msg": "%d log records dropped, the log is too slow "
+                        "(%d in total)",
+                        "args": (
+                            self.dropped - self.reported_dropped,
+                            self.dropped,
+                        ),
+                    }
+                )
+            )
+            self.reported_dropped = self.dropped
+        return records
+
+    def _write(self, records: List[logging.LogRecord]):
+        for record in records:
+            for handler in self.handlers:
+                if record.levelno >= handler.level:
+                    handler.handle(record)
+        self.written += len(records)
+
+    async def _writer(self):
+        loop = asyncio.get_running_loop()
+        while True:
+            try:
+                batch = [
+                    await asyncio.wait_for(
+                        self.queue.get(), timeout=self.interval
+                    )
+                ]
+            except asyncio.TimeoutError:
+                batch = []
+            while len(batch) < self.batch_size:
+                try:
+                    batch.append(self.queue.get_nowait())
+                except asyncio.QueueEmpty:
+                    break
+            taken = len(batch)
+            batch.extend(self._take_summaries())
+            try:
+                if batch:
+                    # the handlers may block, keep them off the event loop
+                    await loop.run_in_executor(None, self._write, batch)
+            finally:
+                for _ in range(taken):
+                    self.queue.task_done()
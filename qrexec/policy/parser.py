@@ -31,10 +31,12 @@ import itertools
 import logging
 import pathlib
 import string
+import time
 
 from typing import (
     Iterable,
     List,
+    NamedTuple,
     TextIO,
     Tuple,
     Dict,
@@ -309,6 +311,14 @@ class VMToken(str, metaclass=VMTokenMeta):
         # pylint: disable=unused-argument
         return self == other
 
+    def covers(self, other: "VMToken") -> bool:
+        """Check if this token matches everything the other token matches,
+        regardless of the system state (tags, types etc.)
+
+        This is conservative: False means only that it cannot be proven.
+        """
+        return type(self) is type(other) and self == other
+
     def is_special_value(self) -> bool:
         """Check if the token specification is special (keyword) value"""
         return self.startswith("@") or self == "*"
@@ -417,6 +427,9 @@ class WildcardVM(Source, Target):
     ) -> bool:
         return True
 
+    def covers(self, other: VMToken) -> bool:
+        return True
+
     def expand(self, *, system_info: FullSystemInfo) -> Iterable[VMToken]:
         for name, domain in system_info["domains"].items():
             yield IntendedTarget(name)
@@ -450,6 +463,10 @@ class AnyVM(Source, Target):
     ) -> bool:
         return other != "@adminvm"
 
+    def covers(self, other: VMToken) -> bool:
+        # qube names cannot start with "@", so only these match "@adminvm"
+        return not isinstance(other, (WildcardVM, AdminVM))
+
     def expand(self, *, system_info: FullSystemInfo) -> Iterable[VMToken]:
         for name, domain in system_info["domains"].items():
             if domain["type"] != "AdminVM":
@@ -884,6 +901,12 @@ class ActionType(metaclass=abc.ABCMeta):
         """
         raise NotImplementedError()
 
+    def params(self) -> Tuple[type, Dict[str, object]]:
+        """The action type and its parameters, for comparing actions"""
+        return type(self), {
+            key: value for key, value in vars(self).items() if key != "rule"
+        }
+
     def actual_target(self, intended_target: VMToken) -> IntendedTarget:
         """If action has redirect, it is it. Otherwise, the rule's own target
 
@@ -1164,6 +1187,13 @@ class Rule:
         #: the line number
         self.lineno = lineno
 
+        #: number of requests matched by this rule, counted only when
+        #: :py:attr:`AbstractPolicy.collect_stats` is set
+        self.matches = 0
+        #: time spent finding this rule for the requests it matched, in
+        #: nanoseconds
+        self.match_time_ns = 0
+
         service_, argument_ = validate_service_and_argument(
             service, argument, filepath=filepath, lineno=lineno
         )
@@ -1354,6 +1384,20 @@ class Rule:
             system_info=request.system_info,
         )
 
+    def covers(self, other: "Rule") -> bool:
+        """Check if this rule matches every request the other rule matches
+
+        If so and this rule comes first, the other one is never the result of
+        :py:meth:`AbstractPolicy.find_matching_rule`. Like
+        :py:meth:`VMToken.covers`, this is conservative.
+        """
+        return (
+            (self.service is None or self.service == other.service)
+            and (self.argument is None or self.argument == other.argument)
+            and self.source.covers(other.source)
+            and self.target.covers(other.target)
+        )
+
     def is_match_but_target(self, request: Request) -> bool:
         """Check if given (service, argument source) matches this line.
 
@@ -1597,17 +1641,47 @@ class AbstractParser(metaclass=abc.ABCMeta):
         """
 
 
+class ShadowedRule(NamedTuple):
+    """A rule never matched first, see
+    :py:meth:`AbstractPolicy.find_shadowed_rules`"""
+
+    rule: Rule
+    #: the earlier rule matching every request that *rule* matches
+    shadowed_by: Rule
+    #: whether both rules are the same, including the action
+    duplicate: bool
+
+
 class AbstractPolicy(AbstractParser):
     """This class is a parser that accumulates the rules to form policy."""
 
+    #: count matches and time them in :py:meth:`find_matching_rule`
+    collect_stats = False
+    #: maximum number of entries in :py:attr:`ask_targets_cache`
+    ask_targets_cache_size = 1024
+
     def __init__(self, *args, **kwds):
         super().__init__(*args, **kwds)
         #: list of Rule objects
         self.rules: List[Rule] = []
+        #: rules evaluated by :py:meth:`find_matching_rule`, the same list
+        #: as :py:attr:`rules` unless :py:meth:`compact` was called
+        self.match_rules: List[Rule] = self.rules
+        #: number of requests not matched by any rule
+        self.unmatched = 0
+        #: time spent on the requests not matched by any rule, in nanoseconds
+        self.unmatched_time_ns = 0
+        #: results of :py:meth:`collect_targets_for_ask` by (service,
+        #: argument, source), valid for :py:attr:`ask_targets_system_info`
+        self.ask_targets_cache: Dict[
+            Tuple[Optional[str], Optional[str], str], FrozenSet[str]
+        ] = {}
+        self.ask_targets_system_info: Optional[FullSystemInfo] = None
 
     def handle_rule(self, rule, *, filepath, lineno):
         # pylint: disable=unused-argument
         self.rules.append(rule)
+        self.ask_targets_cache.clear()
 
     def evaluate(self, request):
         """Evaluate policy
@@ -1625,11 +1699,95 @@ class AbstractPolicy(AbstractParser):
     def find_matching_rule(self, request):
         """Find the first rule matching given request"""
 
-        for rule in self.rules:
+        if not self.collect_stats:
+            for rule in self.match_rules:
+                if rule.is_match(request):
+                    return rule
+            raise AccessDenied("no matching rule found")
+
+        # Only the rule found is updated, to keep the overhead constant. The
+        # number of evaluations is derived from it in get_rule_stats().
+        start = time.perf_counter_ns()
+        for rule in self.match_rules:
             if rule.is_match(request):
+                rule.matches += 1
+                rule.match_time_ns += time.perf_counter_ns() - start
                 return rule
+        self.unmatched += 1
+        self.unmatched_time_ns += time.perf_counter_ns() - start
         raise AccessDenied("no matching rule found")
 
+    def get_rule_stats(self) -> List[Tuple[Rule, int]]:
+        """Number of evaluations of each evaluated rule, in policy order
+
+        The rules are evaluated in order until the first match, so a rule was
+        evaluated for every request matched by it, by a later rule, or by
+        none. Use :py:attr:`Rule.matches` and :py:attr:`Rule.match_time_ns`
+        for the other counters.
+        """
+        evaluations = self.unmatched
+        result = []
+        for rule in reversed(self.match_rules):
+            evaluations += rule.matches
+            result.append((rule, evaluations))
+        result.reverse()
+        return result
+
+    def find_shadowed_rules(self) -> List[ShadowedRule]:
+        """Find rules that can never be the first match for a request
+
+        Each such rule is reported with the first earlier rule covering it.
+        Shadowed rules still count for :py:meth:`collect_targets_for_ask`.
+        """
+        result = []
+        # earlier rules by service, None for any service
+        by_service: Dict[Optional[str], List[Tuple[int, Rule]]] = {None: []}
+        for position, rule in enumerate(self.rules):
+            if rule.service is None:
+                candidates: Iterable[Tuple[int, Rule]] = itertools.chain.from_iterable(
+                    by_service.values()
+                )
+            else:
+                candidates = itertools.chain(
+                    by_service[None], by_service.get(rule.service, ())
+                )
+            # candidates are not in policy order across services, pick the
+            # earliest one
+            shadowed_by = min(
+                (
+                    (index, earlier)
+                    for index, earlier in candidates
+                    if earlier.covers(rule)
+                ),
+                key=lambda item: item[0],
+                default=None,
+            )
+            if shadowed_by is not None:
+                earlier = shadowed_by[1]
+                result.append(
+                    ShadowedRule(
+                        rule,
+                        earlier,
+                        duplicate=rule.covers(earlier)
+                        and earlier.action.params() == rule.action.params(),
+                    )
+                )
+            by_service.setdefault(rule.service, []).append((position, rule))
+        return result
+
+    def compact(self) -> List[ShadowedRule]:
+        """Drop shadowed rules from :py:attr:`match_rules`
+
+        The result of :py:meth:`evaluate` does not change. Returns what
+        :py:meth:`find_shadowed_rules` found.
+        """
+        shadowed = self.find_shadowed_rules()
+        dropped = {id(item.rule) for item in shadowed}
+        self.match_rules = [
+            rule for rule in self.rules if id(rule) not in dropped
+        ]
+        return shadowed
+
     def find_rules_for_service(self, service):
         for rule in self.rules:
             if rule.service is None or rule.service == service:
@@ -1640,7 +1798,29 @@ class AbstractPolicy(AbstractParser):
 
         Word 'targets' is used intentionally instead of 'domains', because it
         can also contains @dispvm like keywords.
+
+        The result depends only on the policy, the system info and the
+        service, argument and source of the request, so it is cached until
+        a rule is added or the request comes with another system info
+        object (:py:func:`qrexec.utils.get_system_info` returns the same
+        one while the system does not change).
         """
+        if request.system_info is not self.ask_targets_system_info:
+            self.ask_targets_cache.clear()
+            self.ask_targets_system_info = request.system_info
+        key = (request.service, request.argument, request.source)
+        try:
+            targets = self.ask_targets_cache[key]
+        except KeyError:
+            targets = frozenset(self.compute_targets_for_ask(request))
+            # arguments come from the qubes, do not let them grow the cache
+            if len(self.ask_targets_cache) >= self.ask_targets_cache_size:
+                self.ask_targets_cache.clear()
+            self.ask_targets_cache[key] = targets
+        return set(targets)
+
+    def compute_targets_for_ask(self, request):
+        """Uncached :py:meth:`collect_targets_for_ask`"""
         targets: Set[str] = set()
 
         # iterate over rules in reversed order to easier handle 'deny'
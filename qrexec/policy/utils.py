@@ -19,19 +19,28 @@
 #
 import asyncio
 import os.path
-import pyinotify
 from qrexec import POLICYPATH, POLICYPATH_OLD
 from . import parser
 
 
 class PolicyCache:
-    def __init__(self, path=POLICYPATH, use_legacy=True, lazy_load=False):
+    def __init__(
+        self, path=POLICYPATH, use_legacy=True, lazy_load=False,
+        collect_stats=False, compact=False
+    ):
         self.path = path
         self.outdated = lazy_load
+        # per-rule statistics start over on each reload
+        self.collect_stats = collect_stats
+        # skip shadowed rules when evaluating
+        self.compact = compact
+        # incremented on each load, for users caching results derived from
+        # the policy
+        self.generation = 0
         if lazy_load:
             self.policy = None
         else:
-            self.policy = parser.FilePolicy(policy_path=self.path)
+            self.policy = self.load_policy()
 
         # default policy paths are listed manually, for compatibility with R4.0
         # to be removed in Qubes 5.0
@@ -45,6 +54,10 @@ class PolicyCache:
         self.notifier = None
 
     def initialize_watcher(self):
+        # imported here, one-shot users (qrexec-policy-exec) do not watch
+        # the policy and should not pay for it on startup
+        import pyinotify
+
         self.watch_manager = pyinotify.WatchManager()
 
         # pylint: disable=no-member
@@ -92,28 +105,30 @@ class PolicyCache:
 
     def get_policy(self):
         if self.outdated:
-            self.policy = parser.FilePolicy(policy_path=self.path)
+            self.policy = self.load_policy()
             self.outdated = False
 
         return self.policy
 
+    def load_policy(self):
+        self.generation += 1
+        policy = parser.FilePolicy(policy_path=self.path)
+        policy.collect_stats = self.collect_stats
+        if self.compact:
+            policy.compact()
+        return policy
 
-class PolicyWatcher(pyinotify.ProcessEvent):
-    def __init__(self, cache):
-        self.cache = cache
-        super().__init__()
-
-    def process_IN_CREATE(self, _):
-        self.cache.outdated = True
 
-    def process_IN_DELETE(self, _):
-        self.cache.outdated = True
+class PolicyWatcher:
+    """pyinotify event handler, for any event on the policy
 
-    def process_IN_MODIFY(self, _):
-        self.cache.outdated = True
+    This is a plain callable rather than a pyinotify.ProcessEvent, so that
+    pyinotify is imported only by :py:meth:`PolicyCache.initialize_watcher`.
+    """
 
-    def process_IN_MOVED_TO(self, _):
-        self.cache.outdated = True
+    def __init__(self, cache):
+        self.cache = cache
 
-    def process_IN_MOVED_FROM(self, _):
+    def __call__(self, event):
+        # pylint: disable=unused-argument
         self.cache.outdated = True
@@ -18,7 +18,9 @@
 #
 
 from pathlib import Path
+import os
 import tempfile
+import time
 
 import pytest
 
@@ -28,6 +30,7 @@ from ..policy.admin import (
     PolicyAdminTokenException,
     compute_token,
 )
+from ..policy.utils import PolicyCache
 
 # Disable warnings that conflict with Pytest's use of fixtures.
 # pylint: disable=redefined-outer-name
@@ -207,3 +210,64 @@ def test_api_get_files(policy_dir, api):
         PolicyAdminException, match="contains invalid characters"
     ):
         api.handle_request("policy.GetFiles", "service+param", b"")
+
+
+def test_api_get_files_policy_cache(policy_dir):
+    (policy_dir / "file1.policy").write_text("test.service * @anyvm dom0 deny\n")
+    (policy_dir / "file2.policy").write_text("other.service * dom0 dom0 allow\n")
+    cache = PolicyCache(policy_dir, use_legacy=False)
+    api = PolicyAdmin(policy_dir, policy_cache=cache)
+
+    assert api.handle_request(
+        "policy.GetFiles", "test.service", b"") == b"file1\n"
+    assert api.files_cache == {"test.service": b"file1\n"}
+
+    # the same snapshot until the policy is reloaded
+    (policy_dir / "file2.policy").write_text("test.service * dom0 dom0 allow\n")
+    assert api.handle_request(
+        "policy.GetFiles", "test.service", b"") == b"file1\n"
+    cache.outdated = True
+    assert api.handle_request(
+        "policy.GetFiles", "test.service", b"") == b"file1\nfile2\n"
+
+
+def test_api_method_table():
+    table = PolicyAdmin._method_table()  # pylint: disable=protected-access
+    assert table is PolicyAdmin._method_table()  # pylint: disable=protected-access
+    assert table["policy.GetFiles"] == "policy_get_files"
+    assert table["policy.include.Remove"] == "policy_include_remove"
+    assert PolicyAdmin(Path("/nonexistent")).find_method("policy.Nope") is None
+
+
+@pytest.mark.skipif(
+    not os.environ.get("QREXEC_BENCHMARK"), reason="benchmarks not requested"
+)
+def test_api_get_files_benchmark(policy_dir):
+    """policy.GetFiles on a large policy, parsed per call or cached"""
+    for i in range(200):
+        (policy_dir / "file{}.policy".format(i)).write_text(
+            "".join(
+                "test.Service{} +arg{} @tag:t{} @anyvm allow\n".format(i, j, j)
+                for j in range(50)
+            )
+        )
+    count = 20
+    for name, api in (
+        ("parsed per call", PolicyAdmin(policy_dir)),
+        (
+            "parsed policy",
+            PolicyAdmin(
+                policy_dir, policy_cache=PolicyCache(policy_dir, use_legacy=False)
+            ),
+        ),
+    ):
+        start = time.perf_counter()
+        for i in range(count):
+            assert api.handle_request(
+                "policy.GetFiles", "test.Service{}".format(i), b""
+            ) == "file{}\n".format(i).encode()
+        print(
+            "{}: {:.2f} ms per policy.GetFiles".format(
+                name, (time.perf_counter() - start) / count * 1000
+            )
+        )
@@ -0,0 +1,170 @@
+#
+# The Qubes OS Project, https://www.qubes-os.org/
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <https://www.gnu.org/licenses/>.
+#
+
+import asyncio
+import logging
+import os
+import threading
+import time
+
+import pytest
+
+from ..policy.audit import AuditHandler
+
+
+class ListHandler(logging.Handler):
+    def __init__(self, delay=0.0):
+        super().__init__()
+        self.delay = delay
+        self.messages = []
+        self.threads = set()
+
+    def emit(self, record):
+        time.sleep(self.delay)
+        self.threads.add(threading.get_ident())
+        self.messages.append(record.getMessage())
+
+
+def make_logger(name, handler):
+    log = logging.getLogger(name)
+    log.setLevel(logging.INFO)
+    log.propagate = False
+    for old in list(log.handlers):
+        log.removeHandler(old)
+    log.addHandler(handler)
+    return log
+
+
+class TestAuditHandler:
+    def test_00_synchronous(self):
+        target = ListHandler()
+        log = make_logger("audit-test-00", AuditHandler([target]))
+
+        log.info("%s allowed", "a")
+        log.info("%s denied", "b")
+
+        assert target.messages == ["a allowed", "b denied"]
+        assert target.threads == {threading.get_ident()}
+
+    @pytest.mark.asyncio
+    async def test_10_background_batches(self):
+        target = ListHandler()
+        audit = AuditHandler([target])
+        log = make_logger("audit-test-10", audit)
+        audit.start()
+
+        for i in range(100):
+            log.info("call %d allowed", i)
+        # nothing is written from the event loop
+        assert target.messages == []
+        await audit.stop()
+
+        assert target.messages == ["call {} allowed".format(i) for i in range(100)]
+        assert threading.get_ident() not in target.threads
+        assert audit.dropped == 0
+
+    @pytest.mark.asyncio
+    async def test_20_repeats_summarized(self):
+        target = ListHandler()
+        audit = AuditHandler([target], burst=3)
+        log = make_logger("audit-test-20", audit)
+        audit.start()
+
+        for _ in range(10):
+            log.info("a -> b denied")
+        log.info("c -> d allowed")
+        log.warning("a -> b denied")
+        await audit.stop()
+
+        assert target.messages == [
+            "a -> b denied",
+            "a -> b denied",
+            "a -> b denied",
+            "c -> d allowed",
+            "a -> b denied",
+            "a -> b denied [7 more times in 0 s]",
+        ]
+        assert audit.suppressed == 7
+
+    def test_21_repeats_new_interval(self):
+        target = ListHandler()
+        audit = AuditHandler([target], burst=1, interval=0.1)
+        log = make_logger("audit-test-21", audit)
+
+        for _ in range(3):
+            log.info("a -> b denied")
+        time.sleep(0.2)
+        log.info("a -> b denied")
+
+        assert target.messages == [
+            "a -> b denied",
+            "a -> b denied [2 more times in 0 s]",
+            "a -> b denied",
+        ]
+
+    @pytest.mark.asyncio
+    async def test_30_dropped(self):
+        target = ListHandler()
+        audit = AuditHandler([target], queue_size=5)
+        log = make_logger("audit-test-30", audit)
+        audit.start()
+
+        # the writer task does not get to run in between
+        for i in range(8):
+            log.info("call %d allowed", i)
+        assert audit.dropped == 3
+        await audit.stop()
+
+        assert target.messages == [
+            "call 0 allowed",
+            "call 1 allowed",
+            "call 2 allowed",
+            "call 3 allowed",
+            "call 4 allowed",
+            "3 log records dropped, the log is too slow (3 in total)",
+        ]
+
+
+@pytest.mark.skipif(
+    not os.environ.get("QREXEC_BENCHMARK"), reason="benchmarks not requested"
+)
+@pytest.mark.asyncio
+async def test_90_slow_log_benchmark():
+    """Time spent logging in the event loop, with a log taking 1 ms per
+    record"""
+    count = 1000
+    for name, audit in (("synchronous", None), ("queued", AuditHandler([]))):
+        target = ListHandler(delay=0.001)
+        if audit is None:
+            log = make_logger("audit-bench-" + name, target)
+        else:
+            audit.handlers = [target]
+            log = make_logger("audit-bench-" + name, audit)
+            audit.start()
+        start = time.perf_counter()
+        for i in range(count):
+            log.info("call %d allowed", i)
+            await asyncio.sleep(0)
+        elapsed = time.perf_counter() - start
+        if audit is not None:
+            await audit.stop()
+        assert len(target.messages) == count
+        print(
+            "{}: {:.1f} us per decision in the event loop".format(
+                name, elapsed / count * 1e6
+            )
+        )
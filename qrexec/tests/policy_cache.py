@@ -20,6 +20,9 @@
 
 import os
 import asyncio
+import subprocess
+import sys
+import time
 import pytest
 import unittest
 import unittest.mock
@@ -159,3 +162,56 @@ class TestPolicyCache:
         call = unittest.mock.call(policy_path=tmp_path)
 
         assert mock_parser.mock_calls == [call, call]
+
+    def test_30_one_shot_imports(self):
+        # qrexec-policy-exec is started for a single request when
+        # qrexec-policy-daemon is not running, keep what it imports small
+        modules = ("pyinotify", "qrexec.server")
+        output = subprocess.check_output(
+            [
+                sys.executable,
+                "-c",
+                "import sys, qrexec.tools.qrexec_policy_exec; "
+                "print(' '.join(m for m in {!r} if m in sys.modules))".format(
+                    modules
+                ),
+            ],
+            cwd=os.path.dirname(os.path.dirname(os.path.dirname(__file__))),
+        )
+        assert output.decode().split() == []
+
+
+@pytest.mark.skipif(
+    not os.environ.get("QREXEC_BENCHMARK"), reason="benchmarks not requested"
+)
+def test_90_policy_exec_startup_benchmark(tmp_path):
+    root = os.path.dirname(os.path.dirname(os.path.dirname(__file__)))
+    imports = []
+    for _ in range(10):
+        start = time.perf_counter()
+        subprocess.check_call(
+            [sys.executable, "-c", "import qrexec.tools.qrexec_policy_exec"],
+            cwd=root,
+        )
+        imports.append(time.perf_counter() - start)
+
+    # 50 files of 20 rules, a rather large policy
+    for i in range(50):
+        (tmp_path / "{:02}-test.policy".format(i)).write_text(
+            "".join(
+                "test.Service{} +arg{} @tag:tag{} @anyvm ask\n".format(i, j, j)
+                for j in range(20)
+            )
+        )
+    parses = []
+    for _ in range(10):
+        start = time.perf_counter()
+        utils.PolicyCache(tmp_path, use_legacy=False)
+        parses.append(time.perf_counter() - start)
+
+    print(
+        "\nqrexec-policy-exec startup: interpreter and imports {:.1f} ms, "
+        "parsing 1000 rules {:.1f} ms".format(
+            min(imports) * 1000, min(parses) * 1000
+        )
+    )
@@ -19,9 +19,12 @@
 # You should have received a copy of the GNU Lesser General Public
 # License along with this library; if not, see <https://www.gnu.org/licenses/>.
 
+import copy
 import functools
+import os
 import socket
 import subprocess
+import time
 import unittest.mock
 import asyncio
 import pytest
@@ -1896,6 +1899,241 @@ autostart=True
 requested_target=test-vm2\
 """)
 
+    def test_200_rule_stats(self):
+        policy = parser.StringPolicy(
+            policy="""\
+            * * test-vm1 test-vm2 allow
+            * * test-vm1 @default allow target=test-vm2
+            * * test-vm2 @anyvm ask
+            * * test-vm3 @anyvm deny"""
+        )
+        policy.collect_stats = True
+        policy.evaluate(_req("test-vm1", "test-vm2"))
+        policy.evaluate(_req("test-vm1", "test-vm2"))
+        policy.evaluate(_req("test-vm1", "@default"))
+        with self.assertRaises(exc.AccessDenied):
+            policy.evaluate(_req("test-vm3", "test-vm1"))
+        with self.assertRaises(exc.AccessDenied):
+            policy.evaluate(_req("test-standalone", "test-vm1"))
+
+        self.assertEqual(
+            [rule.matches for rule in policy.rules], [2, 1, 0, 1]
+        )
+        self.assertEqual(policy.unmatched, 1)
+        self.assertEqual(
+            policy.get_rule_stats(),
+            [
+                (policy.rules[0], 5),
+                (policy.rules[1], 3),
+                (policy.rules[2], 2),
+                (policy.rules[3], 2),
+            ],
+        )
+        self.assertGreater(policy.rules[0].match_time_ns, 0)
+        self.assertEqual(policy.rules[2].match_time_ns, 0)
+
+    def test_201_rule_stats_disabled(self):
+        self.policy.evaluate(_req("test-vm1", "test-vm2"))
+        with self.assertRaises(exc.AccessDenied):
+            self.policy.evaluate(_req("test-vm3", "test-vm1"))
+
+        self.assertEqual([rule.matches for rule in self.policy.rules], [0] * 6)
+        self.assertEqual(self.policy.unmatched, 0)
+
+
+    def test_210_shadowed_rules(self):
+        policy = parser.StringPolicy(
+            policy={
+                "__main__": """\
+                * * @anyvm @adminvm deny
+                !include inc
+                test.Service * test-vm1 test-vm2 allow
+                test.Service * @tag:tag1 @anyvm ask
+                test.Service +arg @tag:tag1 test-vm2 ask
+                * * test-vm1 dom0 deny
+                test.Service * test-vm1 test-vm2 allow autostart=no
+                test.Service * test-vm1 @dispvm allow
+                * * @anyvm @anyvm deny
+                test.Other * test-vm1 test-vm2 allow""",
+                "inc": "test.Service * test-vm1 test-vm2 allow",
+            }
+        )
+
+        shadowed = [
+            (
+                item.rule.filepath.name,
+                item.rule.lineno,
+                item.shadowed_by.filepath.name,
+                item.shadowed_by.lineno,
+                item.duplicate,
+            )
+            for item in policy.find_shadowed_rules()
+        ]
+        self.assertEqual(
+            shadowed,
+            [
+                ("__main__[in-memory]", 3, "inc[in-memory]", 1, True),
+                ("__main__[in-memory]", 5, "__main__[in-memory]", 4, False),
+                ("__main__[in-memory]", 6, "__main__[in-memory]", 1, False),
+                ("__main__[in-memory]", 7, "inc[in-memory]", 1, False),
+                ("__main__[in-memory]", 10, "__main__[in-memory]", 9, False),
+            ],
+        )
+
+    def test_211_compact(self):
+        policy = parser.StringPolicy(
+            policy="""\
+            * * test-vm1 test-vm2 allow
+            * * test-vm1 @default allow target=test-vm2
+            * * @tag:tag1 @anyvm ask
+            * * @tag:tag1 test-vm3 ask default_target=test-vm3
+            * * @tag:tag2 @anyvm allow
+            * * test-vm3 test-vm2 deny
+            * * test-vm1 test-vm2 deny"""
+        )
+        requests = [
+            _req(source, target)
+            for source in ("test-vm1", "test-vm2", "test-vm3", "test-standalone")
+            for target in ("test-vm1", "test-vm2", "test-vm3", "@default")
+        ]
+        expected = []
+        for request in requests:
+            try:
+                expected.append(policy.find_matching_rule(request))
+            except exc.AccessDenied:
+                expected.append(None)
+        targets_for_ask = policy.collect_targets_for_ask(
+            _req("test-vm3", "@default")
+        )
+
+        shadowed = policy.compact()
+
+        self.assertEqual(
+            [item.rule for item in shadowed],
+            [policy.rules[3], policy.rules[6]],
+        )
+        self.assertEqual(len(policy.rules), 7)
+        self.assertEqual(len(policy.match_rules), 5)
+        for request, rule in zip(requests, expected):
+            if rule is None:
+                with self.assertRaises(exc.AccessDenied):
+                    policy.find_matching_rule(request)
+            else:
+                self.assertIs(policy.find_matching_rule(request), rule)
+        # shadowed rules still count for the targets to ask about
+        self.assertEqual(
+            policy.collect_targets_for_ask(_req("test-vm3", "@default")),
+            targets_for_ask,
+        )
+
+
+    def test_220_ask_targets_cache(self):
+        system_info = copy.deepcopy(SYSTEM_INFO)
+        request = functools.partial(
+            parser.Request,
+            "test.Service",
+            "+argument",
+            system_info=system_info,
+        )
+        targets = self.policy.collect_targets_for_ask(
+            request("test-vm1", "test-vm3")
+        )
+        self.assertIn("test-vm3", targets)
+        with unittest.mock.patch.object(
+            self.policy,
+            "compute_targets_for_ask",
+            side_effect=self.policy.compute_targets_for_ask,
+        ) as compute:
+            # same (service, argument, source), other target
+            self.policy.collect_targets_for_ask(request("test-vm1", "test-vm2"))
+            compute.assert_not_called()
+            self.policy.collect_targets_for_ask(request("test-vm2", "test-vm3"))
+            self.assertEqual(compute.call_count, 1)
+
+            # another system info object invalidates the cache
+            system_info = copy.deepcopy(system_info)
+            system_info["domains"]["test-vm1"]["tags"] = []
+            request = functools.partial(
+                parser.Request,
+                "test.Service",
+                "+argument",
+                system_info=system_info,
+            )
+            self.assertEqual(
+                self.policy.collect_targets_for_ask(
+                    request("test-vm1", "test-vm3")
+                ),
+                {"test-vm2"},
+            )
+            self.assertEqual(compute.call_count, 2)
+
+    def test_221_ask_targets_cache_size(self):
+        self.policy.ask_targets_cache_size = 2
+        for argument in ("+a", "+b", "+c"):
+            self.policy.collect_targets_for_ask(
+                parser.Request(
+                    "test.Service",
+                    argument,
+                    "test-vm1",
+                    "test-vm2",
+                    system_info=SYSTEM_INFO,
+                )
+            )
+            self.assertLessEqual(len(self.policy.ask_targets_cache), 2)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_290_ask_benchmark(self):
+        domains = {
+            "dom0": dict(SYSTEM_INFO["domains"]["dom0"]),
+            "default-dvm": dict(SYSTEM_INFO["domains"]["default-dvm"]),
+        }
+        for i in range(300):
+            domains["vm{}".format(i)] = {
+                "tags": ["tag{}".format(i % 10)],
+                "type": "AppVM",
+                "default_dispvm": "default-dvm",
+                "template_for_dispvms": i % 30 == 0,
+                "power_state": "Running",
+            }
+        system_info = {"domains": domains}
+        policy = parser.StringPolicy(
+            policy="\n".join(
+                ["* * @tag:tag{0} @tag:tag{0} allow".format(i) for i in range(10)]
+                + ["* * vm{} @anyvm deny".format(i) for i in range(0, 300, 7)]
+                + ["* * @anyvm @dispvm ask", "* * @anyvm @anyvm ask"]
+            )
+        )
+        requests = [
+            parser.Request(
+                "test.Service",
+                "+argument",
+                "vm{}".format(i),
+                "vm{}".format((i + 1) % 300),
+                system_info=system_info,
+            )
+            for i in range(1, 300, 7)
+        ]
+
+        def run():
+            start = time.perf_counter()
+            for _ in range(5):
+                for request in requests:
+                    policy.evaluate(request)
+            return (time.perf_counter() - start) / (5 * len(requests))
+
+        policy.ask_targets_cache_size = 0
+        uncached = run()
+        policy.ask_targets_cache_size = 1024
+        policy.ask_targets_cache.clear()
+        cached = run()
+        print(
+            "\nask evaluation, 300 domains: {:.1f} us uncached, "
+            "{:.1f} us cached".format(uncached * 1e6, cached * 1e6)
+        )
+
+
 # class TC_30_Misc(qubes.tests.QubesTestCase):
 class TC_50_Misc(unittest.TestCase):
     @unittest.mock.patch("socket.socket")
@@ -1967,6 +2205,16 @@ class TC_50_Misc(unittest.TestCase):
         )
 
 
+    def test_010_get_system_info_same_object(self):
+        data = [b'{"domains": {}}', b'{"domains": {}}', b'{"domains": {"a": {}}}']
+        with unittest.mock.patch(
+            "qrexec.utils.qubesd_call", side_effect=data
+        ) as mock_call:
+            first = utils.get_system_info()
+            self.assertIs(utils.get_system_info(), first)
+            self.assertEqual(utils.get_system_info(), {"domains": {"a": {}}})
+        self.assertEqual(mock_call.call_count, 3)
+
 class TC_90_Compat40(unittest.TestCase):
     def test_001_loader(self):
         policy = parser.StringPolicy(
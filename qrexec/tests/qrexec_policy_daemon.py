@@ -29,6 +29,9 @@ import functools
 import unittest
 import unittest.mock
 
+from ..policy import parser
+from ..policy.admin import PolicyAdmin
+from ..policy.utils import PolicyCache
 from ..tools import qrexec_policy_daemon
 
 server_types = [b"Simple", b"GUI"]
@@ -268,6 +271,192 @@ class TestPolicyDaemon:
 
         mock_request.assert_not_called()
 
+    @pytest.mark.asyncio
+    async def test_stats_request(self, mock_request, tmp_path):
+        policy = parser.StringPolicy(
+            policy="""\
+            * * @anyvm dom0 allow
+            * * @anyvm @anyvm deny"""
+        )
+        policy.rules[0].matches = 3
+        policy.rules[0].match_time_ns = 1500
+        policy.unmatched = 1
+        policy_cache = Mock()
+        policy_cache.get_policy.return_value = policy
+        server = await asyncio.start_unix_server(
+            functools.partial(
+                qrexec_policy_daemon.handle_client_connection,
+                log,
+                policy_cache,
+            ),
+            path=str(tmp_path / "socket.d"),
+        )
+
+        s = await self.send_data(server, tmp_path, b"stats=yes\n\n")
+
+        mock_request.assert_not_called()
+        assert s.decode() == (
+            "# file:line\tevaluations\tmatches\tmatch_time_us\trule\n"
+            "__main__[in-memory]:1\t4\t3\t1.5\t* * @anyvm @adminvm allow\n"
+            "__main__[in-memory]:2\t1\t0\t0.0\t* * @anyvm @anyvm deny\n"
+            "-\t1\t1\t0.0\t(no matching rule)\n"
+        )
+
+    @pytest.mark.asyncio
+    async def test_stats_request_with_other_args(
+        self, mock_request, async_server, tmp_path
+    ):
+
+        data = (
+            b"stats=yes\n"
+            b"source=b\n"
+            b"intended_target=c\n"
+            b"service_and_arg=d\n\n"
+        )
+
+        s = await self.send_data(async_server, tmp_path, data)
+
+        assert s == b""
+        mock_request.assert_not_called()
+
+    @asyncio_fixture
+    async def admin_server(self, tmp_path):
+        policy_dir = tmp_path / "policy"
+        policy_dir.mkdir()
+        (policy_dir / "file1.policy").write_text(
+            "test.Service * @anyvm dom0 allow\n"
+        )
+        (policy_dir / "file2.policy").write_text("* * @anyvm @anyvm deny\n")
+        policy_cache = PolicyCache(policy_dir, use_legacy=False)
+        server = await asyncio.start_unix_server(
+            functools.partial(
+                qrexec_policy_daemon.handle_client_connection,
+                log,
+                policy_cache,
+                policy_admin=PolicyAdmin(policy_dir, policy_cache=policy_cache),
+            ),
+            path=str(tmp_path / "socket.d"),
+        )
+
+        yield server
+
+        server.close()
+
+    @pytest.mark.asyncio
+    async def test_admin_request(self, mock_request, admin_server, tmp_path):
+        s = await self.send_data(
+            admin_server,
+            tmp_path,
+            b"admin_method=policy.GetFiles\nadmin_arg=test.Service\n\n",
+        )
+
+        assert s == b"result=ok\nfile1\nfile2\n"
+        mock_request.assert_not_called()
+
+    @pytest.mark.asyncio
+    async def test_admin_request_error(
+        self, mock_request, admin_server, tmp_path
+    ):
+        s = await self.send_data(
+            admin_server,
+            tmp_path,
+            b"admin_method=policy.GetFiles\nadmin_arg=\n\n",
+        )
+
+        assert s == b"result=error\nService cannot be empty."
+        mock_request.assert_not_called()
+
+    @pytest.mark.asyncio
+    async def test_admin_request_not_available(
+        self, mock_request, admin_server, tmp_path
+    ):
+        s = await self.send_data(
+            admin_server,
+            tmp_path,
+            b"admin_method=policy.Remove\nadmin_arg=file1\n\n",
+        )
+
+        assert s.startswith(b"result=error\n")
+        assert (tmp_path / "policy" / "file1.policy").exists()
+        mock_request.assert_not_called()
+
+    @pytest.mark.asyncio
+    async def test_admin_request_with_other_args(
+        self, mock_request, admin_server, tmp_path
+    ):
+        s = await self.send_data(
+            admin_server,
+            tmp_path,
+            b"admin_method=policy.GetFiles\n"
+            b"admin_arg=test.Service\n"
+            b"source=b\n\n",
+        )
+
+        assert s == b""
+        mock_request.assert_not_called()
+
+    @pytest.mark.asyncio
+    async def test_cancellable_request(
+        self, mock_request, async_server, tmp_path
+    ):
+        reader, writer = await asyncio.open_unix_connection(
+            str(tmp_path / "socket.d")
+        )
+        writer.write(
+            b"source=b\n"
+            b"intended_target=c\n"
+            b"service_and_arg=d\n"
+            b"cancellable=yes\n\n"
+        )
+        await writer.drain()
+
+        # the connection stays open while waiting for the answer
+        s = await asyncio.wait_for(reader.read(), timeout=2)
+        writer.close()
+
+        assert s == b"result=deny"
+        mock_request.assert_called_once_with(
+            source="b",
+            intended_target="c",
+            service_and_arg="d",
+            log=unittest.mock.ANY,
+            policy_cache=unittest.mock.ANY,
+        )
+
+    @pytest.mark.asyncio
+    async def test_cancelled_request(
+        self, mock_request, async_server, tmp_path
+    ):
+        started = asyncio.Event()
+        cancelled = asyncio.Event()
+
+        async def slow_request(**_kwargs):
+            started.set()
+            try:
+                await asyncio.sleep(10)
+            except asyncio.CancelledError:
+                cancelled.set()
+                raise
+            return "result=allow"
+
+        mock_request.side_effect = slow_request
+
+        _reader, writer = await asyncio.open_unix_connection(
+            str(tmp_path / "socket.d")
+        )
+        writer.write(
+            b"source=b\n"
+            b"intended_target=c\n"
+            b"service_and_arg=d\n"
+            b"cancellable=yes\n\n"
+        )
+        await writer.drain()
+        await asyncio.wait_for(started.wait(), timeout=2)
+
+        # the caller went away, so the evaluation is abandoned
+        writer.close()
+        await asyncio.wait_for(cancelled.wait(), timeout=2)
+
     @pytest.mark.asyncio
     @pytest.mark.parametrize("server_type", server_types)
     async def test_simple_qrexec_request_succeeds(
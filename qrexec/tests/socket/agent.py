@@ -27,8 +27,11 @@ import shutil
 import struct
 import getpass
 import itertools
+import json
 import asyncio
 import shlex
+import threading
+import time
 
 import psutil
 import pytest
@@ -79,6 +82,9 @@ class TestAgentBase(unittest.TestCase):
 
     def setUp(self):
         self.agent = self.dom0 = None
+        self.agent_args = []
+        # command the agent is started with
+        self.agent_prefix = []
         self.tempdir = tempfile.mkdtemp()
         os.mkdir(os.path.join(self.tempdir, "local-rpc"))
         os.mkdir(os.path.join(self.tempdir, "rpc"))
@@ -106,9 +112,11 @@ class TestAgentBase(unittest.TestCase):
             ROOT_PATH, "lib", "qubes-rpc-multiplexer"
         )
         cmd = [
+            *self.agent_prefix,
             os.path.join(ROOT_PATH, "agent", "qrexec-agent"),
             "--no-fork-server",
             "--agent-socket=" + os.path.join(self.tempdir, "agent.sock"),
+            *self.agent_args,
         ]
         if os.environ.get("USE_STRACE"):
             cmd = ["strace", "-fD"] + cmd
@@ -212,6 +220,24 @@ class TestAgent(TestAgentBase):
             self.assertEqual(f.read(), b"a\n")
         self.check_dom0(dom0)
 
+    def test_just_exec_long_running(self):
+        """The call ends when the command is started, not when it exits"""
+        fifo = os.path.join(self.tempdir, "new_file")
+        os.mkfifo(fifo, mode=0o600)
+        # blocks until the fifo is opened for writing
+        cmd = ("read x < " + shlex.quote(fifo)).encode("ascii", "strict")
+        target, dom0 = self._test_just_exec(cmd)
+        self.assertListEqual(
+            target.recv_all_messages(),
+            [
+                (qrexec.MSG_DATA_EXIT_CODE, b"\0\0\0\0"),
+            ],
+        )
+        dom0.conn.settimeout(10)
+        self.check_dom0(dom0)
+        with open(fifo, "wb") as f:
+            f.write(b"\n")
+
     def test_just_exec_rpc(self):
         fifo = os.path.join(self.tempdir, "new_file")
         os.mkfifo(fifo, mode=0o600)
@@ -294,6 +320,255 @@ printf %s\\n "$QREXEC_SERVICE_FULL_NAME" >> {shlex.quote(fifo)}
         client.close()
         self.check_dom0(dom0)
 
+    def trigger_burst(self, dom0, count):
+        # qrexec-agent reads each request as soon as it accepts the
+        # connection, so send it right after connecting
+        clients = []
+        sent = []
+        for i in range(count):
+            client = self.connect_client()
+            clients.append(client)
+            client.send_message(
+                qrexec.MSG_TRIGGER_SERVICE3,
+                struct.pack("<64s32s", b"target_domain", b"SOCKET")
+                + b"qubes.ServiceName+%d\0" % i,
+            )
+            sent.append(time.perf_counter())
+
+        received = {}
+        for _ in range(count):
+            message_type, target_params = dom0.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_TRIGGER_SERVICE3)
+            ident = target_params[64:96]
+            service_name = target_params[96:-1]
+            self.assertTrue(service_name.startswith(b"qubes.ServiceName+"))
+            received[int(service_name[18:])] = (time.perf_counter(), ident)
+        self.assertEqual(len(received), count)
+
+        for _, ident in received.values():
+            dom0.send_message(qrexec.MSG_SERVICE_REFUSED, ident)
+        for client in clients:
+            self.assertEqual(client.recvall(1), b"")
+        return [received[i][0] - sent[i] for i in range(count)]
+
+    def test_trigger_service_burst(self):
+        self.start_agent()
+        dom0 = self.connect_dom0()
+        # more than fits in the control vchan ring at once
+        self.trigger_burst(dom0, 100)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_trigger_service_burst_latency(self):
+        self.start_agent()
+        dom0 = self.connect_dom0()
+        start = time.perf_counter()
+        timings = sorted(self.trigger_burst(dom0, 500))
+        total = time.perf_counter() - start
+        print(
+            "\n500 simultaneous triggers: p50 {:.2f}ms p99 {:.2f}ms "
+            "max {:.2f}ms, all refused after {:.2f}ms".format(
+                timings[250] * 1000,
+                timings[494] * 1000,
+                timings[-1] * 1000,
+                total * 1000,
+            )
+        )
+
+    def test_trigger_service_larger_than_ring(self):
+        self.start_agent()
+        dom0 = self.connect_dom0()
+        client = self.connect_client()
+        # does not fit in the control vchan ring at all
+        ident = self.trigger_service(
+            dom0, client, b"target_domain", b"qubes.ServiceName+" + b"a" * 20000
+        )
+        dom0.send_message(qrexec.MSG_SERVICE_REFUSED, struct.pack("<32s", ident))
+        self.assertEqual(client.recvall(1), b"")
+
+    def test_exec_cmdline_larger_than_ring(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser().encode("ascii")
+        arg = b"a" * 20000
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", self.target_domain, self.target_port)
+            + user
+            + b":echo "
+            + arg
+            + b"\0",
+        )
+
+        target = self.connect_target()
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+
+        self.assertExpectedStdout(target, arg + b"\n")
+        self.check_dom0(dom0)
+
+    def test_exec_cmdline_inline_data(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser().encode("ascii")
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", self.target_domain, self.target_port)
+            + user
+            + b":cat\0inline data\n",
+        )
+
+        target = self.connect_target()
+        target.handshake()
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b"more data\n")
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+
+        self.assertExpectedStdout(target, b"inline data\nmore data\n")
+        self.check_dom0(dom0)
+
+    def test_exec_cmdline_inline_data_before_connect(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser().encode("ascii")
+        output = os.path.join(self.tempdir, "output")
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", self.target_domain, self.target_port)
+            + user
+            + b":head -n1 > "
+            + output.encode()
+            + b"\0inline data\n",
+        )
+
+        # the service gets the data before the data vchan is connected
+        def has_data():
+            with open(output, "rb") as f:
+                return f.read() == b"inline data\n"
+
+        util.wait_until(
+            lambda: os.path.exists(output) and has_data(),
+            "service did not get the inline data",
+            n_tries=50,
+        )
+
+        target = self.connect_target()
+        target.handshake()
+        # the service may be done already, so do not send anything
+        self.assertExpectedStdout(target, b"")
+        self.check_dom0(dom0)
+
+    def test_exec_cmdline_waits_for_connect(self):
+        """Without inline data, the service starts only once the client is
+        connected"""
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser().encode("ascii")
+        output = os.path.join(self.tempdir, "output")
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", self.target_domain, self.target_port)
+            + user
+            + b":touch "
+            + output.encode()
+            + b"\0",
+        )
+        time.sleep(0.5)
+        self.assertFalse(os.path.exists(output))
+
+        target = self.connect_target()
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(target, b"")
+        self.assertTrue(os.path.exists(output))
+        self.check_dom0(dom0)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_exec_cmdline_inline_data_latency(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser().encode("ascii")
+        data = b"x" * 199 + b"\n"
+
+        def echo(inline):
+            dom0.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack("<LL", self.target_domain, self.target_port)
+                + user
+                + b":head -n1\0"
+                + (data if inline else b""),
+            )
+            target = self.connect_target()
+            target.handshake()
+            if not inline:
+                target.send_message(qrexec.MSG_DATA_STDIN, data)
+            self.assertEqual(
+                target.recv_message(), (qrexec.MSG_DATA_STDOUT, data)
+            )
+            target.send_message(qrexec.MSG_DATA_STDIN, b"")
+            self.assertExpectedStdout(target, b"")
+            target.close()
+            self.check_dom0(dom0)
+
+        for inline in (False, True):
+            timings = []
+            for _ in range(100):
+                start = time.perf_counter()
+                echo(inline)
+                timings.append(time.perf_counter() - start)
+            timings.sort()
+            print(
+                "200-byte echo ({}): median {:.3f} ms, p90 {:.3f} ms".format(
+                    "inline" if inline else "data vchan",
+                    timings[len(timings) // 2] * 1000,
+                    timings[len(timings) * 9 // 10] * 1000,
+                )
+            )
+
+    def test_trigger_service_inline_data(self):
+        self.start_agent()
+
+        target_domain_name = b"target_domain"
+
+        dom0 = self.connect_dom0()
+
+        client = self.connect_client()
+        ident = self.trigger_service(
+            dom0, client, target_domain_name, b"qubes.ServiceName\0data"
+        )
+
+        dom0.send_message(
+            qrexec.MSG_SERVICE_CONNECT,
+            struct.pack("<LL32s", self.target_domain, self.target_port, ident),
+        )
+
+        # connection parameters, followed by the inline data acknowledgement
+        data = client.recvall(12)
+        self.assertEqual(
+            struct.unpack("<LLL", data),
+            (self.target_domain, self.target_port, 1),
+        )
+
+        client.close()
+        self.check_dom0(dom0)
+
     def test_trigger_service_refused(self):
         self.start_agent()
 
@@ -314,6 +589,32 @@ printf %s\\n "$QREXEC_SERVICE_FULL_NAME" >> {shlex.quote(fifo)}
         data = client.recvall(8)
         self.assertEqual(data, b"")
 
+    def test_trigger_service_cancel(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+
+        client = self.connect_client()
+        ident = self.trigger_service(
+            dom0, client, b"target_domain", b"qubes.ServiceName"
+        )
+
+        # the caller gives up before the call is connected
+        client.close()
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_SERVICE_CANCEL, struct.pack("<32s", ident)),
+        )
+
+        # the request is released only when dom0 answers
+        dom0.send_message(
+            qrexec.MSG_SERVICE_REFUSED, struct.pack("<32s", ident)
+        )
+        client = self.connect_client()
+        self.trigger_service(
+            dom0, client, b"target_domain", b"qubes.ServiceName"
+        )
+
     def trigger_service(self, dom0, client, target_domain_name, service_name):
         source_params = (
             struct.pack("<64s32s", target_domain_name, b"SOCKET")
@@ -396,6 +697,33 @@ echo "arg: $1, remote domain: $QREXEC_REMOTE_DOMAIN"
         self.assertExpectedStdout(target, b"arg: arg, remote domain: domX\n")
         self.check_dom0(dom0)
 
+    def test_exec_service_usage_log(self):
+        usage_log = os.path.join(self.tempdir, "usage.log")
+        self.agent_args.append("--usage-log=" + usage_log)
+        util.make_executable_service(
+            self.tempdir,
+            "rpc",
+            "qubes.Service",
+            """\
+#!/bin/sh
+head -c 1000000 /dev/zero | wc -c
+exit 3
+""",
+        )
+        target, dom0 = self.execute_qubesrpc("qubes.Service+arg", "domX")
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(target, b"1000000\n", exit_code=3)
+        # the call is accounted before the end of its connection is reported
+        self.check_dom0(dom0)
+        with open(usage_log) as f:
+            records = [json.loads(line) for line in f]
+        self.assertEqual(len(records), 1)
+        self.assertEqual(records[0]["service"], "qubes.Service")
+        self.assertEqual(records[0]["source"], "domX")
+        self.assertEqual(records[0]["exit_code"], 3)
+        self.assertGreater(records[0]["wall_us"], 0)
+        self.assertGreater(records[0]["max_rss_kib"], 0)
+
     def test_exec_service_keyword(self):
         util.make_executable_service(
             self.tempdir,
@@ -444,6 +772,259 @@ skip-service-descriptor = true
         self.assertExpectedStdout(target, b"arg: arg, remote domain: domX\n")
         self.check_dom0(dom0)
 
+    def exec_echo_service(self, threaded_io):
+        util.make_executable_service(
+            self.tempdir,
+            "rpc",
+            "qubes.Service",
+            """\
+#!/bin/sh
+exec cat
+""",
+        )
+        if threaded_io:
+            with open(
+                os.path.join(self.tempdir, "rpc-config", "qubes.Service"), "w"
+            ) as f:
+                f.write("threaded-io = true\n")
+        return self.execute_qubesrpc("qubes.Service+arg", "domX")
+
+    def test_exec_service_threaded_io(self):
+        target, dom0 = self.exec_echo_service(threaded_io=True)
+        data = bytes(range(256)) * 1024
+        for i in range(0, len(data), 65536):
+            target.send_message(qrexec.MSG_DATA_STDIN, data[i : i + 65536])
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(target, data)
+        self.check_dom0(dom0)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_exec_service_threaded_io_throughput(self):
+        chunk = b"x" * 65536
+        total = 64 * 1024 * 1024
+        for threaded_io in (False, True):
+            self.agent = self.dom0 = None
+            target, dom0 = self.exec_echo_service(threaded_io)
+
+            def send():
+                for _ in range(total // len(chunk)):
+                    target.send_message(qrexec.MSG_DATA_STDIN, chunk)
+                target.send_message(qrexec.MSG_DATA_STDIN, b"")
+
+            start = time.perf_counter()
+            sender = threading.Thread(target=send)
+            sender.start()
+            received = 0
+            while True:
+                msg_type, data = target.recv_message()
+                if msg_type == qrexec.MSG_DATA_STDOUT and not data:
+                    break
+                received += len(data)
+            sender.join()
+            elapsed = time.perf_counter() - start
+            self.assertEqual(received, total)
+            print(
+                "bidirectional echo ({}): {:.1f} MiB/s each way".format(
+                    "threaded" if threaded_io else "single thread",
+                    total / elapsed / 1024 / 1024,
+                )
+            )
+            target.close()
+            self.stop_agent()
+            os.unlink(os.path.join(self.tempdir, "rpc", "qubes.Service"))
+            config = os.path.join(self.tempdir, "rpc-config", "qubes.Service")
+            if os.path.exists(config):
+                os.unlink(config)
+
+    def test_exec_service_max_instances(self):
+        log = os.path.join(self.tempdir, "started.log")
+        util.make_executable_service(
+            self.tempdir,
+            "rpc",
+            "qubes.Service",
+            """\
+#!/bin/sh
+echo "$1" >>{}
+exec cat
+""".format(
+                log
+            ),
+        )
+        with open(
+            os.path.join(self.tempdir, "rpc-config", "qubes.Service"), "w"
+        ) as f:
+            f.write("max-instances = 1\nmax-queued = 1\n")
+        self.start_agent()
+        dom0 = self.connect_dom0()
+
+        user = getpass.getuser()
+        ports = [self.target_port + i for i in range(3)]
+        for i, port in enumerate(ports):
+            dom0.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack("<LL", self.target_domain, port)
+                + "{}:QUBESRPC qubes.Service+{} domX\0".format(user, i).encode(
+                    "ascii"
+                ),
+            )
+
+        def connect(port):
+            target = qrexec.vchan_server(
+                self.tempdir, self.target_domain, self.domain, port
+            )
+            self.addCleanup(target.close)
+            target.accept()
+            target.handshake()
+            return target
+
+        # one running, one queued, the third one refused
+        refused = connect(ports[2])
+        self.assertExpectedStdout(refused, b"", exit_code=126)
+
+        first = connect(ports[0])
+        first.send_message(qrexec.MSG_DATA_STDIN, b"first\n")
+        self.assertEqual(
+            first.recv_message(), (qrexec.MSG_DATA_STDOUT, b"first\n")
+        )
+        with open(log) as f:
+            self.assertEqual(f.read(), "0\n")
+        first.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(first, b"")
+
+        second = connect(ports[1])
+        second.send_message(qrexec.MSG_DATA_STDIN, b"second\n")
+        second.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(second, b"second\n")
+        with open(log) as f:
+            self.assertEqual(f.read(), "0\n1\n")
+
+        terminated = sorted(dom0.recv_message() for _ in ports)
+        self.assertListEqual(
+            terminated,
+            sorted(
+                (
+                    qrexec.MSG_CONNECTION_TERMINATED,
+                    struct.pack("<LL", self.target_domain, port),
+                )
+                for port in ports
+            ),
+        )
+
+    def start_calls(self, services):
+        """Start calls of the services, return connected targets."""
+        self.start_agent()
+        dom0 = self.connect_dom0()
+        user = getpass.getuser()
+        ports = [self.target_port + i for i in range(len(services))]
+        for port, service in zip(ports, services):
+            dom0.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack("<LL", self.target_domain, port)
+                + "{}:QUBESRPC {} domX\0".format(user, service).encode(
+                    "ascii"
+                ),
+            )
+        targets = []
+        for port in ports:
+            target = qrexec.vchan_server(
+                self.tempdir, self.target_domain, self.domain, port
+            )
+            self.addCleanup(target.close)
+            target.accept()
+            target.handshake()
+            targets.append(target)
+        return targets
+
+    def use_service_cgroup(self):
+        cgroup = os.environ.get("QREXEC_TEST_CGROUP")
+        if not cgroup:
+            self.skipTest("QREXEC_TEST_CGROUP (delegated cgroup v2) not set")
+        os.environ["QREXEC_SERVICE_CGROUP"] = cgroup
+        self.addCleanup(os.environ.pop, "QREXEC_SERVICE_CGROUP")
+        return cgroup
+
+    def test_exec_service_cgroup(self):
+        cgroup = self.use_service_cgroup()
+        util.make_executable_service(
+            self.tempdir,
+            "rpc",
+            "qubes.Service",
+            """\
+#!/bin/sh
+grep ^0:: /proc/self/cgroup
+""",
+        )
+        with open(
+            os.path.join(self.tempdir, "rpc-config", "qubes.Service"), "w"
+        ) as f:
+            f.write("cpu-weight = 42\n")
+        (target,) = self.start_calls(["qubes.Service+arg"])
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        messages = util.sort_messages(target.recv_all_messages())
+        self.assertEqual(messages[0][0], qrexec.MSG_DATA_STDOUT)
+        self.assertTrue(messages[0][1].endswith(b"/qubes.Service\n"))
+        with open(os.path.join(cgroup, "qubes.Service", "cpu.weight")) as f:
+            self.assertEqual(f.read(), "42\n")
+
+    def test_exec_service_dot_dot_name(self):
+        """
+        ".." is not a valid service name, even with a cgroup configured
+        """
+        os.environ["QREXEC_SERVICE_CGROUP"] = self.tempdir
+        self.addCleanup(os.environ.pop, "QREXEC_SERVICE_CGROUP")
+        target, dom0 = self.execute_qubesrpc("..+arg", "domX")
+        messages = target.recv_all_messages()
+        self.assertListEqual(
+            util.sort_messages(messages),
+            [
+                (qrexec.MSG_DATA_STDOUT, b""),
+                (qrexec.MSG_DATA_STDERR, b""),
+                (qrexec.MSG_DATA_EXIT_CODE,
+                 struct.pack("<L", qrexec.QREXEC_EXIT_PROBLEM)),
+            ],
+        )
+        self.check_dom0(dom0)
+
+    def test_exec_service_cpu_weight(self):
+        self.use_service_cgroup()
+        for service, weight in (("qubes.Heavy", 1000), ("qubes.Light", 100)):
+            # count loop iterations in 2s, on a single CPU shared by both
+            util.make_executable_service(
+                self.tempdir,
+                "rpc",
+                service,
+                """\
+#!/bin/sh
+exec taskset -c 0 {} -c '
+import time
+end = time.monotonic() + 2
+n = 0
+while time.monotonic() < end:
+    n += 1
+print(n)
+'
+""".format(
+                    sys.executable
+                ),
+            )
+            with open(
+                os.path.join(self.tempdir, "rpc-config", service), "w"
+            ) as f:
+                f.write("cpu-weight = {}\n".format(weight))
+        targets = self.start_calls(["qubes.Heavy", "qubes.Light"])
+        counts = []
+        for target in targets:
+            target.send_message(qrexec.MSG_DATA_STDIN, b"")
+            messages = util.sort_messages(target.recv_all_messages())
+            counts.append(int(messages[0][1]))
+        self.assertGreater(
+            counts[0],
+            counts[1] * 3,
+            "iterations with cpu.weight 1000 vs 100: {} vs {}".format(*counts),
+        )
+
     def test_wait_for_session(self):
         self._test_wait_for_session("qubes.Service+arg")
     def test_wait_for_session_huge_path(self):
@@ -892,6 +1473,17 @@ skip-service-descriptor = true
             b"stdout data",
         )
 
+    def test_connect_socket_tcp_ipv6_in_symlink(self):
+        """A numeric address in the symlink is used without resolving it,
+        whatever addresses the host has configured"""
+        socket_path = os.path.join(
+            self.tempdir, "rpc", "qubes.SocketService"
+        )
+        port = 65531
+        host = "::1"
+        os.symlink(f"/dev/tcp/{host}/{port}", socket_path)
+        self._test_tcp(socket.AF_INET6, "qubes.SocketService", host, port)
+
     def _test_connect_socket_tcp_unexpected_host(self, host):
         socket_path = os.path.join(
             self.tempdir, "rpc", "qubes.SocketService"
@@ -989,6 +1581,396 @@ skip-service-descriptor = true
     def test_connect_socket_tcp_empty_host(self):
         self._test_connect_socket_tcp_unexpected_host("")
 
+    def blackholed_tcp_listener(self, family, host, port=0):
+        """A listener that never completes a connection: its accept queue
+        is full, so further connection attempts time out"""
+        server = socket.socket(family, socket.SOCK_STREAM)
+        self.addCleanup(server.close)
+        server.bind((host, port))
+        server.listen(0)
+        address = server.getsockname()
+        for _ in range(2):
+            filler = socket.socket(family, socket.SOCK_STREAM)
+            self.addCleanup(filler.close)
+            filler.setblocking(False)
+            filler.connect_ex(address)
+        return address[1]
+
+    def test_connect_socket_tcp_connect_timeout(self):
+        port = self.blackholed_tcp_listener(socket.AF_INET, "127.0.0.1")
+        os.symlink(
+            f"/dev/tcp/127.0.0.1/{port}",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        with open(
+            os.path.join(self.tempdir, "rpc-config", "qubes.SocketService"),
+            "w",
+        ) as f:
+            f.write("connect-timeout = 1\n")
+        start = time.monotonic()
+        target, dom0 = self.execute_qubesrpc("qubes.SocketService", "domX")
+        self.assertListEqual(
+            target.recv_all_messages(),
+            [
+                (qrexec.MSG_DATA_STDOUT, b""),
+                (qrexec.MSG_DATA_STDERR, b""),
+                (qrexec.MSG_DATA_EXIT_CODE, b"\175\0\0\0"),
+            ],
+        )
+        self.assertLess(time.monotonic() - start, 10)
+        self.check_dom0(dom0)
+
+    def override_hosts(self, hosts):
+        """Run the agent in its own mount namespace, with /etc/hosts
+        replaced by hosts, a list of (address, name)"""
+        path = os.path.join(self.tempdir, "hosts")
+        with open(path, "w") as f:
+            for address, name in hosts:
+                f.write(f"{address} {name}\n")
+        self.agent_prefix = [
+            "unshare",
+            "--mount",
+            *([] if os.geteuid() == 0 else ["--map-root-user"]),
+            "sh",
+            "-c",
+            'mount --bind "$0" /etc/hosts && exec "$@"',
+            path,
+        ]
+        if subprocess.run(
+            [*self.agent_prefix, "true"], stderr=subprocess.DEVNULL
+        ).returncode != 0:
+            self.skipTest("cannot replace /etc/hosts in a mount namespace")
+
+    def test_connect_socket_tcp_parallel(self):
+        """The first address of the host is blackholed, the connection is
+        made to the next one"""
+        self.override_hosts(
+            [("127.0.0.1", "qrexec-test-host"), ("127.0.0.2", "qrexec-test-host")]
+        )
+        port = self.blackholed_tcp_listener(socket.AF_INET, "127.0.0.1")
+        os.symlink(
+            f"/dev/tcp/qrexec-test-host/{port}",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        start = time.monotonic()
+        # without a connect-timeout, the blackholed address alone would take
+        # the whole kernel timeout
+        self._test_tcp(socket.AF_INET, "qubes.SocketService", "127.0.0.2", port)
+        self.assertLess(time.monotonic() - start, 30)
+
+    def tcp_echo_server(self, host="127.0.0.1"):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind((host, 0))
+        server.listen(128)
+
+        def echo(conn):
+            with conn:
+                while True:
+                    data = conn.recv(65536)
+                    if not data:
+                        break
+                    conn.sendall(data)
+
+        def serve():
+            while True:
+                try:
+                    conn, _addr = server.accept()
+                except OSError:
+                    return
+                threading.Thread(target=echo, args=(conn,), daemon=True).start()
+
+        thread = threading.Thread(target=serve, daemon=True)
+        thread.start()
+
+        def stop():
+            server.shutdown(socket.SHUT_RDWR)
+            server.close()
+            thread.join()
+
+        self.addCleanup(stop)
+        return server.getsockname()[1]
+
+    def tcp_mux_echo(self, target, reader, conn_id, message):
+        """Open a connection, echo message over it and wait for its end"""
+        target.send_message(
+            qrexec.MSG_DATA_STDIN,
+            qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, conn_id)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_DATA, conn_id, message)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_EOF, conn_id),
+        )
+        received = b""
+        while True:
+            frame_type, frame_id, data = reader.recv_frame()
+            self.assertEqual(frame_id, conn_id)
+            if frame_type == qrexec.TCP_MUX_EOF:
+                return received
+            self.assertEqual(frame_type, qrexec.TCP_MUX_DATA)
+            received += data
+
+    def test_connect_socket_tcp_mux(self):
+        port = self.tcp_echo_server()
+        os.symlink(
+            f"/dev/tcp-mux/127.0.0.1/{port}",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        target, dom0 = self.execute_qubesrpc("qubes.SocketService", "domX")
+        reader = qrexec.TcpMuxReader(target)
+
+        # interleaved connections
+        target.send_message(
+            qrexec.MSG_DATA_STDIN,
+            qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, 1)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, 2)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_DATA, 2, b"second")
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_DATA, 1, b"first")
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_EOF, 1)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_EOF, 2),
+        )
+        received = {1: b"", 2: b""}
+        finished = set()
+        while finished != {1, 2}:
+            frame_type, conn_id, data = reader.recv_frame()
+            self.assertNotIn(conn_id, finished)
+            if frame_type == qrexec.TCP_MUX_EOF:
+                finished.add(conn_id)
+            else:
+                self.assertEqual(frame_type, qrexec.TCP_MUX_DATA)
+                received[conn_id] += data
+        self.assertEqual(received, {1: b"first", 2: b"second"})
+
+        # more than a window of data
+        message = os.urandom(1024 * 1024)
+        target.send_message(
+            qrexec.MSG_DATA_STDIN, qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, 3)
+        )
+        received = b""
+        sent = 0
+        credit = 256 * 1024
+        while len(received) < len(message):
+            while sent < len(message) and credit:
+                # a frame, header included, must fit in one qrexec message
+                chunk = message[sent : sent + min(credit, 65536 - 12)]
+                target.send_message(
+                    qrexec.MSG_DATA_STDIN,
+                    qrexec.tcp_mux_frame(qrexec.TCP_MUX_DATA, 3, chunk),
+                )
+                sent += len(chunk)
+                credit -= len(chunk)
+            frame_type, conn_id, data = reader.recv_frame()
+            self.assertEqual(conn_id, 3)
+            if frame_type == qrexec.TCP_MUX_CREDIT:
+                credit += struct.unpack("<L", data)[0]
+            else:
+                self.assertEqual(frame_type, qrexec.TCP_MUX_DATA)
+                received += data
+                # the service stops reading the echo without credit
+                target.send_message(
+                    qrexec.MSG_DATA_STDIN,
+                    qrexec.tcp_mux_frame(
+                        qrexec.TCP_MUX_CREDIT, 3, struct.pack("<L", len(data))
+                    ),
+                )
+        self.assertEqual(received, message)
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(reader, b"")
+        self.check_dom0(dom0)
+
+    def test_connect_socket_tcp_mux_stream_eof(self):
+        """Data still queued for a connection when the stream ends is
+        written out, and the connection is then shut down for writing"""
+        # the accept queue is full, so the connection is still being made
+        # when the stream ends
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.addCleanup(server.close)
+        server.bind(("127.0.0.1", 0))
+        server.listen(0)
+        fillers = []
+        for _ in range(2):
+            filler = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.addCleanup(filler.close)
+            filler.setblocking(False)
+            filler.connect_ex(server.getsockname())
+            fillers.append(filler.getsockname())
+        server.settimeout(10)
+        received = []
+
+        def sink():
+            time.sleep(0.5)
+            while True:
+                try:
+                    conn, addr = server.accept()
+                except OSError:
+                    return
+                if addr not in fillers:
+                    break
+                conn.close()
+            with conn:
+                data = b""
+                while True:
+                    chunk = conn.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+                received.append(data)
+
+        thread = threading.Thread(target=sink, daemon=True)
+        thread.start()
+        os.symlink(
+            f"/dev/tcp-mux/127.0.0.1/{server.getsockname()[1]}",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        target, dom0 = self.execute_qubesrpc("qubes.SocketService", "domX")
+        message = os.urandom(256 * 1024)
+        target.send_message(
+            qrexec.MSG_DATA_STDIN, qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, 1)
+        )
+        for start in range(0, len(message), 65536 - 12):
+            target.send_message(
+                qrexec.MSG_DATA_STDIN,
+                qrexec.tcp_mux_frame(
+                    qrexec.TCP_MUX_DATA, 1, message[start : start + 65536 - 12]
+                ),
+            )
+        # no EOF frame, the stream just ends
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        thread.join(15)
+        self.assertEqual([len(data) for data in received], [len(message)])
+        self.assertTrue(received[0] == message, "data differs")
+
+        messages = util.sort_messages(target.recv_all_messages())
+        self.assertListEqual(
+            messages[-3:],
+            [
+                (qrexec.MSG_DATA_STDOUT, b""),
+                (qrexec.MSG_DATA_STDERR, b""),
+                (qrexec.MSG_DATA_EXIT_CODE, struct.pack("<L", 0)),
+            ],
+        )
+        stdout = b"".join(data for _msg_type, data in messages[:-3])
+        # nothing but credit for the data written so far
+        while stdout:
+            frame_type, conn_id, length = struct.unpack("<LLL", stdout[:12])
+            self.assertEqual((frame_type, conn_id), (qrexec.TCP_MUX_CREDIT, 1))
+            stdout = stdout[12 + length :]
+        self.check_dom0(dom0)
+
+    def test_connect_socket_tcp_mux_refused(self):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as unused:
+            unused.bind(("127.0.0.1", 0))
+            port = unused.getsockname()[1]
+        os.symlink(
+            "/dev/tcp-mux/127.0.0.1",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        target, dom0 = self.execute_qubesrpc(
+            f"qubes.SocketService+{port}", "domX"
+        )
+        reader = qrexec.TcpMuxReader(target)
+        target.send_message(
+            qrexec.MSG_DATA_STDIN,
+            qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, 7)
+            + qrexec.tcp_mux_frame(qrexec.TCP_MUX_DATA, 7, b"ignored"),
+        )
+        self.assertEqual(reader.recv_frame(), (qrexec.TCP_MUX_CLOSE, 7, b""))
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(reader, b"")
+        self.check_dom0(dom0)
+
+    def test_connect_socket_tcp_mux_connect_timeout(self):
+        """Connections are made side by side, one that hangs does not hold up
+        the others"""
+        port = self.blackholed_tcp_listener(socket.AF_INET, "127.0.0.1")
+        os.symlink(
+            f"/dev/tcp-mux/127.0.0.1/{port}",
+            os.path.join(self.tempdir, "rpc", "qubes.SocketService"),
+        )
+        with open(
+            os.path.join(self.tempdir, "rpc-config", "qubes.SocketService"),
+            "w",
+        ) as f:
+            f.write("connect-timeout = 1\n")
+        target, dom0 = self.execute_qubesrpc("qubes.SocketService", "domX")
+        reader = qrexec.TcpMuxReader(target)
+        start = time.monotonic()
+        target.send_message(
+            qrexec.MSG_DATA_STDIN,
+            b"".join(
+                qrexec.tcp_mux_frame(qrexec.TCP_MUX_OPEN, conn_id)
+                for conn_id in range(3)
+            ),
+        )
+        closed = {reader.recv_frame() for _ in range(3)}
+        self.assertEqual(
+            closed,
+            {(qrexec.TCP_MUX_CLOSE, conn_id, b"") for conn_id in range(3)},
+        )
+        # one after another, they would take 3 seconds
+        self.assertLess(time.monotonic() - start, 2.5)
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(reader, b"")
+        self.check_dom0(dom0)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_connect_socket_tcp_mux_latency(self):
+        connections = 200
+        message = b"x" * 100
+        port = self.tcp_echo_server()
+        for name, target in (
+            ("qubes.TCP", f"/dev/tcp/127.0.0.1/{port}"),
+            ("qubes.TCPMux", f"/dev/tcp-mux/127.0.0.1/{port}"),
+        ):
+            os.symlink(target, os.path.join(self.tempdir, "rpc", name))
+        with open(
+            os.path.join(self.tempdir, "rpc-config", "qubes.TCP"), "w"
+        ) as config:
+            config.write("skip-service-descriptor = true\n")
+
+        def report(name, timings, total):
+            timings.sort()
+            print(
+                "{}: {:.0f} connections/s, median {:.3f} ms, p90 {:.3f} ms".format(
+                    name,
+                    connections / total,
+                    timings[len(timings) // 2] * 1000,
+                    timings[len(timings) * 9 // 10] * 1000,
+                )
+            )
+
+        # one qrexec call per connection
+        timings = []
+        start_all = time.perf_counter()
+        for _ in range(connections):
+            start = time.perf_counter()
+            target, _dom0 = self.execute_qubesrpc("qubes.TCP", "domX")
+            target.send_message(qrexec.MSG_DATA_STDIN, message)
+            target.send_message(qrexec.MSG_DATA_STDIN, b"")
+            messages = target.recv_all_messages()
+            timings.append(time.perf_counter() - start)
+            self.assertIn((qrexec.MSG_DATA_STDOUT, message), messages)
+            target.close()
+            self.dom0.recv_message()
+        report("call per connection", timings, time.perf_counter() - start_all)
+
+        # all connections in one call
+        timings = []
+        start_all = time.perf_counter()
+        target, dom0 = self.execute_qubesrpc("qubes.TCPMux", "domX")
+        reader = qrexec.TcpMuxReader(target)
+        for conn_id in range(connections):
+            start = time.perf_counter()
+            self.assertEqual(
+                self.tcp_mux_echo(target, reader, conn_id, message), message
+            )
+            timings.append(time.perf_counter() - start)
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(reader, b"")
+        report("multiplexed", timings, time.perf_counter() - start_all)
+        self.check_dom0(dom0)
+
     def test_connect_socket(self):
         socket_path = os.path.join(
             self.tempdir, "rpc", "qubes.SocketService+arg"
@@ -1012,6 +1994,261 @@ skip-service-descriptor = true
         self.assertExpectedStdout(target, b"stdout data")
         self.check_dom0(dom0)
 
+    def connect_socket_service_accept_fds(self, accept_fds=True):
+        socket_path = os.path.join(
+            self.tempdir, "rpc", "qubes.SocketService+arg"
+        )
+        if accept_fds:
+            with open(
+                os.path.join(
+                    self.tempdir, "rpc-config", "qubes.SocketService"
+                ),
+                "w",
+            ) as f:
+                f.write("accept-fds = true\n")
+        server = qrexec.socket_server(socket_path)
+        self.addCleanup(server.close)
+
+        target, dom0 = self.execute_qubesrpc("qubes.SocketService+arg", "domX")
+
+        server.accept()
+        expected = b"qubes.SocketService+arg domX\0"
+        self.assertEqual(server.recvall(len(expected)), expected)
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        return server, target, dom0
+
+    def test_connect_socket_accept_fds(self):
+        file_path = os.path.join(self.tempdir, "file")
+        file_data = bytes(range(256)) * 1024
+        with open(file_path, "wb") as f:
+            f.write(file_data)
+        server, target, dom0 = self.connect_socket_service_accept_fds()
+
+        server.sendall(b"before")
+        with open(file_path, "rb") as f:
+            socket.send_fds(server.conn, [b"\0"], [f.fileno()])
+        read_fd, write_fd = os.pipe()
+        socket.send_fds(server.conn, [b"\0"], [read_fd])
+        os.close(read_fd)
+        os.write(write_fd, b"pipe data")
+        os.close(write_fd)
+        server.sendall(b"after")
+        server.close()
+        self.assertExpectedStdout(
+            target, b"before" + file_data + b"pipe data" + b"after"
+        )
+        self.check_dom0(dom0)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_connect_socket_accept_fds_throughput(self):
+        file_path = os.path.join(self.tempdir, "file")
+        size = 256 * 1024 * 1024
+        with open(file_path, "wb") as f:
+            f.truncate(size)
+
+        for accept_fds in (False, True):
+            self.agent = self.dom0 = None
+            server, target, dom0 = self.connect_socket_service_accept_fds(
+                accept_fds
+            )
+            start = time.perf_counter()
+
+            def serve():
+                with open(file_path, "rb") as f:
+                    if accept_fds:
+                        socket.send_fds(server.conn, [b"\0"], [f.fileno()])
+                    else:
+                        server.conn.sendfile(f)
+                server.close()
+
+            # the file does not fit in the vchan, read it while it is sent
+            sender = threading.Thread(target=serve)
+            sender.start()
+            received = 0
+            while True:
+                msg_type, data = target.recv_message()
+                if msg_type == qrexec.MSG_DATA_STDOUT and not data:
+                    break
+                received += len(data)
+            elapsed = time.perf_counter() - start
+            sender.join()
+            self.assertEqual(received, size)
+            print(
+                "serving {} MiB file ({}): {:.1f} MiB/s".format(
+                    size // 1024 // 1024,
+                    "passed fd" if accept_fds else "socket",
+                    size / elapsed / 1024 / 1024,
+                )
+            )
+            target.close()
+            self.stop_agent()
+
+    def make_plugin_service(self, name, source):
+        if shutil.which("cc") is None:
+            self.skipTest("no C compiler to build the plugin")
+        source_path = os.path.join(self.tempdir, name + ".c")
+        with open(source_path, "w") as f:
+            f.write(source)
+        subprocess.check_call(
+            [
+                "cc",
+                "-shared",
+                "-fPIC",
+                "-I" + os.path.join(ROOT_PATH, "libqrexec"),
+                "-o",
+                os.path.join(self.tempdir, "rpc", name + ".so"),
+                source_path,
+            ]
+        )
+
+    plugin_source = """\
+#include <libqrexec-utils.h>
+
+const unsigned int qrexec_plugin_abi_version = QREXEC_PLUGIN_ABI_VERSION;
+
+int qrexec_plugin_call(const struct qrexec_plugin_call *call)
+{
+    char line[64];
+
+    if (!fgets(line, sizeof(line), call->stdin_stream))
+        line[0] = 0;
+    fprintf(call->stdout_stream, "arg: %s, remote domain: %s, input: %s",
+            call->arg ? call->arg : "", call->source_domain, line);
+    return 3;
+}
+"""
+
+    def test_exec_plugin_service(self):
+        self.make_plugin_service("qubes.Service", self.plugin_source)
+        target, dom0 = self.execute_qubesrpc("qubes.Service+arg", "domX")
+        target.send_message(qrexec.MSG_DATA_STDIN, b"stdin data\n")
+        target.send_message(qrexec.MSG_DATA_STDIN, b"")
+        self.assertExpectedStdout(
+            target,
+            b"arg: arg, remote domain: domX, input: stdin data\n",
+            exit_code=3,
+        )
+        self.check_dom0(dom0)
+
+    def test_exec_plugin_service_other_user(self):
+        loaded = os.path.join(self.tempdir, "loaded")
+        self.make_plugin_service(
+            "qubes.Service",
+            self.plugin_source
+            + """
+#include <fcntl.h>
+#include <unistd.h>
+
+__attribute__((constructor)) static void loaded(void)
+{
+    close(open("%s", O_WRONLY | O_CREAT, 0644));
+}
+"""
+            % loaded,
+        )
+        self.start_agent()
+        dom0 = self.connect_dom0()
+        other_user = "root" if getpass.getuser() != "root" else "nobody"
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", self.target_domain, self.target_port)
+            + "{}:QUBESRPC qubes.Service+arg domX\0".format(other_user).encode(),
+        )
+        target = self.connect_target()
+        target.handshake()
+        messages = target.recv_all_messages()
+        self.assertListEqual(
+            util.sort_messages(messages),
+            [
+                (qrexec.MSG_DATA_STDOUT, b""),
+                (qrexec.MSG_DATA_STDERR, b""),
+                (qrexec.MSG_DATA_EXIT_CODE, b"\175\0\0\0"),
+            ],
+        )
+        self.assertFalse(os.path.exists(loaded))
+        self.check_dom0(dom0)
+
+    def test_exec_plugin_service_bad_abi(self):
+        self.make_plugin_service(
+            "qubes.Service",
+            "int qrexec_plugin_call(const void *call) { return 0; }\n",
+        )
+        target, dom0 = self.execute_qubesrpc("qubes.Service+arg", "domX")
+        messages = target.recv_all_messages()
+        self.assertListEqual(
+            util.sort_messages(messages),
+            [
+                (qrexec.MSG_DATA_STDOUT, b""),
+                (qrexec.MSG_DATA_STDERR, b""),
+                (qrexec.MSG_DATA_EXIT_CODE, b"\175\0\0\0"),
+            ],
+        )
+        self.check_dom0(dom0)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_trivial_service_latency(self):
+        calls = 200
+        expected = b"arg: arg, remote domain: domX, input: \n"
+
+        def socket_service(server):
+            while True:
+                try:
+                    conn, _addr = server.accept()
+                except OSError:
+                    return
+                with conn:
+                    conn.recv(4096)
+                    conn.sendall(expected)
+
+        def run(service):
+            timings = []
+            for _ in range(calls):
+                start = time.perf_counter()
+                target, _dom0 = self.execute_qubesrpc(service, "domX")
+                target.send_message(qrexec.MSG_DATA_STDIN, b"\n")
+                target.send_message(qrexec.MSG_DATA_STDIN, b"")
+                messages = target.recv_all_messages()
+                timings.append(time.perf_counter() - start)
+                self.assertIn((qrexec.MSG_DATA_STDOUT, expected), messages)
+                target.close()
+                self.dom0.recv_message()
+            timings.sort()
+            print(
+                "{}: median {:.3f} ms, p90 {:.3f} ms".format(
+                    service,
+                    timings[len(timings) // 2] * 1000,
+                    timings[len(timings) * 9 // 10] * 1000,
+                )
+            )
+
+        self.make_executable_service(
+            "rpc",
+            "qubes.Script",
+            """\
+#!/bin/sh
+read input
+echo "arg: $1, remote domain: $QREXEC_REMOTE_DOMAIN, input: $input"
+""",
+        )
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        server.bind(os.path.join(self.tempdir, "rpc", "qubes.Socket"))
+        server.listen(16)
+        server_thread = threading.Thread(target=socket_service, args=(server,))
+        server_thread.start()
+        self.make_plugin_service("qubes.Plugin", self.plugin_source)
+        try:
+            run("qubes.Script+arg")
+            run("qubes.Socket+arg")
+            run("qubes.Plugin+arg")
+        finally:
+            server.shutdown(socket.SHUT_RDWR)
+            server.close()
+            server_thread.join()
+
     def test_service_close_stdout_stderr_early(self):
         self.make_executable_service(
             "rpc",
@@ -1314,7 +2551,15 @@ class TestClientVm(unittest.TestCase):
         self.addCleanup(target_client.close)
         return target_client
 
-    def run_service(self, *, local_program=None, options=None, stdio=subprocess.PIPE):
+    def run_service(
+        self,
+        *,
+        local_program=None,
+        options=None,
+        stdio=subprocess.PIPE,
+        inline_data=b"",
+        inline_data_sent=True,
+    ):
         server = self.connect_server()
 
         args = options or []
@@ -1331,10 +2576,13 @@ class TestClientVm(unittest.TestCase):
         self.assertEqual(
             data,
             struct.pack("<64s32s", self.target_domain_name.encode(), b"SOCKET")
-            + b"qubes.ServiceName\0",
+            + b"qubes.ServiceName\0"
+            + inline_data,
         )
 
         server.sendall(struct.pack("<LL", self.target_domain, self.target_port))
+        if inline_data:
+            server.sendall(struct.pack("<L", inline_data_sent))
 
         target_client = self.connect_target_client()
         target_client.handshake()
@@ -1352,6 +2600,151 @@ class TestClientVm(unittest.TestCase):
         self.client.wait()
         self.assertEqual(self.client.returncode, 42)
 
+    def listen_agent_socket(self):
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.addCleanup(server.close)
+        server.bind(os.path.join(self.tempdir, "agent.sock"))
+        server.listen(16)
+        return server
+
+    def serve_call(self, server, port, *, exit_code=0):
+        """Handle one call from qrexec-client-vm, echoing back its stdin."""
+        conn, _addr = server.accept()
+        with qrexec.QrexecClient(conn) as agent:
+            message_type, _data = agent.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_TRIGGER_SERVICE3)
+            agent.sendall(struct.pack("<LL", self.target_domain, port))
+            with qrexec.vchan_client(
+                self.tempdir, self.domain, self.target_domain, port
+            ) as target_client:
+                target_client.handshake()
+                while True:
+                    message_type, data = target_client.recv_message()
+                    self.assertEqual(message_type, qrexec.MSG_DATA_STDIN)
+                    target_client.send_message(qrexec.MSG_DATA_STDOUT, data)
+                    if not data:
+                        break
+                target_client.send_message(
+                    qrexec.MSG_DATA_EXIT_CODE, struct.pack("<L", exit_code)
+                )
+        return _data
+
+    def test_run_client_batch(self):
+        server = self.listen_agent_socket()
+        input_path = os.path.join(self.tempdir, "input")
+        output_path = os.path.join(self.tempdir, "output")
+        batch_path = os.path.join(self.tempdir, "batch")
+        with open(input_path, "wb") as f:
+            f.write(b"input data\n")
+        with open(batch_path, "w") as f:
+            f.write(
+                "target_domain qubes.ServiceName {} {}\n"
+                "# comment\n"
+                "\n"
+                "$dispvm qubes.Other+arg\n".format(input_path, output_path)
+            )
+
+        self.start_client(["--batch", batch_path])
+        data = self.serve_call(server, self.target_port)
+        self.assertEqual(
+            data,
+            struct.pack("<64s32s", b"target_domain", b"SOCKET")
+            + b"qubes.ServiceName\0",
+        )
+        data = self.serve_call(server, self.target_port + 1, exit_code=3)
+        self.assertEqual(
+            data,
+            struct.pack("<64s32s", b"@dispvm", b"SOCKET")
+            + b"qubes.Other+arg\0",
+        )
+
+        stdout, _stderr = self.client.communicate()
+        self.assertEqual(stdout, b"1 0\n4 3\n")
+        self.assertEqual(self.client.returncode, 1)
+        with open(output_path, "rb") as f:
+            self.assertEqual(f.read(), b"input data\n")
+
+    def test_run_client_batch_bad_line(self):
+        batch_path = os.path.join(self.tempdir, "batch")
+        with open(batch_path, "w") as f:
+            f.write("target_domain\n")
+
+        self.start_client(["--batch", batch_path])
+        stdout, _stderr = self.client.communicate()
+        self.assertEqual(stdout, b"")
+        self.assertEqual(self.client.returncode, 2)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_run_client_batch_benchmark(self):
+        server = self.listen_agent_socket()
+        calls = 1000
+        batch_path = os.path.join(self.tempdir, "batch")
+        with open(batch_path, "w") as f:
+            f.write("target_domain qubes.ServiceName\n" * calls)
+
+        start = time.perf_counter()
+        self.start_client(["--batch", batch_path])
+        for i in range(calls):
+            self.serve_call(server, self.target_port + i)
+        self.client.communicate()
+        batch_time = time.perf_counter() - start
+        self.assertEqual(self.client.returncode, 0)
+
+        start = time.perf_counter()
+        for i in range(calls):
+            self.start_client(["target_domain", "qubes.ServiceName"])
+            self.client.stdin.close()
+            self.serve_call(server, self.target_port + i)
+            self.client.wait()
+            self.client.stdout.close()
+            self.client.stderr.close()
+            self.assertEqual(self.client.returncode, 0)
+        loop_time = time.perf_counter() - start
+
+        print(
+            "{} calls: batch {:.3f} s, loop {:.3f} s".format(
+                calls, batch_time, loop_time
+            )
+        )
+
+    def test_run_client_inline_prefix_data(self):
+        target_client = self.run_service(
+            options=["--prefix-data=prefix"], inline_data=b"prefix"
+        )
+        self.client.stdin.close()
+        # already delivered along with the request, not sent again
+        self.assertEqual(
+            target_client.recv_message(), (qrexec.MSG_DATA_STDIN, b"")
+        )
+        target_client.send_message(qrexec.MSG_DATA_STDOUT, b"")
+        target_client.send_message(
+            qrexec.MSG_DATA_EXIT_CODE, struct.pack("<L", 0)
+        )
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_client_inline_prefix_data_dropped(self):
+        target_client = self.run_service(
+            options=["--prefix-data=prefix"],
+            inline_data=b"prefix",
+            inline_data_sent=False,
+        )
+        self.client.stdin.close()
+        self.assertStdoutMessages(
+            target_client, b"prefix", qrexec.MSG_DATA_STDIN
+        )
+        self.assertEqual(
+            target_client.recv_message(), (qrexec.MSG_DATA_STDIN, b"")
+        )
+        target_client.send_message(qrexec.MSG_DATA_STDOUT, b"")
+        target_client.send_message(
+            qrexec.MSG_DATA_EXIT_CODE, struct.pack("<L", 0)
+        )
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
     def test_run_client_eof(self):
         remote, local = socket.socketpair()
         target_client = self.run_service(stdio=remote)
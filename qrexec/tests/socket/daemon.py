@@ -18,6 +18,7 @@
 # with this program; if not, see <http://www.gnu.org/licenses/>.
 
 import unittest
+import unittest.mock
 import subprocess
 import os.path
 import os
@@ -33,6 +34,8 @@ import psutil
 import pytest
 
 from . import qrexec
+from . import replay
+from ...tools import qrexec_daemon_stats
 from . import util
 
 ROOT_PATH = os.path.abspath(
@@ -54,6 +57,7 @@ class TestDaemon(unittest.TestCase):
 echo "$@" > {tempdir}/qrexec-policy-params
 
 sleep $(cat {tempdir}/qrexec-policy-sleep || echo 0)
+echo "$3" >> {tempdir}/qrexec-policy-finished
 exit_code=$(cat {tempdir}/qrexec-policy-exitcode || echo 1)
 
 # Prepare the response based on the exit code
@@ -174,6 +178,31 @@ exit $exit_code
         self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
         self.assertEqual(data, struct.pack("<32s", ident.encode()))
 
+    def test_trace_replay(self):
+        trace_path = os.path.join(self.tempdir, "qrexec.trace")
+        with unittest.mock.patch.dict(
+            os.environ, {"QREXEC_TRACE_FILE": trace_path}
+        ):
+            agent = self.start_daemon_with_agent()
+        agent.handshake()
+        # refused without calling the policy
+        self.send_trigger_service(agent, "target_domain", "qubes.Service", "")
+        message_type, _data = agent.recv_message()
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+        self.stop_daemon()
+        agent.close()
+
+        records = replay.read_trace(trace_path)
+        self.assertEqual(len(records), 1)
+        self.assertEqual(records[0].message_type, qrexec.MSG_TRIGGER_SERVICE3)
+        self.assertEqual(len(records[0].payload), records[0].length)
+
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        replay.replay(agent, records, speed=0)
+        message_type, _data = agent.recv_message()
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+
     def test_bad_request_id_1(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -226,7 +255,7 @@ exit $exit_code
         message_type, data = agent.recv_message()
         self.assertEqual(message_type, qrexec.MSG_HELLO)
         (ver,) = struct.unpack("<L", data)
-        self.assertEqual(ver, 3)
+        self.assertEqual(ver, qrexec.QREXEC_PROTOCOL_VERSION)
 
         target_domain_name = "target_domain"
         ident = b"ab"
@@ -253,7 +282,8 @@ exit $exit_code
         Test that qrexec-daemon rejects various invalid requests.
         """
         agent = self.start_daemon_with_agent()
-        agent.handshake()
+        # protocol version 4 agents can send data after the NUL terminator
+        agent.handshake(version=3)
 
         target_domain_name = "target_domain"
         ident = "ab"
@@ -287,6 +317,45 @@ exit $exit_code
             )
             recv_refused(agent)
 
+    def test_bad_inline_data_request(self):
+        """
+        Test that qrexec-daemon rejects invalid requests with inline data.
+        """
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        target_domain_name = "target_domain"
+        ident = "ab"
+
+        self.set_policy_params(1, 0)
+
+        def recv_refused(agent):
+            message_type, data = agent.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+            self.assertEqual(data, struct.pack("<32s", ident.encode()))
+            self.assertFalse(os.path.exists(
+                os.path.join(self.tempdir, "qrexec-policy-params")
+            )),
+
+        # missing NUL terminator
+        agent.send_message(
+            qrexec.MSG_TRIGGER_SERVICE3,
+            struct.pack("<64s32s", target_domain_name.encode(), ident.encode())
+            + b"a",
+        )
+        recv_refused(agent)
+
+        # empty service name with data, or data too long
+        for service_name, payload in (
+            ("", b"data"),
+            ("+a", b"data"),
+            ("a", b"x" * (qrexec.MAX_INLINE_PAYLOAD + 1)),
+        ):
+            self.send_trigger_service(
+                agent, target_domain_name, service_name, ident, payload
+            )
+            recv_refused(agent)
+
     def test_new_style_request(self):
         """
         Test that qrexec-daemon accepts request.
@@ -361,13 +430,19 @@ requested_target=anotherdomain
         ))
 
     def send_trigger_service(
-        self, agent, target_domain_name: str, service_name: str, ident: str
+        self,
+        agent,
+        target_domain_name: str,
+        service_name: str,
+        ident: str,
+        payload: bytes = b"",
     ):
         agent.send_message(
             qrexec.MSG_TRIGGER_SERVICE3,
             struct.pack("<64s32s", target_domain_name.encode(), ident.encode())
             + service_name.encode()
-            + b"\0",
+            + b"\0"
+            + payload,
         )
 
     def trigger_service(
@@ -465,6 +540,129 @@ requested_target=anotherdomain
 
         return port
 
+    def test_client_stats(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        self.set_policy_params(0, 1)
+        message_type, _data = self.trigger_service(
+            agent, "target_domain", "qubes.ServiceName", "SOCKET1"
+        )
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+        self.client_exec(self.domain + 1)
+
+        stats = qrexec_daemon_stats.get_stats(
+            os.path.join(self.tempdir, "qrexec.{}".format(self.domain))
+        )
+        self.assertEqual(stats.domain_id, self.domain)
+        self.assertEqual(stats.service_calls, 1)
+        self.assertEqual(stats.service_allowed, 0)
+        self.assertEqual(stats.service_refused, 1)
+        self.assertEqual(stats.policy_pending, 0)
+        self.assertEqual(stats.ports_in_use, 1)
+        # the exec client, and the stats one
+        self.assertEqual(stats.client_connections, 2)
+        self.assertEqual(sum(stats.policy_latency), 1)
+
+    def count_finished_policy_calls(self):
+        try:
+            with open(
+                os.path.join(self.tempdir, "qrexec-policy-finished")
+            ) as f:
+                return len(f.readlines())
+        except FileNotFoundError:
+            return 0
+
+    def test_trigger_service_cancel(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        ident = "SOCKET12"
+        self.set_policy_params(5, 0)
+        self.send_trigger_service(agent, "target_domain", "qubes.Service", ident)
+        self.wait_for_policy_program_call()
+
+        start = time.monotonic()
+        agent.send_message(
+            qrexec.MSG_SERVICE_CANCEL, struct.pack("<32s", ident.encode())
+        )
+        # refused without waiting for the policy
+        self.assertEqual(
+            agent.recv_message(),
+            (qrexec.MSG_SERVICE_REFUSED, struct.pack("<32s", ident.encode())),
+        )
+        self.assertLess(time.monotonic() - start, 4)
+        self.assertEqual(self.count_finished_policy_calls(), 0)
+
+        stats = qrexec_daemon_stats.get_stats(
+            os.path.join(self.tempdir, "qrexec.{}".format(self.domain))
+        )
+        self.assertEqual(stats.service_calls, 1)
+        self.assertEqual(stats.service_cancelled, 1)
+        self.assertEqual(stats.service_refused, 1)
+        self.assertEqual(stats.policy_pending, 0)
+
+    def test_trigger_service_cancel_answered(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        ident = "SOCKET13"
+        self.set_policy_params(0, 1)
+        message_type, _data = self.trigger_service(
+            agent, "target_domain", "qubes.Service", ident
+        )
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+
+        # the answer crossed the cancel message, which is ignored
+        agent.send_message(
+            qrexec.MSG_SERVICE_CANCEL, struct.pack("<32s", ident.encode())
+        )
+        stats = qrexec_daemon_stats.get_stats(
+            os.path.join(self.tempdir, "qrexec.{}".format(self.domain))
+        )
+        self.assertEqual(stats.service_cancelled, 0)
+        self.assertEqual(stats.service_refused, 1)
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_trigger_service_cancel_benchmark(self):
+        """Callers giving up while the policy is slow, for example waiting for
+        the user or for a disposable to start"""
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        self.set_policy_params(2, 0)
+
+        count = 50
+        idents = ["SOCKET{}".format(i) for i in range(count)]
+        for ident in idents:
+            self.send_trigger_service(
+                agent, "target_domain", "qubes.Service", ident
+            )
+        self.wait_for_policy_program_call()
+        # half of the callers time out
+        for ident in idents[::2]:
+            agent.send_message(
+                qrexec.MSG_SERVICE_CANCEL, struct.pack("<32s", ident.encode())
+            )
+
+        answered = set()
+        while len(answered) < count:
+            message_type, data = agent.recv_message()
+            if message_type == qrexec.MSG_SERVICE_REFUSED:
+                answered.add(data.rstrip(b"\0").decode())
+        self.wait_for_daemon_children()
+        stats = qrexec_daemon_stats.get_stats(
+            os.path.join(self.tempdir, "qrexec.{}".format(self.domain))
+        )
+        print(
+            "{} calls, {} cancelled, policy evaluations run to completion: "
+            "{}".format(
+                count, stats.service_cancelled, self.count_finished_policy_calls()
+            )
+        )
+        self.assertEqual(stats.service_cancelled, count // 2)
+
     def test_client_exec_allocates_next_port(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -602,6 +800,106 @@ requested_target=anotherdomain
         self.daemon.terminate()
         self.assertEqual(agent.recv_all_messages(), [])
 
+    def connect_target_daemon(self, target_domain_name):
+        target_daemon = qrexec.socket_server(
+            os.path.join(self.tempdir, "qrexec.{}".format(target_domain_name))
+        )
+        self.addCleanup(target_daemon.close)
+        return target_daemon
+
+    def vm_to_vm_call(self, agent, target_domain_name, ident, payload=b""):
+        target_domain = self.domain + 1
+        target_port = 513
+
+        target_daemon = self.connect_target_daemon(target_domain_name)
+        self.send_trigger_service(
+            agent, target_domain_name, "qubes.Service", ident, payload
+        )
+
+        # negotiate_connection_params with the target daemon
+        target_daemon.accept()
+        target_daemon.handshake()
+        self.assertEqual(
+            target_daemon.recv_message(),
+            (
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack("<LL", self.domain, 0)
+                + b"toto:QUBESRPC qubes.Service+ "
+                + self.domain_name.encode()
+                + b"\0"
+                + payload,
+            ),
+        )
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack("<LL", target_domain, target_port),
+        )
+
+        # send_service_connect, over the link to the source daemon
+        self.assertEqual(
+            agent.recv_message(),
+            (
+                qrexec.MSG_SERVICE_CONNECT,
+                struct.pack(
+                    "<LL32s", target_domain, target_port, ident.encode()
+                ),
+            ),
+        )
+        target_daemon.close()
+
+    def test_vm_to_vm_call_uses_daemon_link(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        # The service request child must not need the daemon socket to
+        # report the established connection back.
+        daemon_socket_path = os.path.join(
+            self.tempdir, "qrexec.{}".format(self.domain)
+        )
+        util.wait_until(
+            lambda: os.path.exists(daemon_socket_path),
+            "qrexec-daemon socket not created",
+        )
+        os.unlink(daemon_socket_path)
+
+        self.set_policy_params(0, 0)
+        self.vm_to_vm_call(agent, "target_domain", "SOCKET11")
+        self.vm_to_vm_call(agent, "target_domain", "SOCKET12")
+
+    def test_vm_to_vm_call_inline_data(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        self.set_policy_params(0, 0)
+
+        self.vm_to_vm_call(agent, "target_domain", "SOCKET11", b"data\0")
+        self.vm_to_vm_call(
+            agent,
+            "target_domain",
+            "SOCKET12",
+            b"x" * qrexec.MAX_INLINE_PAYLOAD,
+        )
+
+    @unittest.skipUnless(
+        os.environ.get("QREXEC_BENCHMARK"), "benchmarks not requested"
+    )
+    def test_vm_to_vm_call_setup_latency(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        self.set_policy_params(0, 0)
+
+        timings = []
+        for i in range(100):
+            start = time.perf_counter()
+            self.vm_to_vm_call(agent, "target_domain", "SOCKET{}".format(i))
+            timings.append(time.perf_counter() - start)
+        timings.sort()
+        print(
+            "VM-to-VM call setup: median {:.3f} ms, p90 {:.3f} ms".format(
+                timings[len(timings) // 2] * 1000,
+                timings[len(timings) * 9 // 10] * 1000,
+            )
+        )
+
 
 @unittest.skipIf(os.environ.get("SKIP_SOCKET_TESTS"), "socket tests not set up")
 class TestClient(unittest.TestCase):
@@ -893,6 +1191,24 @@ echo "arg: $1, remote domain: $QREXEC_REMOTE_DOMAIN, input: $input"
     def test_exec_service_with_invalid_config_6(self):
         self.exec_service_with_invalid_config(None)
 
+    def test_exec_service_with_invalid_config_7(self):
+        self.exec_service_with_invalid_config("max-instances = 257\n")
+
+    def test_exec_service_with_invalid_config_8(self):
+        self.exec_service_with_invalid_config("max-queued = true\n")
+
+    def test_exec_service_with_invalid_config_9(self):
+        self.exec_service_with_invalid_config("cpu-weight = 0\n")
+
+    def test_exec_service_with_invalid_config_10(self):
+        self.exec_service_with_invalid_config("io-weight = 10001\n")
+
+    def test_exec_service_with_invalid_config_11(self):
+        self.exec_service_with_invalid_config("memory-high = 0\n")
+
+    def test_exec_service_with_invalid_config_12(self):
+        self.exec_service_with_invalid_config("connect-timeout = 0\n")
+
     def _test_run_dom0_service_exec(self, nogui):
         util.make_executable_service(
             self.tempdir,
@@ -35,8 +35,18 @@ MSG_SERVICE_REFUSED = 0x203
 MSG_TRIGGER_SERVICE = 0x210
 MSG_CONNECTION_TERMINATED = 0x211
 MSG_TRIGGER_SERVICE3 = 0x212
+MSG_SERVICE_CANCEL = 0x213
 MSG_HELLO = 0x300
-QREXEC_PROTOCOL_VERSION = 3
+MSG_STATS = 0x301
+QREXEC_PROTOCOL_VERSION = 5
+MAX_INLINE_PAYLOAD = 1024
+# See struct qrexec_tcp_mux_header in libqrexec-utils.h
+TCP_MUX_OPEN = 1
+TCP_MUX_DATA = 2
+TCP_MUX_EOF = 3
+TCP_MUX_CLOSE = 4
+TCP_MUX_CREDIT = 5
+
 QREXEC_EXIT_PROBLEM = 125
 QREXEC_EXIT_REQUEST_REFUSED = 126
 QREXEC_EXIT_SERVICE_NOT_FOUND = 127
@@ -93,8 +103,8 @@ class QrexecClient:
             messages.append((message_type, data))
         return messages
 
-    def handshake(self):
-        self.send_message(MSG_HELLO, struct.pack("<L", QREXEC_PROTOCOL_VERSION))
+    def handshake(self, version=QREXEC_PROTOCOL_VERSION):
+        self.send_message(MSG_HELLO, struct.pack("<L", version))
         message_type, data = self.recv_message()
         assert message_type == MSG_HELLO
         (ver,) = struct.unpack("<L", data)
@@ -120,6 +130,46 @@ class QrexecServer(QrexecClient):
     def shutdown(self, arg):
         self.conn.shutdown(arg)
 
+def tcp_mux_frame(frame_type, conn_id, data=b""):
+    return struct.pack("<LLL", frame_type, conn_id, len(data)) + data
+
+
+class TcpMuxReader:
+    """Parse frames of a /dev/tcp-mux service from its stdout"""
+
+    def __init__(self, target):
+        self.target = target
+        self.buffer = b""
+        # the service has no stderr, its EOF may come at any time
+        self.skipped = []
+
+    def recv_frame(self):
+        while True:
+            if len(self.buffer) >= 12:
+                frame_type, conn_id, length = struct.unpack(
+                    "<LLL", self.buffer[:12]
+                )
+                if len(self.buffer) >= 12 + length:
+                    data = self.buffer[12 : 12 + length]
+                    self.buffer = self.buffer[12 + length :]
+                    return frame_type, conn_id, data
+            msg_type, data = self.target.recv_message()
+            if (msg_type, data) == (MSG_DATA_STDERR, b""):
+                self.skipped.append((msg_type, data))
+                continue
+            if msg_type != MSG_DATA_STDOUT or not data:
+                raise ValueError(
+                    "unexpected message {:#x} {!r}".format(msg_type, data)
+                )
+            self.buffer += data
+
+    def recv_all_messages(self):
+        """The remaining messages, with those skipped by recv_frame()"""
+        assert not self.buffer, "unread frames"
+        messages, self.skipped = self.skipped, []
+        return messages + self.target.recv_all_messages()
+
+
 def vchan_client(socket_dir, domain, remote_domain, port):
     vchan_socket_path = os.path.join(
         socket_dir, "vchan.{}.{}.{}.sock".format(domain, remote_domain, port)
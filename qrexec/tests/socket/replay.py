@@ -0,0 +1,226 @@
+# -*- encoding: utf-8 -*-
+#
+# The Qubes OS Project, http://www.qubes-os.org
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License along
+# with this program; if not, see <http://www.gnu.org/licenses/>.
+
+"""
+Replay of control vchan traces, for load testing qrexec-daemon and
+qrexec-agent built with the vchan-socket backend.
+
+A trace is recorded by running the daemon or agent with QREXEC_TRACE_FILE set
+(see libqrexec/trace.c).  This driver then plays the part of the agent (for
+a daemon) or of the daemon (for an agent), and sends the traced messages at
+their original pace, or faster with --speed.  Running the target with
+QREXEC_TRACE_FILE set again records how long it took to handle each of the
+replayed messages, which --summary prints per message type:
+
+    QREXEC_TRACE_FILE=replayed.trace python3 -m qrexec.tests.socket.replay \\
+        --target=daemon --socket-dir=DIR --domain=42 --speed=10 \\
+        recorded.trace -- daemon/qrexec-daemon --direct ... 42 vm-name
+    python3 -m qrexec.tests.socket.replay --summary replayed.trace
+
+Payloads of traces recorded with QREXEC_TRACE_REDACT=1 are replayed as zero
+bytes of the original length.  The target rejects such messages, so they only
+exercise the message intake and validation.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import threading
+import time
+from typing import List, NamedTuple, Optional
+
+from . import qrexec
+
+
+class TraceRecord(NamedTuple):
+    offset_ns: int
+    handle_ns: int
+    message_type: int
+    length: int
+    # None if redacted
+    payload: Optional[bytes]
+
+    def data(self) -> bytes:
+        if self.payload is None:
+            return bytes(self.length)
+        return self.payload
+
+
+MESSAGE_NAMES = {
+    value: name
+    for name, value in vars(qrexec).items()
+    if name.startswith("MSG_")
+}
+
+
+def read_trace(path: str) -> List[TraceRecord]:
+    records = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            fields = line.split()
+            if len(fields) not in (4, 5):
+                raise ValueError("invalid trace line: {!r}".format(line))
+            if len(fields) == 4:
+                payload = b""
+            elif fields[4] == "-":
+                payload = None
+            else:
+                payload = bytes.fromhex(fields[4])
+            records.append(
+                TraceRecord(
+                    offset_ns=int(fields[0]),
+                    handle_ns=int(fields[1]),
+                    message_type=int(fields[2], 16),
+                    length=int(fields[3]),
+                    payload=payload,
+                )
+            )
+    return records
+
+
+def replay(conn, records: List[TraceRecord], speed: float = 1.0) -> List[float]:
+    """
+    Send the messages from records over conn, keeping the recorded intervals
+    divided by speed (0 means as fast as possible).  Returns how late each
+    message was sent, in seconds, which grows when the target does not keep up.
+    """
+    lags = []
+    if not records:
+        return lags
+    start = time.monotonic()
+    first_ns = records[0].offset_ns
+    for record in records:
+        due = start
+        if speed > 0:
+            due += (record.offset_ns - first_ns) / 1e9 / speed
+            delay = due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+        lags.append(max(0.0, time.monotonic() - due))
+        conn.send_message(record.message_type, record.data())
+    return lags
+
+
+def drain(conn):
+    """Read and drop messages from the target, so it never blocks on us."""
+    def run():
+        try:
+            while conn.conn.recv(65536):
+                pass
+        except OSError:
+            pass
+
+    thread = threading.Thread(target=run, daemon=True)
+    thread.start()
+    return thread
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def print_summary(records: List[TraceRecord], out=sys.stdout):
+    by_type = {}
+    for record in records:
+        by_type.setdefault(record.message_type, []).append(record.handle_ns)
+    print("type\tcount\tmean_us\tp50_us\tp99_us\tmax_us", file=out)
+    for message_type, times in sorted(by_type.items()):
+        print(
+            "{}\t{}\t{:.1f}\t{:.1f}\t{:.1f}\t{:.1f}".format(
+                MESSAGE_NAMES.get(message_type, hex(message_type)),
+                len(times),
+                sum(times) / len(times) / 1000,
+                percentile(times, 0.5) / 1000,
+                percentile(times, 0.99) / 1000,
+                max(times) / 1000,
+            ),
+            file=out,
+        )
+
+
+def connect(target, socket_dir, domain, command):
+    env = os.environ.copy()
+    env["VCHAN_SOCKET_DIR"] = socket_dir
+    proc = None
+    if target == "daemon":
+        # we are the agent, the daemon connects to us
+        env["VCHAN_DOMAIN"] = "0"
+        conn = qrexec.vchan_server(socket_dir, domain, 0, 512)
+        if command:
+            proc = subprocess.Popen(command, env=env)
+        conn.accept()
+    else:
+        # we are the daemon, connecting to the agent
+        env["VCHAN_DOMAIN"] = str(domain)
+        if command:
+            proc = subprocess.Popen(command, env=env)
+        conn = qrexec.vchan_client(socket_dir, domain, 0, 512)
+    conn.handshake()
+    return conn, proc
+
+
+def main(args=None):
+    parser = argparse.ArgumentParser(
+        description="Replay a qrexec control vchan trace"
+    )
+    parser.add_argument("--summary", action="store_true",
+                        help="print handling times from the trace and exit")
+    parser.add_argument("--target", choices=("daemon", "agent"),
+                        default="daemon")
+    parser.add_argument("--socket-dir", default=".",
+                        help="VCHAN_SOCKET_DIR of the target")
+    parser.add_argument("--domain", type=int, default=42,
+                        help="domain ID of the agent")
+    parser.add_argument("--speed", type=float, default=1.0,
+                        help="replay speed factor, 0 for as fast as possible")
+    parser.add_argument("--wait", type=float, default=1.0,
+                        help="seconds to give the target to handle the last "
+                        "messages before disconnecting")
+    parser.add_argument("trace")
+    parser.add_argument("command", nargs=argparse.REMAINDER,
+                        help="command starting the target, after --")
+    args = parser.parse_args(args)
+
+    records = read_trace(args.trace)
+    if args.summary:
+        print_summary(records)
+        return 0
+
+    command = args.command
+    if command and command[0] == "--":
+        command = command[1:]
+    conn, proc = connect(args.target, args.socket_dir, args.domain, command)
+    drain(conn)
+    lags = replay(conn, records, args.speed)
+    time.sleep(args.wait)
+    conn.close()
+    if proc:
+        proc.terminate()
+        proc.wait()
+    if lags:
+        print("messages\t{}".format(len(lags)))
+        print("lag_p50_us\t{:.1f}".format(percentile(lags, 0.5) * 1e6))
+        print("lag_max_us\t{:.1f}".format(max(lags) * 1e6))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
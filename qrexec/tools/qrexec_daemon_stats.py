@@ -0,0 +1,204 @@
+#
+# The Qubes OS Project, https://www.qubes-os.org/
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, see <https://www.gnu.org/licenses/>.
+#
+
+"""qrexec-daemon-stats -- show statistics of the running qrexec-daemons
+
+Every qrexec-daemon (one per running qube) answers MSG_STATS on its socket
+with call counters and a histogram of policy latencies, see
+struct qrexec_daemon_stats in libqrexec/qrexec.h.
+"""
+
+import argparse
+import os
+import socket
+import struct
+import sys
+from typing import List, NamedTuple, Optional
+
+# See libqrexec/qrexec.h
+MSG_HELLO = 0x300
+MSG_STATS = 0x301
+QREXEC_PROTOCOL_VERSION = 5
+QREXEC_DAEMON_SOCKET_DIR = "/var/run/qubes"
+QREXEC_STATS_LATENCY_BUCKETS = 24
+
+_HEADER = struct.Struct("<LL")
+_STATS = struct.Struct("<4L6Q{}Q".format(QREXEC_STATS_LATENCY_BUCKETS))
+
+
+class DaemonStats(NamedTuple):
+    domain_id: int
+    ports_in_use: int
+    clients: int
+    policy_pending: int
+    service_calls: int
+    service_allowed: int
+    service_refused: int
+    service_cancelled: int
+    client_connections: int
+    policy_time_us: int
+    policy_latency: List[int]
+
+    @classmethod
+    def unpack(cls, data: bytes) -> "DaemonStats":
+        fields = _STATS.unpack(data)
+        return cls(*fields[:10], policy_latency=list(fields[10:]))
+
+    def policy_latency_percentile_us(self, fraction: float) -> Optional[int]:
+        """Upper bound of the given latency percentile, None if unknown"""
+        total = sum(self.policy_latency)
+        if not total:
+            return None
+        seen = 0
+        for bucket, count in enumerate(self.policy_latency):
+            seen += count
+            if seen >= total * fraction:
+                return 1 << bucket
+        return 1 << (QREXEC_STATS_LATENCY_BUCKETS - 1)
+
+
+def _recvall(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("qrexec-daemon closed the connection")
+        data += chunk
+    return data
+
+
+def _recv_message(sock):
+    message_type, length = _HEADER.unpack(_recvall(sock, _HEADER.size))
+    return message_type, _recvall(sock, length)
+
+
+def get_stats(socket_path: str) -> DaemonStats:
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(socket_path)
+        message_type, _data = _recv_message(sock)
+        if message_type != MSG_HELLO:
+            raise ConnectionError("unexpected message 0x{:x}".format(message_type))
+        sock.sendall(
+            _HEADER.pack(MSG_HELLO, 4)
+            + struct.pack("<L", QREXEC_PROTOCOL_VERSION)
+            + _HEADER.pack(MSG_STATS, 0)
+        )
+        message_type, data = _recv_message(sock)
+        if message_type != MSG_STATS or len(data) != _STATS.size:
+            raise ConnectionError(
+                "invalid stats reply: type 0x{:x}, {} bytes".format(
+                    message_type, len(data)
+                )
+            )
+    return DaemonStats.unpack(data)
+
+
+def find_daemons(socket_dir: str):
+    """Names of the qubes with a running qrexec-daemon"""
+    for entry in sorted(os.listdir(socket_dir)):
+        if not entry.startswith("qrexec.") or entry[len("qrexec.") :].isdigit():
+            continue
+        # qrexec.<name> is a symlink to the qrexec.<domid> socket
+        if os.path.islink(os.path.join(socket_dir, entry)):
+            yield entry[len("qrexec.") :]
+
+
+def _format_us(value: Optional[int]) -> str:
+    if value is None:
+        return "-"
+    return "{:.1f}".format(value / 1000)
+
+
+parser = argparse.ArgumentParser(
+    description="Show statistics of the running qrexec-daemons, the busiest "
+    "qubes first"
+)
+parser.add_argument(
+    "--socket-dir",
+    default=QREXEC_DAEMON_SOCKET_DIR,
+    help="directory of the qrexec-daemon sockets",
+)
+parser.add_argument(
+    "--histogram",
+    action="store_true",
+    help="also print the policy latency histograms",
+)
+parser.add_argument(
+    "names",
+    metavar="QUBE",
+    nargs="*",
+    help="qubes to show, all with a running daemon by default",
+)
+
+
+def main(args=None):
+    args = parser.parse_args(args)
+
+    names = args.names or list(find_daemons(args.socket_dir))
+    results = []
+    exit_code = 0
+    for name in names:
+        try:
+            results.append(
+                (name, get_stats(os.path.join(args.socket_dir, "qrexec." + name)))
+            )
+        except OSError as e:
+            print("{}: {}".format(name, e), file=sys.stderr)
+            exit_code = 1
+
+    results.sort(key=lambda item: item[1].service_calls, reverse=True)
+    print(
+        "qube\tcalls\tallowed\trefused\tcancelled\tpending\tports\tclients\t"
+        "policy_mean_ms\tpolicy_p50_ms\tpolicy_p99_ms"
+    )
+    for name, stats in results:
+        responses = sum(stats.policy_latency)
+        print(
+            "\t".join(
+                (
+                    name,
+                    str(stats.service_calls),
+                    str(stats.service_allowed),
+                    str(stats.service_refused),
+                    str(stats.service_cancelled),
+                    str(stats.policy_pending),
+                    str(stats.ports_in_use),
+                    str(stats.clients),
+                    _format_us(
+                        stats.policy_time_us // responses if responses else None
+                    ),
+                    _format_us(stats.policy_latency_percentile_us(0.5)),
+                    _format_us(stats.policy_latency_percentile_us(0.99)),
+                )
+            )
+        )
+    if args.histogram:
+        for name, stats in results:
+            print("\n{}: policy latency".format(name))
+            for bucket, count in enumerate(stats.policy_latency):
+                if not count:
+                    continue
+                if bucket == QREXEC_STATS_LATENCY_BUCKETS - 1:
+                    label = ">= {} ms".format(_format_us(1 << (bucket - 1)))
+                else:
+                    label = "< {} ms".format(_format_us(1 << bucket))
+                print("  {}\t{}".format(label, count))
+    return exit_code
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -28,6 +28,9 @@ import os
 from ..utils import sanitize_domain_name, get_system_info
 from .qrexec_policy_exec import handle_request
 from .. import POLICYPATH, POLICYSOCKET, POLICY_EVAL_SOCKET, POLICY_GUI_SOCKET
+from .. import RPCNAME_ALLOWED_CHARSET
+from ..policy.admin import PolicyAdmin, PolicyAdminException
+from ..policy.audit import AuditHandler
 from ..policy.utils import PolicyCache
 
 argparser = argparse.ArgumentParser(description="Evaluate qrexec policy daemon")
@@ -65,12 +68,101 @@ REQUIRED_REQUEST_ARGUMENTS = (
 
 OPTIONAL_REQUEST_ARGUMENTS = ("assume_yes_for_ask", "just_evaluate")
 
+# "cancellable=yes": the caller closes the connection to abandon the request,
+# which stops the evaluation (and for example an ask prompt) early
+CANCELLABLE_REQUEST_ARGUMENT = "cancellable"
+
+# "stats=yes" alone requests the per-rule statistics instead of an evaluation
+STATS_REQUEST_ARGUMENT = "stats"
+
+# "admin_method=policy.GetFiles" and "admin_arg=..." alone call a read-only
+# policy admin method on the parsed policy (see PolicyAdmin); the response is
+# "result=ok" or "result=error", a newline, and the method output or the error
+ADMIN_REQUEST_ARGUMENTS = ("admin_method", "admin_arg")
+
 ALLOWED_REQUEST_ARGUMENTS = (
-    REQUIRED_REQUEST_ARGUMENTS + OPTIONAL_REQUEST_ARGUMENTS
+    REQUIRED_REQUEST_ARGUMENTS
+    + OPTIONAL_REQUEST_ARGUMENTS
+    + (STATS_REQUEST_ARGUMENT, CANCELLABLE_REQUEST_ARGUMENT)
+    + ADMIN_REQUEST_ARGUMENTS
 )
 
 
-async def handle_client_connection(log, policy_cache, reader, writer):
+class RequestCancelled(Exception):
+    """The caller closed the connection before the request was handled"""
+
+
+async def await_unless_closed(reader, coro):
+    """Await coro, but cancel it when the caller closes the connection (or
+    sends anything more) first"""
+    request = asyncio.ensure_future(coro)
+    closed = asyncio.ensure_future(reader.read(1))
+    try:
+        await asyncio.wait(
+            (request, closed), return_when=asyncio.FIRST_COMPLETED
+        )
+        if not request.done():
+            raise RequestCancelled()
+        return request.result()
+    finally:
+        request.cancel()
+        closed.cancel()
+
+
+def format_rule_stats(policy):
+    """Per-rule statistics, a line per rule and one for unmatched requests"""
+    lines = ["# file:line\tevaluations\tmatches\tmatch_time_us\trule"]
+    for rule, evaluations in policy.get_rule_stats():
+        lines.append(
+            "{}:{}\t{}\t{}\t{:.1f}\t{}".format(
+                rule.filepath,
+                rule.lineno,
+                evaluations,
+                rule.matches,
+                rule.match_time_ns / 1000,
+                " ".join(
+                    (
+                        rule.service or "*",
+                        rule.argument or "*",
+                        str(rule.source),
+                        str(rule.target),
+                        str(rule.action),
+                    )
+                ),
+            )
+        )
+    lines.append(
+        "-\t{}\t{}\t{:.1f}\t(no matching rule)".format(
+            policy.unmatched,
+            policy.unmatched,
+            policy.unmatched_time_ns / 1000,
+        )
+    )
+    return "".join(line + "\n" for line in lines)
+
+
+def handle_admin_request(log, policy_admin, service_name, arg):
+    func = policy_admin.find_method(service_name)
+    if func is None or not func.api_parsed_policy:
+        return b"result=error\nnot available in the policy daemon: " + (
+            service_name.encode("ascii", "replace")
+        )
+    if arg and not all(char in RPCNAME_ALLOWED_CHARSET for char in arg):
+        return b"result=error\ninvalid argument"
+    try:
+        return b"result=ok\n" + (
+            policy_admin.handle_request(service_name, arg, b"") or b""
+        )
+    except PolicyAdminException as exc:
+        return b"result=error\n" + str(exc).encode("utf-8")
+    except Exception:  # pylint: disable=broad-except
+        log.exception("error handling %s+%s", service_name, arg)
+        return b"result=error\ninternal error"
+
+
+async def handle_client_connection(
+    log, policy_cache, reader, writer, policy_admin=None
+):
 
     args = {}
 
@@ -97,7 +189,12 @@ async def handle_client_connection(log, policy_cache, reader, writer):
                 )
                 return
 
-            if argument in ("assume_yes_for_ask", "just_evaluate"):
+            if argument in (
+                "assume_yes_for_ask",
+                "just_evaluate",
+                STATS_REQUEST_ARGUMENT,
+                CANCELLABLE_REQUEST_ARGUMENT,
+            ):
                 if value == "yes":
                     value = True
                 elif value == "no":
@@ -111,13 +208,62 @@ async def handle_client_connection(log, policy_cache, reader, writer):
 
             args[argument] = value
 
+        if STATS_REQUEST_ARGUMENT in args:
+            if len(args) > 1:
+                log.error(
+                    "error parsing policy request: "
+                    "stats cannot be combined with other arguments"
+                )
+                return
+            if args[STATS_REQUEST_ARGUMENT]:
+                writer.write(
+                    format_rule_stats(policy_cache.get_policy()).encode(
+                        "utf-8", "strict"
+                    )
+                )
+                await writer.drain()
+            return
+
+        if "admin_method" in args:
+            if set(args) - set(ADMIN_REQUEST_ARGUMENTS):
+                log.error(
+                    "error parsing policy request: "
+                    "admin_method cannot be combined with other arguments"
+                )
+                return
+            if policy_admin is None:
+                policy_admin = PolicyAdmin(
+                    pathlib.Path(policy_cache.path), policy_cache=policy_cache
+                )
+            writer.write(
+                handle_admin_request(
+                    log,
+                    policy_admin,
+                    args["admin_method"],
+                    args.get("admin_arg", ""),
+                )
+            )
+            await writer.drain()
+            return
+
         if not all(arg in args for arg in REQUIRED_REQUEST_ARGUMENTS):
             log.error("error parsing policy request: required argument missing")
             return
 
-        result = await handle_request(
-            **args, log=log, policy_cache=policy_cache
-        )
+        cancellable = args.pop(CANCELLABLE_REQUEST_ARGUMENT, False)
+        request = handle_request(**args, log=log, policy_cache=policy_cache)
+        if cancellable:
+            try:
+                result = await await_unless_closed(reader, request)
+            except RequestCancelled:
+                log.info(
+                    "%s: request for %s cancelled by the caller",
+                    args["source"],
+                    args["service_and_arg"],
+                )
+                return
+        else:
+            result = await request
 
         writer.write(result.encode("ascii", "strict") if result else b"result=deny\n")
         await writer.drain()
@@ -295,16 +441,29 @@ async def start_serving(args=None):
     logging.basicConfig(format="%(message)s")
     log = logging.getLogger("policy")
     log.setLevel(logging.INFO)
+    # every decision is logged, do not make the requests wait for the log
+    audit_handler = AuditHandler(logging.getLogger().handlers)
+    log.addHandler(audit_handler)
+    log.propagate = False
+    audit_handler.start()
 
     for i in (args.eval_socket_path, args.gui_socket_path, args.socket_path):
         try:
             os.unlink(i)
         except FileNotFoundError:
             pass
-    policy_cache = PolicyCache(args.policy_path)
+    policy_cache = PolicyCache(
+        args.policy_path, collect_stats=True, compact=True
+    )
     policy_cache.initialize_watcher()
+    policy_admin = PolicyAdmin(args.policy_path, policy_cache=policy_cache)
     policy_server = await asyncio.start_unix_server(
-        functools.partial(handle_client_connection, log, policy_cache),
+        functools.partial(
+            handle_client_connection,
+            log,
+            policy_cache,
+            policy_admin=policy_admin,
+        ),
         path=args.socket_path,
     )
 
@@ -32,7 +32,13 @@ from .. import exc
 from .. import utils
 from ..policy import parser
 from ..policy.utils import PolicyCache
-from ..server import call_socket_service
+
+
+async def call_socket_service(*args, **kwds):
+    # imported on first use, most requests do not need to contact a GUI VM
+    from ..server import call_socket_service as _call_socket_service
+
+    return await _call_socket_service(*args, **kwds)
 
 
 def create_default_policy(service_name):
@@ -24,14 +24,16 @@
 import argparse
 import sys
 import os
+import socket
 import subprocess
 
 from ..policy.admin_client import PolicyClient
-from .. import RPCNAME_ALLOWED_CHARSET
+from ..policy.parser import FilePolicy
+from .. import RPCNAME_ALLOWED_CHARSET, POLICYSOCKET
 from ..client import VERSION
 
 parser = argparse.ArgumentParser(
-    usage="qubes-policy {[-l]|-g|-r|-d} [include/][RPCNAME[+ARGUMENT]]"
+    usage="qubes-policy {[-l]|-g|-r|-d|-s|-S} [include/][RPCNAME[+ARGUMENT]]"
 )
 
 parser.add_argument(
@@ -70,6 +72,26 @@ parser.add_argument(
     help="remove a policy file",
 )
 
+parser.add_argument(
+    "-s",
+    "--stats",
+    dest="method",
+    action="store_const",
+    const="stats",
+    help="show how often each policy rule was evaluated and matched by"
+    " qrexec-policy-daemon since the policy was last loaded (dom0 only)",
+)
+
+parser.add_argument(
+    "-S",
+    "--shadowed",
+    dest="method",
+    action="store_const",
+    const="shadowed",
+    help="list policy rules that never match because an earlier rule"
+    " matches every request they do (dom0 only)",
+)
+
 parser.add_argument(
     "name",
     metavar="[include/][name]",
@@ -81,6 +103,33 @@ parser.add_argument(
 parser.set_defaults(method="list", name="")
 
 
+def get_stats(socket_path=POLICYSOCKET):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(str(socket_path))
+        sock.sendall(b"stats=yes\n\n")
+        sock.shutdown(socket.SHUT_WR)
+        data = []
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data.append(chunk)
+    return b"".join(data).decode("utf-8", "strict")
+
+
+def print_shadowed(policy):
+    for item in policy.find_shadowed_rules():
+        print(
+            "{}:{}: {} by {}:{}".format(
+                item.rule.filepath,
+                item.rule.lineno,
+                "duplicate" if item.duplicate else "shadowed",
+                item.shadowed_by.filepath,
+                item.shadowed_by.lineno,
+            )
+        )
+
+
 def run_method(method, name, client, is_include):
     if method == "list":
         if is_include:
@@ -120,6 +169,21 @@ def main(args=None):
         print("You need to run as root in dom0")
         sys.exit(1)
 
+    if args.method in ("stats", "shadowed"):
+        if args.name:
+            parser.error("--{} doesn't work with a file name".format(args.method))
+        if VERSION != "dom0":
+            parser.error("--{} is only available in dom0".format(args.method))
+        if args.method == "shadowed":
+            print_shadowed(FilePolicy())
+            return
+        try:
+            print(get_stats(), end="")
+        except OSError as e:
+            print("Cannot get statistics from qrexec-policy-daemon: {}".format(e))
+            sys.exit(1)
+        return
+
     client = PolicyClient()
     name = args.name
 
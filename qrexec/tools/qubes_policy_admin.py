@@ -24,11 +24,40 @@ qubes-policy-admin - a QubesRPC script for policy API
 """
 
 import os
+import socket
 import sys
 import logging
 
 from ..policy.admin import PolicyAdmin, PolicyAdminException
-from .. import POLICYPATH
+from .. import POLICYPATH, POLICYSOCKET
+
+
+def query_policy_daemon(service_name, argument, socket_path=POLICYSOCKET):
+    """Call a parsed_policy method in qrexec-policy-daemon, which has the
+    policy parsed already.  Returns None if the daemon is not available,
+    raises PolicyAdminException if the method failed."""
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+            sock.connect(str(socket_path))
+            sock.sendall(
+                "admin_method={}\nadmin_arg={}\n\n".format(
+                    service_name, argument
+                ).encode("ascii")
+            )
+            data = []
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data.append(chunk)
+    except OSError:
+        return None
+    result, _, response = b"".join(data).partition(b"\n")
+    if result == b"result=ok":
+        return response
+    if result == b"result=error":
+        raise PolicyAdminException(response.decode("utf-8", "replace"))
+    return None
 
 
 def main():
@@ -50,7 +79,12 @@ def main():
 
     admin = PolicyAdmin(POLICYPATH)
     try:
-        response = admin.handle_request(service_name, argument, payload)
+        response = None
+        func = admin.find_method(service_name)
+        if func is not None and func.api_parsed_policy and not payload:
+            response = query_policy_daemon(service_name, argument)
+        if response is None:
+            response = admin.handle_request(service_name, argument, payload)
     except PolicyAdminException as exc:
         logging.warning(
             "%s+%s (%s): error: %s", service_name, argument, source, exc
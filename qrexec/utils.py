@@ -21,7 +21,9 @@
 import json
 import socket
 import subprocess
-from typing import Set, Optional, TypedDict, List, Dict, cast, TYPE_CHECKING
+from typing import (
+    Set, Optional, TypedDict, List, Dict, Tuple, cast, TYPE_CHECKING
+)
 if TYPE_CHECKING:
     from typing import TypeAlias
 
@@ -121,6 +123,8 @@ SystemInfo: 'TypeAlias' = Dict[str, SystemInfoEntry]
 class FullSystemInfo(TypedDict):
     domains: SystemInfo
 
+_last_system_info: Optional[Tuple[bytes, FullSystemInfo]] = None
+
 def get_system_info() -> FullSystemInfo:
     """Get system information
 
@@ -135,8 +139,17 @@ def get_system_info() -> FullSystemInfo:
           - default_dispvm: name of default AppVM for DispVMs started from here
     """
 
+    global _last_system_info  # pylint: disable=global-statement
+
     system_info = qubesd_call("dom0", "internal.GetSystemInfo")
-    return cast(SystemInfo, json.loads(system_info.decode("utf-8")))
+    # Return the same object while the system does not change, which is
+    # what caches derived from it (see AbstractPolicy.ask_targets_cache)
+    # use to tell whether they are still valid.  Do not modify it.
+    if _last_system_info is not None and _last_system_info[0] == system_info:
+        return _last_system_info[1]
+    parsed = cast(FullSystemInfo, json.loads(system_info.decode("utf-8")))
+    _last_system_info = (system_info, parsed)
+    return parsed
 
 
 def prepare_subprocess_kwds(input: object) -> Dict[str, object]: